@@ -0,0 +1,511 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <set>
+#include <functional>
+#include <random>
+#include <algorithm>
+#include <cmath>
+
+#include <zlib.h>
+
+#include "TStopwatch.h"
+#include "TBufferFile.h"
+#include "TClass.h"
+
+#include "CaenEvent.hh"
+#include "CaenSorter.hh"
+#include "CaenParser.hh"
+#include "CaenHitColumns.hh"
+#include "CaenUnpack.hh"
+#include "CaenTraceCodec.hh"
+
+// Benchmarks for the time critical parts of the readout and conversion.
+// Each benchmark uses generated data, so no digitizer or input file is needed.
+
+// creates hits for nofChannels channels, grouped into readout blocks in which all hits of one channel come
+// before the hits of the next channel (like the digitizer sends them)
+std::vector<CaenEvent*> GenerateHits(int nofChannels, size_t nofHits, std::mt19937_64& generator)
+{
+	std::vector<CaenEvent*> hits;
+	hits.reserve(nofHits);
+	std::exponential_distribution<double> gap(1./1000.); // on average one hit per channel every 1000 samples
+	std::uniform_int_distribution<int> cfd(0, 1023);
+	std::vector<double> time(nofChannels, 0.);
+	const int hitsPerBlock = 64;
+	while(hits.size() < nofHits) {
+		for(int ch = 0; ch < nofChannels; ++ch) {
+			for(int i = 0; i < hitsPerBlock && hits.size() < nofHits; ++i) {
+				time[ch] += gap(generator);
+				uint64_t timestamp = static_cast<uint64_t>(time[ch]);
+				auto event = new CaenEvent;
+				event->Channel(ch);
+				event->TriggerTime(timestamp & 0x7fffffff);
+				event->ExtendedTimestamp(timestamp>>31);
+				event->Cfd(cfd(generator));
+				hits.push_back(event);
+			}
+		}
+	}
+	return hits;
+}
+
+// sorts the hits with the multiset the digitizer used before and with the CaenSorter
+// both keep bufferSize events in memory, just like CaenDigitizer::WriteEvents
+void BenchmarkSorter(size_t nofHits, size_t bufferSize)
+{
+	std::mt19937_64 generator(42);
+	TStopwatch watch;
+	std::cout<<"sorting "<<nofHits<<" hits, keeping "<<bufferSize<<" in memory"<<std::endl;
+	std::cout<<"channels   multiset [ns/hit]   CaenSorter [ns/hit]   speedup"<<std::endl;
+	for(int nofChannels : { 1, 8, 16 }) {
+		std::vector<CaenEvent*> hits = GenerateHits(nofChannels, nofHits, generator);
+		std::vector<uint64_t> multisetOrder;
+		std::vector<uint64_t> sorterOrder;
+		multisetOrder.reserve(nofHits);
+		sorterOrder.reserve(nofHits);
+
+		std::multiset<CaenEvent*, std::function<bool(const CaenEvent*, const CaenEvent*)> > ordered([](const CaenEvent* a, const CaenEvent* b) {
+				return a->GetTime() < b->GetTime();
+				});
+		watch.Start();
+		for(auto hit : hits) {
+			ordered.insert(hit);
+			if(ordered.size() > bufferSize) {
+				multisetOrder.push_back((*ordered.begin())->GetTimeKey());
+				ordered.erase(ordered.begin());
+			}
+		}
+		while(!ordered.empty()) {
+			multisetOrder.push_back((*ordered.begin())->GetTimeKey());
+			ordered.erase(ordered.begin());
+		}
+		watch.Stop();
+		double multisetTime = watch.RealTime();
+
+		CaenSorter sorter;
+		watch.Start();
+		for(auto hit : hits) {
+			sorter.Add(0, hit);
+			if(sorter.Size() > bufferSize) {
+				sorterOrder.push_back(sorter.Pop()->GetTimeKey());
+			}
+		}
+		while(!sorter.Empty()) {
+			sorterOrder.push_back(sorter.Pop()->GetTimeKey());
+		}
+		watch.Stop();
+		double sorterTime = watch.RealTime();
+
+		std::cout<<std::setw(8)<<nofChannels<<"   "<<std::setw(17)<<1e9*multisetTime/nofHits<<"   "<<std::setw(19)<<1e9*sorterTime/nofHits<<"   "<<std::setw(7)<<multisetTime/sorterTime<<std::endl;
+		if(multisetOrder != sorterOrder) {
+			std::cout<<"Warning, CaenSorter and multiset produced different orders!"<<std::endl;
+		}
+		for(auto hit : hits) {
+			delete hit;
+		}
+	}
+}
+
+// creates board aggregates like a DT5730 with DPP-PSD firmware would send them: nofAggregates aggregates with
+// hitsPerChannel hits in each of the eight channel pairs, with recordLength samples per hit (0 = no waveforms) and the
+// extras word in format extraFormat (-1 = no extras word)
+std::vector<uint32_t> GenerateAggregates(size_t nofAggregates, int hitsPerChannel, int recordLength, bool dualTrace, std::mt19937_64& generator, int extraFormat = 2)
+{
+	std::vector<uint32_t> data;
+	std::uniform_int_distribution<uint32_t> word;
+	bool extras = extraFormat >= 0;
+	int numSampleWords = recordLength/2;
+	int eventSize = numSampleWords + (extras ? 3 : 2);
+	uint32_t channelWords = 2 + hitsPerChannel*eventSize;
+	uint32_t boardWords = 4 + 8*channelWords;
+	uint32_t time = 0;
+	data.reserve(nofAggregates*boardWords);
+	for(size_t a = 0; a < nofAggregates; ++a) {
+		data.push_back(0xa0000000 | boardWords);
+		data.push_back(0xff);
+		data.push_back(a & 0x7fffff);
+		data.push_back(time);
+		for(int pair = 0; pair < 8; ++pair) {
+			data.push_back(0x80000000 | channelWords);
+			data.push_back((dualTrace ? 0x80000000 : 0) | 0x60000000 | (recordLength > 0 ? 0x08000000 : 0) | (extras ? 0x10000000 | (extraFormat<<24) : 0) | (recordLength/8));
+			for(int hit = 0; hit < hitsPerChannel; ++hit) {
+				time += 100;
+				data.push_back(((hit & 0x1)<<31) | (time & 0x7fffffff));
+				for(int s = 0; s < numSampleWords; ++s) {
+					data.push_back(word(generator) & 0xffffffff);
+				}
+				if(extraFormat == 7) {
+					data.push_back(0x12345678);
+				} else if(extras) {
+					data.push_back((word(generator) & 0xffff03ff) | 0x8000);
+				}
+				data.push_back(word(generator) & 0xffffffff);
+			}
+		}
+	}
+	return data;
+}
+
+// sink that reuses a single event, like the decode threads reusing pooled events, either unpacking the traces right
+// away or keeping the sample words (like the decode threads do now)
+class BenchmarkSink {
+public:
+	BenchmarkSink(bool lazy = false) : fHits(0), fLazy(lazy) {}
+	bool Traces(size_t nofSamples, bool dualTrace, CaenTraces& traces)
+	{
+		if(fLazy) {
+			traces.fWords = fEvent.ResizeSampleWords(nofSamples/2, dualTrace);
+			return true;
+		}
+		traces.fAnalog[0] = fEvent.ResizeWaveform(0, dualTrace ? nofSamples/2 : nofSamples);
+		traces.fAnalog[1] = fEvent.ResizeWaveform(1, dualTrace ? nofSamples/2 : 0);
+		traces.fDigital[0] = fEvent.ResizeDigitalWaveform(0, nofSamples);
+		traces.fDigital[1] = fEvent.ResizeDigitalWaveform(1, nofSamples);
+		return true;
+	}
+	void Add(const CaenHit& hit) { fEvent.Read(hit); ++fHits; }
+
+	CaenEvent fEvent;
+	size_t fHits;
+	bool fLazy;
+};
+
+// decodes generated board aggregates with ParseData into new CaenEvents (like MakeHist used to), into a reused
+// event (with the traces unpacked right away or only the sample words copied), and into reused columns
+void BenchmarkDecoder(size_t nofAggregates)
+{
+	std::mt19937_64 generator(42);
+	TStopwatch watch;
+	std::cout<<"decoding "<<nofAggregates<<" board aggregates (fewer for longer records) with 4 hits per channel pair"<<std::endl;
+	std::cout<<"record length   dual trace   new events [ns/hit]   reused event [ns/hit]   lazy event [ns/hit]   columns [ns/hit]   columns [MB/s]"<<std::endl;
+	CaenHitColumns columns;
+	for(int recordLength : { 0, 64, 512, 4096 }) {
+		for(bool dualTrace : { false, true }) {
+			if(recordLength == 0 && dualTrace) continue;
+			// keep the amount of data about the same for all record lengths
+			size_t aggregates = std::max<size_t>(1, nofAggregates*3/(recordLength/2 + 3));
+			std::vector<uint32_t> data = GenerateAggregates(aggregates, 4, recordLength, dualTrace, generator);
+
+			watch.Start();
+			std::vector<CaenEvent*> events = ParseData(reinterpret_cast<char*>(data.data()), data.size(), 0);
+			for(auto event : events) {
+				delete event;
+			}
+			watch.Stop();
+			double newTime = watch.RealTime();
+
+			BenchmarkSink sink;
+			watch.Start();
+			if(!ParseData(data.data(), data.size(), sink)) {
+				std::cout<<"Warning, failed to decode generated data!"<<std::endl;
+			}
+			watch.Stop();
+			double reusedTime = watch.RealTime();
+
+			BenchmarkSink lazySink(true);
+			watch.Start();
+			ParseData(data.data(), data.size(), lazySink);
+			watch.Stop();
+			double lazyTime = watch.RealTime();
+
+			// parse once to grow the columns, like they would be after the first few blocks
+			ParseData(data.data(), data.size(), columns);
+			columns.Clear();
+			watch.Start();
+			ParseData(data.data(), data.size(), columns);
+			watch.Stop();
+			double columnTime = watch.RealTime();
+			columns.Clear();
+
+			std::cout<<std::setw(13)<<recordLength<<"   "<<std::setw(10)<<(dualTrace ? "yes" : "no")<<"   "<<std::setw(19)<<1e9*newTime/sink.fHits<<"   "<<std::setw(21)<<1e9*reusedTime/sink.fHits<<"   "<<std::setw(19)<<1e9*lazyTime/sink.fHits<<"   "<<std::setw(16)<<1e9*columnTime/sink.fHits<<"   "<<std::setw(14)<<data.size()*4/1024./1024./columnTime<<std::endl;
+		}
+	}
+}
+
+// decodes generated board aggregates for each combination of extras format, waveforms and dual trace, i.e. each
+// specialisation of the hit loop in ParseData
+void BenchmarkFormats(size_t nofHits)
+{
+	std::mt19937_64 generator(42);
+	TStopwatch watch;
+	std::cout<<"decoding "<<nofHits<<" hits per format (4 per channel pair and board aggregate) into a reused event"<<std::endl;
+	std::cout<<"extras format   record length   dual trace   [ns/hit]   [MB/s]"<<std::endl;
+	for(int extraFormat : { -1, 0, 1, 2, 4, 5, 7 }) {
+		for(int recordLength : { 0, 64 }) {
+			for(bool dualTrace : { false, true }) {
+				if(recordLength == 0 && dualTrace) continue;
+				std::vector<uint32_t> data = GenerateAggregates(std::max<size_t>(1, nofHits/32), 4, recordLength, dualTrace, generator, extraFormat);
+				BenchmarkSink sink;
+				watch.Start();
+				if(!ParseData(data.data(), data.size(), sink)) {
+					std::cout<<"Warning, failed to decode generated data!"<<std::endl;
+				}
+				watch.Stop();
+				std::cout<<std::setw(13)<<(extraFormat < 0 ? std::string("none") : std::to_string(extraFormat))<<"   "<<std::setw(13)<<recordLength<<"   "<<std::setw(10)<<(dualTrace ? "yes" : "no")<<"   "<<std::setw(8)<<1e9*watch.RealTime()/sink.fHits<<"   "<<std::setw(6)<<data.size()*4/1024./1024./watch.RealTime()<<std::endl;
+			}
+		}
+	}
+}
+
+// unpacks the sample words of one hit with each of the kernels, and checks that they all agree with the scalar one
+void BenchmarkUnpack(size_t nofSampleWords)
+{
+	typedef void (*UnpackFunction)(const uint32_t*, size_t, bool, CaenTraces&);
+	std::vector<std::pair<std::string, UnpackFunction> > kernels;
+	kernels.emplace_back("scalar", UnpackSamplesScalar);
+#ifdef CAEN_UNPACK_X86
+	if(HasSse41()) kernels.emplace_back("SSE4.1", UnpackSamplesSse41);
+	if(HasAvx2()) kernels.emplace_back("AVX2", UnpackSamplesAvx2);
+#endif
+	std::cout<<"unpacking "<<nofSampleWords<<" sample words per record length, UnpackSamples uses "<<UnpackKernel()<<std::endl;
+	std::cout<<"record length   dual trace";
+	for(auto& kernel : kernels) std::cout<<"   "<<std::setw(8)<<kernel.first<<" [GB/s]";
+	std::cout<<std::endl;
+
+	std::mt19937_64 generator(42);
+	std::uniform_int_distribution<uint32_t> random;
+	TStopwatch watch;
+	for(int recordLength : { 64, 256, 1024, 4096 }) {
+		for(bool dualTrace : { false, true }) {
+			size_t wordsPerHit = recordLength/2;
+			size_t nofHits = std::max<size_t>(1, nofSampleWords/wordsPerHit);
+			std::vector<uint32_t> words(nofHits*wordsPerHit);
+			for(auto& word : words) word = random(generator);
+			// one set of traces per kernel, to compare the results
+			std::vector<std::vector<uint16_t> > analog(kernels.size(), std::vector<uint16_t>(2*wordsPerHit));
+			std::vector<std::vector<uint8_t> > digital(kernels.size(), std::vector<uint8_t>(4*wordsPerHit));
+			std::cout<<std::setw(13)<<recordLength<<"   "<<std::setw(10)<<(dualTrace ? "yes" : "no");
+			for(size_t k = 0; k < kernels.size(); ++k) {
+				CaenTraces traces = { { analog[k].data(), analog[k].data() + wordsPerHit }, { digital[k].data(), digital[k].data() + 2*wordsPerHit } };
+				watch.Start();
+				for(size_t hit = 0; hit < nofHits; ++hit) {
+					kernels[k].second(words.data() + hit*wordsPerHit, wordsPerHit, dualTrace, traces);
+				}
+				watch.Stop();
+				std::cout<<"   "<<std::setw(15)<<words.size()*4/1e9/watch.RealTime();
+				// only the last hit is left in the traces, which is enough to check the kernel
+				if(analog[k] != analog[0] || digital[k] != digital[0]) {
+					std::cout<<std::endl<<"Warning, "<<kernels[k].first<<" kernel differs from the scalar one!"<<std::endl;
+				}
+			}
+			std::cout<<std::endl;
+		}
+	}
+}
+
+// streams hits into a buffer and back with the member-wise streamer CaenEvent had up to version 3 and with its
+// hand-written streamer, with and without traces
+void BenchmarkStreamer(size_t nofHits)
+{
+	std::mt19937_64 generator(42);
+	std::uniform_int_distribution<int> sample(0, 0x3fff);
+	const size_t hitsPerBuffer = 1000;
+	size_t nofBuffers = std::max<size_t>(1, nofHits/hitsPerBuffer);
+	std::cout<<"streaming "<<nofBuffers*hitsPerBuffer<<" hits into and out of a buffer ("<<hitsPerBuffer<<" hits per buffer)"<<std::endl;
+	std::cout<<"record length   streamer      write [ns/hit]   read [ns/hit]   [bytes/hit]"<<std::endl;
+	for(int recordLength : { 0, 64, 512 }) {
+		std::vector<CaenEvent*> hits = GenerateHits(8, hitsPerBuffer, generator);
+		for(auto hit : hits) {
+			uint16_t* trace = hit->ResizeWaveform(0, recordLength);
+			for(int i = 0; i < recordLength; ++i) trace[i] = sample(generator);
+			hit->ResizeWaveform(1, 0);
+			hit->ResizeDigitalWaveform(0, recordLength);
+			hit->ResizeDigitalWaveform(1, recordLength);
+		}
+		for(bool handWritten : { false, true }) {
+			TBufferFile buffer(TBuffer::kWrite, 1<<20);
+			CaenEvent event; // reused for reading, like the event of a tree branch
+			TStopwatch writeWatch;
+			TStopwatch readWatch;
+			writeWatch.Reset();
+			readWatch.Reset();
+			bool identical = true;
+			for(size_t b = 0; b < nofBuffers; ++b) {
+				buffer.SetWriteMode();
+				buffer.SetBufferOffset(0);
+				writeWatch.Start(false);
+				for(auto hit : hits) {
+					if(handWritten) hit->Streamer(buffer);
+					else            buffer.WriteClassBuffer(CaenEvent::Class(), hit);
+				}
+				writeWatch.Stop();
+				buffer.SetReadMode();
+				buffer.SetBufferOffset(0);
+				readWatch.Start(false);
+				for(size_t i = 0; i < hits.size(); ++i) {
+					if(handWritten) event.Streamer(buffer);
+					else            buffer.ReadClassBuffer(CaenEvent::Class(), &event);
+					// only compare the last hit of each buffer, so the comparison doesn't dominate the read time
+					if(i + 1 == hits.size()) {
+						identical = identical && event.GetTimeKey() == hits[i]->GetTimeKey() && event.Channel() == hits[i]->Channel() &&
+							event.Waveforms() == hits[i]->Waveforms() && event.DigitalWaveforms() == hits[i]->DigitalWaveforms();
+					}
+				}
+				readWatch.Stop();
+			}
+			size_t nofStreamed = nofBuffers*hitsPerBuffer;
+			std::cout<<std::setw(13)<<recordLength<<"   "<<std::setw(11)<<(handWritten ? "hand-written" : "member-wise")<<"   "<<std::setw(14)<<1e9*writeWatch.RealTime()/nofStreamed<<"   "<<std::setw(13)<<1e9*readWatch.RealTime()/nofStreamed<<"   "<<std::setw(11)<<buffer.Length()/static_cast<double>(hitsPerBuffer)<<std::endl;
+			if(!identical) {
+				std::cout<<"Warning, hits read back differ from the ones written!"<<std::endl;
+			}
+		}
+		for(auto hit : hits) delete hit;
+	}
+}
+
+// creates the traces of a hit: a baseline with noise and a pulse at a fifth of the trace, with the gates as digital traces
+void GenerateTraces(size_t recordLength, std::mt19937_64& generator, std::vector<uint16_t>& analog, std::vector<uint8_t>& gate, std::vector<uint8_t>& shortGate)
+{
+	std::normal_distribution<double> noise(0., 2.);
+	std::uniform_real_distribution<double> amplitude(100., 5000.);
+	analog.resize(recordLength);
+	gate.resize(recordLength);
+	shortGate.resize(recordLength);
+	size_t trigger = recordLength/5;
+	double height = amplitude(generator);
+	for(size_t i = 0; i < recordLength; ++i) {
+		double sample = 8000. + noise(generator);
+		if(i >= trigger) {
+			double t = static_cast<double>(i - trigger);
+			sample -= height*(1. - std::exp(-t/2.))*std::exp(-t/20.);
+		}
+		analog[i] = static_cast<uint16_t>(std::max(0., sample));
+		gate[i] = (i + 4 >= trigger && i < trigger + 40) ? 1 : 0;
+		shortGate[i] = (i + 4 >= trigger && i < trigger + 10) ? 1 : 0;
+	}
+}
+
+// compresses the traces of generated hits with CaenTraceCodec and with zlib (which ROOT uses by default), zlib gets the
+// traces of all hits at once, like the baskets ROOT compresses
+void BenchmarkTraces(size_t nofHits)
+{
+	std::mt19937_64 generator(42);
+	TStopwatch watch;
+	std::cout<<"compressing the traces (one analog and two digital traces) of "<<nofHits<<" hits"<<std::endl;
+	std::cout<<"record length   compression     ratio   encode [MB/s]   decode [MB/s]"<<std::endl;
+	for(size_t recordLength : { 64, 512, 2048 }) {
+		std::vector<std::vector<uint16_t> > analog(nofHits);
+		std::vector<std::vector<uint8_t> > gate(nofHits);
+		std::vector<std::vector<uint8_t> > shortGate(nofHits);
+		std::vector<uint8_t> raw; // all traces as they are stored in CaenEvent
+		for(size_t h = 0; h < nofHits; ++h) {
+			GenerateTraces(recordLength, generator, analog[h], gate[h], shortGate[h]);
+			raw.insert(raw.end(), reinterpret_cast<const uint8_t*>(analog[h].data()), reinterpret_cast<const uint8_t*>(analog[h].data() + recordLength));
+			raw.insert(raw.end(), gate[h].begin(), gate[h].end());
+			raw.insert(raw.end(), shortGate[h].begin(), shortGate[h].end());
+		}
+		double megabytes = raw.size()/1024./1024.;
+
+		std::vector<uint8_t> encoded(nofHits*(MaxEncodedAnalogSize(recordLength) + 2*MaxEncodedDigitalSize(recordLength)));
+		std::vector<size_t> sizes(3*nofHits);
+		watch.Start();
+		uint8_t* output = encoded.data();
+		for(size_t h = 0; h < nofHits; ++h) {
+			sizes[3*h]   = EncodeAnalog(analog[h].data(), recordLength, output);
+			output += sizes[3*h];
+			sizes[3*h+1] = EncodeDigital(gate[h].data(), recordLength, output);
+			output += sizes[3*h+1];
+			sizes[3*h+2] = EncodeDigital(shortGate[h].data(), recordLength, output);
+			output += sizes[3*h+2];
+		}
+		watch.Stop();
+		double encodeTime = watch.RealTime();
+		size_t encodedSize = output - encoded.data();
+
+		std::vector<uint16_t> decodedAnalog(recordLength);
+		std::vector<uint8_t> decodedDigital(recordLength);
+		bool identical = true;
+		watch.Start();
+		const uint8_t* input = encoded.data();
+		for(size_t h = 0; h < nofHits; ++h) {
+			identical = DecodeAnalog(input, sizes[3*h], decodedAnalog.data(), recordLength) && identical;
+			input += sizes[3*h];
+			identical = DecodeDigital(input, sizes[3*h+1], decodedDigital.data(), recordLength) && identical;
+			input += sizes[3*h+1];
+			identical = DecodeDigital(input, sizes[3*h+2], decodedDigital.data(), recordLength) && identical;
+			input += sizes[3*h+2];
+		}
+		watch.Stop();
+		// only the last hit is left in the decoded traces, which is enough to check the codec
+		identical = identical && decodedAnalog == analog.back() && decodedDigital == shortGate.back();
+		std::cout<<std::setw(13)<<recordLength<<"   "<<std::setw(11)<<"trace codec"<<"   "<<std::setw(7)<<static_cast<double>(raw.size())/encodedSize<<"   "<<std::setw(13)<<megabytes/encodeTime<<"   "<<std::setw(13)<<megabytes/watch.RealTime()<<std::endl;
+		if(!identical) {
+			std::cout<<"Warning, decoded traces differ from the original ones!"<<std::endl;
+		}
+		{
+			// ROOT still compresses the coded traces, which is what ends up on disk
+			uLongf compressedSize = compressBound(encodedSize);
+			std::vector<Bytef> compressed(compressedSize);
+			watch.Start();
+			compress2(compressed.data(), &compressedSize, encoded.data(), encodedSize, 1);
+			watch.Stop();
+			std::cout<<std::setw(13)<<recordLength<<"   "<<std::setw(11)<<"+ zlib 1"<<"   "<<std::setw(7)<<static_cast<double>(raw.size())/compressedSize<<"   "<<std::setw(13)<<megabytes/(encodeTime + watch.RealTime())<<std::endl;
+		}
+
+		for(int level : { 1, 6 }) {
+			uLongf compressedSize = compressBound(raw.size());
+			std::vector<Bytef> compressed(compressedSize);
+			watch.Start();
+			compress2(compressed.data(), &compressedSize, raw.data(), raw.size(), level);
+			watch.Stop();
+			encodeTime = watch.RealTime();
+			std::vector<Bytef> uncompressed(raw.size());
+			uLongf uncompressedSize = raw.size();
+			watch.Start();
+			uncompress(uncompressed.data(), &uncompressedSize, compressed.data(), compressedSize);
+			watch.Stop();
+			std::cout<<std::setw(13)<<recordLength<<"   "<<std::setw(11)<<("zlib level " + std::to_string(level))<<"   "<<std::setw(7)<<static_cast<double>(raw.size())/compressedSize<<"   "<<std::setw(13)<<megabytes/encodeTime<<"   "<<std::setw(13)<<megabytes/watch.RealTime()<<std::endl;
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if(argc < 2) {
+		std::cerr<<"Usage: "<<argv[0]<<" <benchmark> [options]"<<std::endl;
+		std::cerr<<"Available benchmarks:"<<std::endl;
+		std::cerr<<"   sorter [number of hits] [buffer size]"<<std::endl;
+		std::cerr<<"   decoder [number of board aggregates]"<<std::endl;
+		std::cerr<<"   formats [number of hits]"<<std::endl;
+		std::cerr<<"   unpack [number of sample words]"<<std::endl;
+		std::cerr<<"   streamer [number of hits]"<<std::endl;
+		std::cerr<<"   traces [number of hits]"<<std::endl;
+		return 1;
+	}
+	std::string benchmark = argv[1];
+
+	if(benchmark == "sorter") {
+		size_t nofHits = 2000000;
+		size_t bufferSize = 100000;
+		if(argc > 2) nofHits = strtoul(argv[2], nullptr, 0);
+		if(argc > 3) bufferSize = strtoul(argv[3], nullptr, 0);
+		BenchmarkSorter(nofHits, bufferSize);
+	} else if(benchmark == "decoder") {
+		size_t nofAggregates = 100000;
+		if(argc > 2) nofAggregates = strtoul(argv[2], nullptr, 0);
+		BenchmarkDecoder(nofAggregates);
+	} else if(benchmark == "formats") {
+		size_t nofHits = 10000000;
+		if(argc > 2) nofHits = strtoul(argv[2], nullptr, 0);
+		BenchmarkFormats(nofHits);
+	} else if(benchmark == "unpack") {
+		size_t nofSampleWords = 50000000;
+		if(argc > 2) nofSampleWords = strtoul(argv[2], nullptr, 0);
+		BenchmarkUnpack(nofSampleWords);
+	} else if(benchmark == "streamer") {
+		size_t nofHits = 1000000;
+		if(argc > 2) nofHits = strtoul(argv[2], nullptr, 0);
+		BenchmarkStreamer(nofHits);
+	} else if(benchmark == "traces") {
+		size_t nofHits = 20000;
+		if(argc > 2) nofHits = strtoul(argv[2], nullptr, 0);
+		BenchmarkTraces(nofHits);
+	} else {
+		std::cerr<<"Unknown benchmark \""<<benchmark<<"\""<<std::endl;
+		return 1;
+	}
+
+	return 0;
+}
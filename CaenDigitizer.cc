@@ -1,15 +1,17 @@
 #include "CaenDigitizer.hh"
+#include "CaenParser.hh"
 
 #include <iostream>
 #include <iomanip>
 #include <sstream>
 #include <stdexcept>
-#include <fstream>
+#include <chrono>
+#include <algorithm>
 
 #include <curses.h>
 
 CaenDigitizer::CaenDigitizer(const CaenSettings& settings, bool debug)
-	: fSettings(&settings), fOutputFile(nullptr), fTree(nullptr), fEvent(new CaenEvent), fBytesRead(0), fEventsRead(0), fRunTime(0.), fOldBytesRead(0), fOldEventsRead(0), fOldRunTime(0.), fDebug(debug)
+	: fSettings(&settings), fOutputFile(nullptr), fWriter(nullptr), fRawOutput(nullptr), fHitOutput(nullptr), fHandleMutex(settings.NumberOfBoards()), fReading(false), fReadError(0), fReadStalls(0), fDecoding(false), fBytesRead(0), fEventsRead(0), fRunTime(0.), fOldBytesRead(0), fOldEventsRead(0), fOldAllocated(0), fOldRunTime(0.), fDebug(debug)
 {
 	if(fDebug) std::cout<<"constructing digitizer"<<std::endl;
 	CAEN_DGTZ_ErrorCode errorCode;
@@ -18,11 +20,22 @@ CaenDigitizer::CaenDigitizer(const CaenSettings& settings, bool debug)
 
 	try {
 		fHandle.resize(fSettings->NumberOfBoards(), 0);
-		fBuffer.resize(fSettings->NumberOfBoards());
-		fBufferSize.resize(fSettings->NumberOfBoards());
-		fEvents.resize(fSettings->NumberOfBoards());
-		fNofEvents.resize(fSettings->NumberOfBoards(), std::vector<uint32_t>(fSettings->NumberOfChannels(), 0));
-		fWaveforms.resize(fSettings->NumberOfBoards(), nullptr);
+		fBuffer.resize(fSettings->NumberOfBoards(), std::vector<ReadoutBuffer>(fSettings->ReadoutBuffers()));
+		fFilledBuffers.resize(fSettings->NumberOfBoards(), nullptr);
+		fFreeBuffers.resize(fSettings->NumberOfBoards(), nullptr);
+		fHeldBuffers.resize(fSettings->NumberOfBoards(), nullptr);
+		// boards in list mode don't send traces, so we can skip everything waveform related for them
+		fUseWaveforms.resize(fSettings->NumberOfBoards());
+		for(int b = 0; b < fSettings->NumberOfBoards(); ++b) {
+			fUseWaveforms[b] = (fSettings->AcquisitionMode(b) != CAEN_DGTZ_DPP_ACQ_MODE_List);
+		}
+		// without decode threads we still need one context to decode in the main thread
+		fDecodeContext.resize(std::max(NumberOfDecodeThreads(), 1));
+		for(auto& context : fDecodeContext) {
+			context.fEvents.resize(fSettings->NumberOfBoards(), nullptr);
+			context.fNofEvents.resize(fSettings->NumberOfBoards(), std::vector<uint32_t>(fSettings->NumberOfChannels(), 0));
+			context.fWaveforms.resize(fSettings->NumberOfBoards(), nullptr);
+		}
 	} catch(std::exception e) {
 		std::cerr<<"Failed to resize vectors for "<<fSettings->NumberOfBoards()<<" boards, and "<<fSettings->NumberOfChannels()<<" channels: "<<e.what()<<std::endl;
 		throw e;
@@ -55,65 +68,62 @@ CaenDigitizer::CaenDigitizer(const CaenSettings& settings, bool debug)
 
 		ProgramDigitizer(b);
 		
-		// we don't really need to know how many bytes have been allocated, so we use fBufferSize here
-		if(fDebug) std::cout<<fHandle[b]<<"/"<<fBuffer.size()<<": trying to allocate memory for readout buffer "<<static_cast<void*>(fBuffer[b])<<std::endl;
-		errorCode = CAEN_DGTZ_MallocReadoutBuffer(fHandle[b], &fBuffer[b], &fBufferSize[b]);
-		if(errorCode != 0) {
-			throw std::runtime_error(Form("Error %d when allocating readout buffer", errorCode));
-		}
-		if(fDebug) std::cout<<"allocated "<<fBufferSize[0]<<" bytes of buffer for board "<<b<<std::endl;
-		// again, we don't care how many bytes have been allocated, so we use fNofEvents here
-		fEvents[b] = new CAEN_DGTZ_DPP_PSD_Event_t*[fSettings->NumberOfChannels()];
-		errorCode = CAEN_DGTZ_MallocDPPEvents(fHandle[b], reinterpret_cast<void**>(fEvents[b]), fNofEvents[b].data());
-		if(errorCode != 0) {
-			throw std::runtime_error(Form("Error %d when allocating DPP events", errorCode));
+		// allocate the pool of readout buffers, all of them start out as free buffers for the reader thread
+		fFilledBuffers[b] = new RingBuffer<ReadoutBuffer*>(fBuffer[b].size());
+		fFreeBuffers[b] = new RingBuffer<ReadoutBuffer*>(fBuffer[b].size());
+		for(auto& buffer : fBuffer[b]) {
+			// we don't really need to know how many bytes have been allocated, so we use fSize here
+			if(fDebug) std::cout<<fHandle[b]<<"/"<<fBuffer.size()<<": trying to allocate memory for readout buffer"<<std::endl;
+			buffer.fData = nullptr;
+			errorCode = CAEN_DGTZ_MallocReadoutBuffer(fHandle[b], &buffer.fData, &buffer.fSize);
+			if(errorCode != 0) {
+				throw std::runtime_error(Form("Error %d when allocating readout buffer", errorCode));
+			}
+			if(fDebug) std::cout<<"allocated "<<buffer.fSize<<" bytes of buffer for board "<<b<<std::endl;
+			buffer.fSize = 0;
+			buffer.fBoard = b;
+			buffer.fSequence = 0;
+			buffer.fWallTime = 0;
+			fFreeBuffers[b]->Push(&buffer);
 		}
-#ifdef USE_WAVEFORMS
-		// allocate waveforms, again not caring how many bytes have been allocated
-		uint32_t size;
-		errorCode = CAEN_DGTZ_MallocDPPWaveforms(fHandle[b], reinterpret_cast<void**>(&(fWaveforms[b])), &size);
-		if(errorCode != 0) {
-#ifdef USE_CURSES
-			printw("error 2\n");
-#else
-			std::cout<<"error 2"<<std::endl;
-#endif
-			throw std::runtime_error(Form("Error %d when allocating DPP waveforms", errorCode));
+		// each decode context needs its own DPP events and waveforms for this board
+		for(auto& context : fDecodeContext) {
+			AllocateDecodeContext(context, b);
 		}
-#endif
 #ifdef USE_CURSES
 		if(fDebug) printw("done with board %d\n", b);
 #else
 		if(fDebug) std::cout<<"done with board "<<b<<std::endl;
 #endif
 	}
-
-	fOrdered = decltype(fOrdered)([](const CaenEvent* a, const CaenEvent* b) {
-			return a->GetTime() < b->GetTime();
-			});
 }
 
 CaenDigitizer::~CaenDigitizer()
 {
 	for(int b = 0; b < fSettings->NumberOfBoards(); ++b) {
-		CAEN_DGTZ_FreeReadoutBuffer(&fBuffer[b]);
-		CAEN_DGTZ_FreeDPPEvents(fHandle[b], reinterpret_cast<void**>(fEvents[b]));
-#ifdef USE_WAVEFORMS
-		CAEN_DGTZ_FreeDPPWaveforms(fHandle[b], reinterpret_cast<void*>(fWaveforms[b]));
-#endif
+		for(auto& buffer : fBuffer[b]) {
+			CAEN_DGTZ_FreeReadoutBuffer(&buffer.fData);
+		}
+		delete fFilledBuffers[b];
+		delete fFreeBuffers[b];
+		for(auto& context : fDecodeContext) {
+			FreeDecodeContext(context, b);
+		}
 		if(CAEN_DGTZ_CloseDigitizer(fHandle[b]) != 0) {
 			std::cout<<"Failed to close "<<b<<". digitizer "<<fHandle[b]<<std::endl;
 		}
 	}
 }
 
-double CaenDigitizer::Run(TFile* outputFile, std::ofstream& dataFile, uint64_t events, double runTime)
+double CaenDigitizer::Run(TFile* outputFile, CaenRawWriter* rawOutput, CaenHitWriter* hitOutput, uint64_t events, double runTime)
 {
-	CAEN_DGTZ_ErrorCode errorCode;
 	fOutputFile = outputFile;
+	fRawOutput = rawOutput;
+	fHitOutput = hitOutput;
 
 	if(fOutputFile != nullptr) {
-		CreateTree();
+		// from here on only the writer thread touches the output file
+		fWriter = new CaenTreeWriter(fOutputFile, fSettings->WriterBatchSize(), fSettings->WriterBatches(), fSettings->TreeSaveInterval(), fSettings->FlatTree(), fSettings->FlatTreeWaveforms(), &fEventPool, fDebug);
 	}
 
 	int ch = 0; //character read from input
@@ -130,51 +140,41 @@ double CaenDigitizer::Run(TFile* outputFile, std::ofstream& dataFile, uint64_t e
 #endif
 
 	fStopwatch.Start();
+	fRunTime = 0.;
+	// the timestamps start over with each run, so we need a new sorter
+	fSorter = CaenSorter();
 
 #ifdef USE_CURSES
 	int x, y;
 	getyx(stdscr, y, x);
 #endif
 
+	StartDecoding();
+	StartReadout();
+
 	while(ch != 's') {
-		// read data
 		if(fDebug) {
 			std::cout<<"--------------------------------------------------------------------------------"<<std::endl;
 		}
-		for(int b = 0; b < fSettings->NumberOfBoards(); ++b) {
-			// reset fNofEvents
-			for(int ch = 0; ch < fSettings->NumberOfChannels(); ++ch) {
-				fNofEvents[b][ch] = 0;
-			}
-			errorCode = CAEN_DGTZ_ReadData(fHandle[b], CAEN_DGTZ_SLAVE_TERMINATED_READOUT_MBLT, fBuffer[b], &fBufferSize[b]);
-			if(errorCode != 0) {
-				std::cerr<<"Error "<<errorCode<<" when reading data"<<std::endl;
-				return -1.;
-			}
-			if(fDebug) {
-				std::cout<<"Read "<<fBufferSize[b]<<" bytes"<<std::endl;
-			}
-			if(fBufferSize[b] > 0) {
-				fBytesRead += fBufferSize[b];
-				if(dataFile.is_open()) {
-					dataFile.write(fBuffer[b], fBufferSize[b]);
-				}
-				errorCode = CAEN_DGTZ_GetDPPEvents(fHandle[b], fBuffer[b], fBufferSize[b], reinterpret_cast<void**>(fEvents[b]), fNofEvents[b].data());
-				if(errorCode != 0) {
-					if(fDebug) std::cerr<<"Error "<<errorCode<<" when parsing events"<<std::endl;
-					continue;
-				}
-				// add number of events of each channel to total
-				for(auto nEv : fNofEvents[b]) {
-					fEventsRead += nEv;
-				}
+		// check that none of the reader threads or background writers has failed
+		if(fReadError != 0 || WriteFailed()) {
+			if(fReadError != 0) {
+				std::cerr<<"Error "<<fReadError<<" when reading data"<<std::endl;
+			} else {
+				std::cerr<<"Failed to write the output files, stopping the run"<<std::endl;
 			}
+			StopReadout();
+			ProcessBuffers(true);
+			StopDecoding();
+			FinishWriting();
+			return -1.;
 		}
-		if(fOutputFile != nullptr) {
-			if(fDebug) {
-				std::cout<<"----------------------------------------"<<std::endl;
-			}
-			SortEvents();
+		// decode and sort all buffers the reader threads have filled so far
+		if(!ProcessBuffers()) {
+			// nothing to be done, so give the reader threads some time to fill buffers
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+		if(WritesEvents()) {
 			if(fDebug) {
 				std::cout<<"--------------------"<<std::endl;
 			}
@@ -206,13 +206,21 @@ double CaenDigitizer::Run(TFile* outputFile, std::ofstream& dataFile, uint64_t e
 		if(fRunTime - fOldRunTime > fSettings->Update()) {
 #ifdef USE_CURSES
 			//printw("%.1f s, got %lu events = %.1f events/s\n", fRunTime, fEventsRead, fEventsRead/fRunTime);
-			mvprintw(y, x, "%.1f s, got %lu events = %.1f events/s, and %.3f MB/s average, %.1f events/s and %.3f MB/s in last %.1f seconds\n", fRunTime, fEventsRead, fEventsRead/fRunTime, fBytesRead/1024./1024./fRunTime, (fEventsRead-fOldEventsRead)/(fRunTime - fOldRunTime), (fBytesRead - fOldBytesRead)/1024./1024./(fRunTime - fOldRunTime), fRunTime - fOldRunTime);
+			mvprintw(y, x, "%.1f s, got %lu events = %.1f events/s, and %.3f MB/s average, %.1f events/s and %.3f MB/s in last %.1f seconds, %lu readout stalls, %lu late events (up to %.1f ns), %lu writer stalls, raw data %.1f MB/s (%.1f MB/s while writing) with %lu buffers queued, %.1f event allocations/s\n", fRunTime, fEventsRead, fEventsRead/fRunTime, fBytesRead/1024./1024./fRunTime, (fEventsRead-fOldEventsRead)/(fRunTime - fOldRunTime), (fBytesRead - fOldBytesRead)/1024./1024./(fRunTime - fOldRunTime), fRunTime - fOldRunTime, static_cast<uint64_t>(fReadStalls), fSorter.Late(), fSorter.MaxLateness()/512., fWriter != nullptr ? fWriter->Stalls() : 0, fRawOutput != nullptr ? fRawOutput->Rate() : 0., fRawOutput != nullptr ? fRawOutput->WriteRate() : 0., fRawOutput != nullptr ? fRawOutput->QueueDepth() : 0, (fEventPool.Allocated() - fOldAllocated)/(fRunTime - fOldRunTime));
 #else
-			std::cout<<fRunTime<<" s, got "<<fEventsRead<<" events = "<<fEventsRead/fRunTime<<" events/s, and "<<fBytesRead/1024./1024./fRunTime<<" MB/s average, "<<(fEventsRead-fOldEventsRead)/(fRunTime - fOldRunTime)<<" events/s, and "<<(fBytesRead - fOldBytesRead)/1024./1024./(fRunTime - fOldRunTime)<<" MB/s in last "<<fRunTime-fOldRunTime<<" seconds"<<std::endl;
+			std::cout<<fRunTime<<" s, got "<<fEventsRead<<" events = "<<fEventsRead/fRunTime<<" events/s, and "<<fBytesRead/1024./1024./fRunTime<<" MB/s average, "<<(fEventsRead-fOldEventsRead)/(fRunTime - fOldRunTime)<<" events/s, and "<<(fBytesRead - fOldBytesRead)/1024./1024./(fRunTime - fOldRunTime)<<" MB/s in last "<<fRunTime-fOldRunTime<<" seconds, "<<fReadStalls<<" readout stalls, "<<fSorter.Late()<<" late events (up to "<<fSorter.MaxLateness()/512.<<" ns), "<<(fWriter != nullptr ? fWriter->Stalls() : 0)<<" writer stalls, raw data "<<(fRawOutput != nullptr ? fRawOutput->Rate() : 0.)<<" MB/s ("<<(fRawOutput != nullptr ? fRawOutput->WriteRate() : 0.)<<" MB/s while writing) with "<<(fRawOutput != nullptr ? fRawOutput->QueueDepth() : 0)<<" buffers queued, "<<(fEventPool.Allocated() - fOldAllocated)/(fRunTime - fOldRunTime)<<" event allocations/s"<<std::endl;
 #endif
+			// hand the events released so far to the writer, so at low rates they don't wait for the batch to fill up
+			if(fWriter != nullptr) {
+				fWriter->Flush();
+			}
+			if(fHitOutput != nullptr) {
+				fHitOutput->Flush();
+			}
 			fOldRunTime = fRunTime;
 			fOldEventsRead = fEventsRead;
 			fOldBytesRead = fBytesRead;
+			fOldAllocated = fEventPool.Allocated();
 		}
 #ifdef USE_CURSES
 		if((ch = getch()) != ERR) {
@@ -230,8 +238,12 @@ double CaenDigitizer::Run(TFile* outputFile, std::ofstream& dataFile, uint64_t e
 		}
 #endif
 	}
+	// stop the reader threads and decode what they have read so far
+	StopReadout();
+	ProcessBuffers(true);
+	StopDecoding();
 #ifdef USE_CURSES
-	printw("flushing remaining %lu events\n", fOrdered.size());
+	printw("flushing remaining %lu events\n", fSorter.Size());
 	refresh();
 #else
 #endif
@@ -247,11 +259,398 @@ double CaenDigitizer::Run(TFile* outputFile, std::ofstream& dataFile, uint64_t e
 		CAEN_DGTZ_SWStopAcquisition(fHandle[b]);
 	}
 	// write tree
-	fTree->Write("", TObject::kOverwrite);
+	FinishWriting();
 
 	return fRunTime;
 }
 
+void CaenDigitizer::StartReadout()
+{
+	fReading = true;
+	fReadError = 0;
+	for(int b = 0; b < fSettings->NumberOfBoards(); ++b) {
+		fReadThreads.emplace_back(&CaenDigitizer::ReadBoard, this, b);
+	}
+}
+
+void CaenDigitizer::StopReadout()
+{
+	fReading = false;
+	for(auto& thread : fReadThreads) {
+		thread.join();
+	}
+	fReadThreads.clear();
+	// return the buffers the reader threads were still holding, so that the pools are complete for the next run
+	// (only the main thread pushes to the free buffers)
+	for(size_t b = 0; b < fHeldBuffers.size(); ++b) {
+		if(fHeldBuffers[b] != nullptr) {
+			fFreeBuffers[b]->Push(fHeldBuffers[b]);
+			fHeldBuffers[b] = nullptr;
+		}
+	}
+}
+
+void CaenDigitizer::ReadBoard(int b)
+{
+	// reader thread for board b: keeps draining the board into free buffers and hands them on as soon as they contain data
+	// this thread must not print anything (curses is not thread-safe), errors are reported via fReadError
+	CAEN_DGTZ_ErrorCode errorCode;
+	ReadoutBuffer* buffer = nullptr;
+	uint64_t sequence = 0;
+	bool stalled = false;
+
+	while(fReading) {
+		if(buffer == nullptr) {
+			if(!fFreeBuffers[b]->Pop(buffer)) {
+				// all buffers are still waiting to be decoded, count each stall once and not every time we wait
+				if(!stalled) {
+					++fReadStalls;
+					stalled = true;
+				}
+				std::this_thread::yield();
+				continue;
+			}
+			stalled = false;
+		}
+		{
+			std::lock_guard<std::mutex> lock(fHandleMutex[b]);
+			errorCode = CAEN_DGTZ_ReadData(fHandle[b], CAEN_DGTZ_SLAVE_TERMINATED_READOUT_MBLT, buffer->fData, &buffer->fSize);
+		}
+		if(errorCode != 0) {
+			fReadError = errorCode;
+			break;
+		}
+		if(buffer->fSize > 0) {
+			buffer->fSequence = sequence++;
+			buffer->fWallTime = WallTime();
+			// can't fail, the ring is large enough to hold all buffers of this board
+			fFilledBuffers[b]->Push(buffer);
+			buffer = nullptr;
+		}
+	}
+	// the main thread might still be pushing to the free buffers, so StopReadout returns this buffer to them
+	fHeldBuffers[b] = buffer;
+}
+
+int CaenDigitizer::NumberOfDecodeThreads() const
+{
+	// the library decoder holds the mutex of the board for the whole buffer, so more threads than boards would only wait
+	if(fSettings->NativeDecoder()) {
+		return fSettings->DecodeThreads();
+	}
+	return std::min(fSettings->DecodeThreads(), fSettings->NumberOfBoards());
+}
+
+void CaenDigitizer::StartDecoding()
+{
+	fDecoding = true;
+	for(int w = 0; w < NumberOfDecodeThreads(); ++w) {
+		fDecodeThreads.emplace_back(&CaenDigitizer::DecodeWorker, this, w);
+	}
+}
+
+void CaenDigitizer::StopDecoding()
+{
+	{
+		std::lock_guard<std::mutex> lock(fDecodeMutex);
+		fDecoding = false;
+	}
+	fDecodeCondition.notify_all();
+	for(auto& thread : fDecodeThreads) {
+		thread.join();
+	}
+	fDecodeThreads.clear();
+}
+
+void CaenDigitizer::DecodeWorker(int w)
+{
+	// decode thread: takes buffers from fDecodeQueue until decoding is stopped and the queue is empty
+	std::unique_lock<std::mutex> lock(fDecodeMutex);
+	while(true) {
+		fDecodeCondition.wait(lock, [this]() { return !fDecodeQueue.empty() || !fDecoding; });
+		if(fDecodeQueue.empty()) {
+			break;
+		}
+		ReadoutBuffer* buffer = fDecodeQueue.front();
+		fDecodeQueue.pop_front();
+		lock.unlock();
+		DecodeBuffer(fDecodeContext[w], buffer);
+		lock.lock();
+		buffer->fDecoded = true;
+		fDecodedCondition.notify_one();
+	}
+}
+
+void CaenDigitizer::DecodeBuffer(DecodeContext& context, ReadoutBuffer* buffer)
+{
+	// decodes the DPP events of this buffer and, if we write a tree, creates the CaenEvents for them
+	// can be called from any decode thread, as long as each thread uses its own context
+	if(fSettings->NativeDecoder()) {
+		DecodeBufferNative(context, buffer);
+		return;
+	}
+	CAEN_DGTZ_ErrorCode errorCode;
+	int b = buffer->fBoard;
+	buffer->fEvents.clear();
+	buffer->fNofEvents = 0;
+
+	// reset fNofEvents
+	for(int ch = 0; ch < fSettings->NumberOfChannels(); ++ch) {
+		context.fNofEvents[b][ch] = 0;
+	}
+	// lock once for the whole buffer, so the reader thread of this board waits at most for one buffer and not for every
+	// waveform decoded by any thread
+	std::lock_guard<std::mutex> lock(fHandleMutex[b]);
+	errorCode = CAEN_DGTZ_GetDPPEvents(fHandle[b], buffer->fData, buffer->fSize, reinterpret_cast<void**>(context.fEvents[b]), context.fNofEvents[b].data());
+	if(errorCode != 0) {
+		if(fDebug) std::cerr<<"Error "<<errorCode<<" when parsing events"<<std::endl;
+		return;
+	}
+	// add number of events of each channel to total
+	for(auto nEv : context.fNofEvents[b]) {
+		buffer->fNofEvents += nEv;
+	}
+	if(!WritesEvents()) {
+		return;
+	}
+
+	// list mode boards get their own loop, so they don't pay for the waveform checks
+	if(!fUseWaveforms[b]) {
+		for(int ch = 0; ch < fSettings->NumberOfChannels(); ++ch) {
+			for(unsigned int ev = 0; ev < context.fNofEvents[b][ch]; ++ev) {
+				if(!CheckEvent(context.fEvents[b][ch][ev])) {
+					if(fDebug) {
+						std::cout<<"Skipping event, board "<<b<<", channel "<<ch<<", event "<<ev<<" with all times zero!"<<std::endl;
+					}
+					continue;
+				}
+				CaenEvent* event = GetEvent(context);
+				event->Read(ch, context.fEvents[b][ch][ev], nullptr);
+				event->Board(b);
+				buffer->fEvents.push_back(event);
+			}
+		}
+		return;
+	}
+
+	for(int ch = 0; ch < fSettings->NumberOfChannels(); ++ch) {
+		for(unsigned int ev = 0; ev < context.fNofEvents[b][ch]; ++ev) {
+			if(!CheckEvent(context.fEvents[b][ch][ev])) {
+				if(fDebug) {
+					std::cout<<"Skipping event, board "<<b<<", channel "<<ch<<", event "<<ev<<" with all times zero!"<<std::endl;
+				}
+				continue;
+			}
+			CAEN_DGTZ_DPP_PSD_Waveforms_t* waveforms = context.fWaveforms[b];
+			errorCode = CAEN_DGTZ_DecodeDPPWaveforms(fHandle[b], reinterpret_cast<void*>(context.fEvents[b][ch]+ev), reinterpret_cast<void*>(waveforms));
+			if(errorCode != 0) {
+				if(fDebug) {
+					std::cout<<"failed to decode waveform for board "<<b<<", channel "<<ch<<", event "<<ev<<": "<<context.fEvents[b][ch][ev].Waveforms<<std::endl;
+				}
+				waveforms = nullptr;
+			}
+			CaenEvent* event = GetEvent(context);
+			event->Read(ch, context.fEvents[b][ch][ev], waveforms);
+			event->Board(b);
+			buffer->fEvents.push_back(event);
+		}
+	}
+}
+
+class CaenDigitizer::DecodeSink {
+public:
+	DecodeSink(CaenDigitizer* digitizer, DecodeContext& context, ReadoutBuffer* buffer)
+		: fDigitizer(digitizer), fContext(context), fBuffer(buffer), fEvent(nullptr)
+	{
+		fCreateEvents = fDigitizer->WritesEvents();
+		fWaveforms = fCreateEvents && fDigitizer->fUseWaveforms[buffer->fBoard];
+		// the hit file copies the traces in the main thread, so they are better unpacked here by the decode threads
+		fSampleWords = fDigitizer->fHitOutput == nullptr || !fDigitizer->fSettings->HitWaveforms();
+	}
+
+	~DecodeSink()
+	{
+		// an event that got traces but no hit (corrupt data) goes back to the cache
+		if(fEvent != nullptr) {
+			fContext.fFreeEvents.push_back(fEvent);
+		}
+	}
+
+	bool Traces(size_t nofSamples, bool dualTrace, CaenTraces& traces)
+	{
+		if(!fWaveforms) {
+			return false;
+		}
+		if(fEvent == nullptr) {
+			fEvent = fDigitizer->GetEvent(fContext);
+		}
+		if(fSampleWords) {
+			// the event keeps the sample words, they are only unpacked if the traces are written or looked at
+			traces.fWords = fEvent->ResizeSampleWords(nofSamples/2, dualTrace);
+			return true;
+		}
+		// a pooled event might still have the sample words of an earlier run, which don't need to be unpacked
+		if(!fEvent->TracesUnpacked()) {
+			fEvent->ClearWaveforms();
+		}
+		size_t nofAnalogSamples = dualTrace ? nofSamples/2 : nofSamples;
+		traces.fAnalog[0] = fEvent->ResizeWaveform(0, nofAnalogSamples);
+		traces.fAnalog[1] = fEvent->ResizeWaveform(1, dualTrace ? nofAnalogSamples : 0);
+		traces.fDigital[0] = fEvent->ResizeDigitalWaveform(0, nofSamples);
+		traces.fDigital[1] = fEvent->ResizeDigitalWaveform(1, nofSamples);
+		return true;
+	}
+
+	void Add(const CaenHit& hit)
+	{
+		++fBuffer->fNofEvents;
+		if(!fCreateEvents) {
+			return;
+		}
+		if(!fDigitizer->CheckEvent(hit)) {
+			if(fDigitizer->fDebug) {
+				std::cout<<"Skipping event, board "<<fBuffer->fBoard<<", channel "<<hit.fChannel<<" with all times zero!"<<std::endl;
+			}
+			if(fEvent != nullptr) {
+				fContext.fFreeEvents.push_back(fEvent);
+				fEvent = nullptr;
+			}
+			return;
+		}
+		if(fEvent == nullptr) {
+			fEvent = fDigitizer->GetEvent(fContext);
+			fEvent->ClearWaveforms();
+		}
+		fEvent->Read(hit);
+		fEvent->Board(fBuffer->fBoard);
+		fBuffer->fEvents.push_back(fEvent);
+		fEvent = nullptr;
+	}
+
+private:
+	CaenDigitizer* fDigitizer;
+	DecodeContext& fContext;
+	ReadoutBuffer* fBuffer;
+	CaenEvent* fEvent; // event the traces of the current hit are decoded into
+	bool fCreateEvents;
+	bool fWaveforms;
+	bool fSampleWords;
+};
+
+void CaenDigitizer::DecodeBufferNative(DecodeContext& context, ReadoutBuffer* buffer)
+{
+	// decodes the board aggregates straight from the raw data into the CaenEvents, without going through the
+	// CAEN_DGTZ_DPP_PSD_Event_t and waveform structures of the CAEN library
+	buffer->fEvents.clear();
+	buffer->fNofEvents = 0;
+	DecodeSink sink(this, context, buffer);
+	if(!ParseData(reinterpret_cast<const uint32_t*>(buffer->fData), buffer->fSize/4, sink) && fDebug) {
+		std::cerr<<"Error when parsing events of board "<<buffer->fBoard<<", readout "<<buffer->fSequence<<std::endl;
+	}
+}
+
+CaenEvent* CaenDigitizer::GetEvent(DecodeContext& context)
+{
+	// only lock the pool once every few hundred events
+	if(context.fFreeEvents.empty()) {
+		fEventPool.Get(context.fFreeEvents, 256);
+	}
+	CaenEvent* event = context.fFreeEvents.back();
+	context.fFreeEvents.pop_back();
+	return event;
+}
+
+bool CaenDigitizer::ProcessBuffers(bool wait)
+{
+	// hands all filled buffers to the decode threads and sorts the decoded buffers in the order they were handed out
+	// if wait is true, this waits until all buffers have been decoded
+	// returns true if any buffer was handed out or sorted
+	ReadoutBuffer* buffer;
+	bool processed = false;
+	for(int b = 0; b < fSettings->NumberOfBoards(); ++b) {
+		while(fFilledBuffers[b]->Pop(buffer)) {
+			processed = true;
+			if(fDebug) {
+				std::cout<<"Read "<<buffer->fSize<<" bytes from board "<<b<<" in readout "<<buffer->fSequence<<std::endl;
+			}
+			fBytesRead += buffer->fSize;
+			if(fRawOutput != nullptr) {
+				fRawOutput->WriteBlock(b, buffer->fSequence, buffer->fWallTime, buffer->fData, buffer->fSize);
+			}
+			buffer->fDecoded = false;
+			fPendingBuffers.push_back(buffer);
+			if(fDecodeThreads.empty()) {
+				DecodeBuffer(fDecodeContext[0], buffer);
+				buffer->fDecoded = true;
+			} else {
+				std::lock_guard<std::mutex> lock(fDecodeMutex);
+				fDecodeQueue.push_back(buffer);
+				fDecodeCondition.notify_one();
+			}
+		}
+	}
+
+	std::unique_lock<std::mutex> lock(fDecodeMutex);
+	while(!fPendingBuffers.empty()) {
+		buffer = fPendingBuffers.front();
+		if(!buffer->fDecoded) {
+			if(!wait) {
+				break;
+			}
+			fDecodedCondition.wait(lock, [buffer]() { return buffer->fDecoded; });
+		}
+		fPendingBuffers.pop_front();
+		lock.unlock();
+		processed = true;
+		fEventsRead += buffer->fNofEvents;
+		if(WritesEvents()) {
+			if(fDebug) {
+				std::cout<<"----------------------------------------"<<std::endl;
+			}
+			SortEvents(buffer);
+		}
+		// the buffer isn't needed anymore, so we can give it back to the reader thread
+		fFreeBuffers[buffer->fBoard]->Push(buffer);
+		lock.lock();
+	}
+	return processed;
+}
+
+void CaenDigitizer::AllocateDecodeContext(DecodeContext& context, int b)
+{
+	CAEN_DGTZ_ErrorCode errorCode;
+	// again, we don't care how many bytes have been allocated, so we use fNofEvents here
+	context.fEvents[b] = new CAEN_DGTZ_DPP_PSD_Event_t*[fSettings->NumberOfChannels()];
+	errorCode = CAEN_DGTZ_MallocDPPEvents(fHandle[b], reinterpret_cast<void**>(context.fEvents[b]), context.fNofEvents[b].data());
+	if(errorCode != 0) {
+		throw std::runtime_error(Form("Error %d when allocating DPP events", errorCode));
+	}
+	if(!fUseWaveforms[b]) {
+		return;
+	}
+	// allocate waveforms, again not caring how many bytes have been allocated
+	uint32_t size;
+	errorCode = CAEN_DGTZ_MallocDPPWaveforms(fHandle[b], reinterpret_cast<void**>(&(context.fWaveforms[b])), &size);
+	if(errorCode != 0) {
+#ifdef USE_CURSES
+		printw("error 2\n");
+#else
+		std::cout<<"error 2"<<std::endl;
+#endif
+		throw std::runtime_error(Form("Error %d when allocating DPP waveforms", errorCode));
+	}
+}
+
+void CaenDigitizer::FreeDecodeContext(DecodeContext& context, int b)
+{
+	CAEN_DGTZ_FreeDPPEvents(fHandle[b], reinterpret_cast<void**>(context.fEvents[b]));
+	delete[] context.fEvents[b];
+	if(context.fWaveforms[b] != nullptr) {
+		CAEN_DGTZ_FreeDPPWaveforms(fHandle[b], reinterpret_cast<void*>(context.fWaveforms[b]));
+		context.fWaveforms[b] = nullptr;
+	}
+}
+
 void CaenDigitizer::ProgramDigitizer(int b)
 {
 	if(fDebug) std::cout<<"programming digitizer "<<b<<std::endl;
@@ -359,10 +758,37 @@ void CaenDigitizer::ProgramDigitizer(int b)
 	if(fDebug) std::cout<<"done with digitizer "<<b<<std::endl;
 }
 
-void CaenDigitizer::CreateTree()
+bool CaenDigitizer::WriteFailed() const
 {
-	fTree = new TTree("tree", "tree");
-	fTree->Branch("event",&fEvent);
+	// the writers report the error themselves when they are closed
+	return (fRawOutput != nullptr && fRawOutput->Error() != 0) || (fHitOutput != nullptr && fHitOutput->Error() != 0);
+}
+
+void CaenDigitizer::FinishWriting()
+{
+	// the raw data and hit files are closed by the caller
+	fRawOutput = nullptr;
+	fHitOutput = nullptr;
+	if(fWriter == nullptr) {
+		return;
+	}
+	fWriter->Finish();
+	delete fWriter;
+	fWriter = nullptr;
+}
+
+bool CaenDigitizer::CheckEvent(const CaenHit& hit)
+{
+	if(hit.fTriggerTime == 0 && hit.fExtendedTimestamp == 0 && hit.fCfd == 0) {
+		if(fDebug) {
+			std::cout<<"empty time"<<std::endl;
+		}
+		return false;
+	}
+	if(fDebug) {
+		std::cout<<"times: "<<hit.fExtendedTimestamp<<", "<<hit.fTriggerTime<<", "<<hit.fCfd<<std::endl;
+	}
+	return true;
 }
 
 bool CaenDigitizer::CheckEvent(const CAEN_DGTZ_DPP_PSD_Event_t& event)
@@ -379,74 +805,58 @@ bool CaenDigitizer::CheckEvent(const CAEN_DGTZ_DPP_PSD_Event_t& event)
 	return true;
 }
 
-void CaenDigitizer::SortEvents()
+void CaenDigitizer::SortEvents(ReadoutBuffer* buffer)
 {
-#ifdef USE_WAVEFORMS
-	CAEN_DGTZ_ErrorCode errorCode;
-#endif
-	for(int b = 0; b < fSettings->NumberOfBoards(); ++b) {
-		for(int ch = 0; ch < fSettings->NumberOfChannels(); ++ch) {
-			for(unsigned int ev = 0; ev < fNofEvents[b][ch]; ++ev) {
-				if(!CheckEvent(fEvents[b][ch][ev])) {
-					if(fDebug) {
-						std::cout<<"Skipping event "<<fEventsRead<<", board "<<b<<", channel "<<ch<<", event "<<ev<<" with all times zero!"<<std::endl;
-					}
-					continue;
-				}
-#ifdef USE_WAVEFORMS
-				errorCode = CAEN_DGTZ_DecodeDPPWaveforms(fHandle[b], reinterpret_cast<void*>(fEvents[b][ch]+ev), reinterpret_cast<void*>(fWaveforms[b]));
-				if(errorCode != 0) {
-					if(fDebug) {
-						std::cout<<"failed to decode waveform for board "<<b<<", channel "<<ch<<", event "<<ev<<": "<<fEvents[b][ch][ev].Waveforms<<std::endl;
-					}
-					fWaveforms[b] = nullptr;
-				}
-				auto tmpEvent = new CaenEvent(ch, fEvents[b][ch][ev], fWaveforms[b]);
-#else
-				auto tmpEvent = new CaenEvent(ch, fEvents[b][ch][ev], nullptr);
-#endif
-				fOrdered.insert(tmpEvent);
-				if(fDebug) {
-					std::cout<<"board "<<b<<", channel "<<ch<<", event "<<ev<<":"<<std::endl;
-					tmpEvent->Print();
-				}
-				//fTree->Fill();
-			}
+	for(auto event : buffer->fEvents) {
+		fSorter.Add(buffer->fBoard, event, fRunTime);
+		if(fDebug) {
+			std::cout<<"board "<<buffer->fBoard<<", readout "<<buffer->fSequence<<":"<<std::endl;
+			event->Print();
 		}
 	}
+	buffer->fEvents.clear();
 }
 
 void CaenDigitizer::WriteEvents(bool finish)
 {
-	if(fOrdered.empty()) {
+	if(fSorter.Empty()) {
 		return;
 	}
 #ifdef USE_CURSES
 	int x, y;
 	getyx(stdscr, y, x);
 #endif
-	while(finish || fOrdered.size() > fSettings->BufferSize()) {
-		fEvent = *fOrdered.begin();
-		if(fDebug) {
-			std::cout<<"Writing event "<<fTree->GetEntries()<<std::endl;
-			fEvent->Print();
+	// release everything older than the watermark, and always keep the number of waiting events below the buffer size (if set)
+	uint64_t watermark = fSorter.Watermark(fRunTime, fSettings->MaxLatency(), static_cast<uint64_t>(fSettings->SortMargin()*512.));
+	while(finish || fSorter.Ready(watermark) || (fSettings->BufferSize() > 0 && fSorter.Size() > fSettings->BufferSize())) {
+		CaenEvent* event = fSorter.Pop();
+		// the hit file copies the event, so without a tree it can go straight back to the pool
+		if(fHitOutput != nullptr) {
+			fHitOutput->Add(*event);
+		}
+		if(fWriter != nullptr) {
+			fWriter->Add(event);
+		} else {
+			fWrittenEvents.push_back(event);
 		}
-		fTree->Fill();
-		delete *fOrdered.begin();
-		fOrdered.erase(fOrdered.begin());
 		if(finish) {
-			if(true || fOrdered.size()%1000 == 0) {
+			if(true || fSorter.Size()%1000 == 0) {
 #ifdef USE_CURSES
-				mvprintw(y, x, "%8lu events remaining\n", fOrdered.size());
+				mvprintw(y, x, "%8lu events remaining\n", fSorter.Size());
 				refresh();
 #else
-				std::cout<<std::setw(8)<<fOrdered.size()<<" events remaining\r"<<std::flush;
+				std::cout<<std::setw(8)<<fSorter.Size()<<" events remaining\r"<<std::flush;
 #endif
 			}
-			if(fOrdered.size() == 0) {
+		}
+		if(fSorter.Empty()) {
+			if(finish) {
 				std::cout<<std::endl;
-				break;
 			}
+			break;
 		}
-	} 
+	}
+	if(!fWrittenEvents.empty()) {
+		fEventPool.Release(fWrittenEvents);
+	}
 }
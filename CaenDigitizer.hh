@@ -2,7 +2,11 @@
 #define CAENDIGITIZER_HH
 #include <vector>
 #include <string>
-#include <functional>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 #include "TFile.h"
 #include "TTree.h"
@@ -10,39 +14,102 @@
 
 #include "CaenSettings.hh"
 #include "CaenEvent.hh"
+#include "CaenSorter.hh"
+#include "CaenEventPool.hh"
+#include "CaenTreeWriter.hh"
+#include "CaenRawWriter.hh"
+#include "CaenHitWriter.hh"
+#include "RingBuffer.hh"
+
+// one block of raw data read from a board
+struct ReadoutBuffer {
+	char*    fData;
+	uint32_t fSize;     // bytes read into fData by the last call to CAEN_DGTZ_ReadData
+	int      fBoard;
+	uint64_t fSequence; // readout number of this block for this board
+	uint64_t fWallTime; // time of the readout in ns since the epoch
+	// filled by the decode threads
+	std::vector<CaenEvent*> fEvents;
+	uint64_t fNofEvents; // number of events in this block, including the ones that were skipped
+	bool     fDecoded;   // guarded by CaenDigitizer::fDecodeMutex
+};
+
+// everything a decode thread needs to decode readout buffers from any of the boards
+struct DecodeContext {
+	std::vector<CAEN_DGTZ_DPP_PSD_Event_t**>    fEvents;
+	std::vector<std::vector<uint32_t> >         fNofEvents;
+	std::vector<CAEN_DGTZ_DPP_PSD_Waveforms_t*> fWaveforms;
+	std::vector<CaenEvent*>                     fFreeEvents; // taken from the event pool in batches
+};
 
 class CaenDigitizer {
 public:
 	CaenDigitizer(const CaenSettings& settings, bool debug);
 	~CaenDigitizer();
 
-	double Run(TFile* outputFile, std::ofstream& dataFile, uint64_t events = 0, double runTime = 0);
+	double Run(TFile* outputFile, CaenRawWriter* rawOutput, CaenHitWriter* hitOutput, uint64_t events = 0, double runTime = 0);
 
 private:
+	class DecodeSink; // hands the hits decoded by DecodeBufferNative to the buffer
+
 	void ProgramDigitizer(int board);
-	void CreateTree();
-	void DecodeData(int b);
+	void FinishWriting();
+	bool WriteFailed() const; // true if a background write to the raw data or hit file has failed
+	void AllocateDecodeContext(DecodeContext& context, int b);
+	void FreeDecodeContext(DecodeContext& context, int b);
+	void StartReadout();
+	void StopReadout();
+	void ReadBoard(int b);
+	void StartDecoding();
+	void StopDecoding();
+	void DecodeWorker(int w);
+	void DecodeBuffer(DecodeContext& context, ReadoutBuffer* buffer);
+	void DecodeBufferNative(DecodeContext& context, ReadoutBuffer* buffer);
+	CaenEvent* GetEvent(DecodeContext& context);
+	bool ProcessBuffers(bool wait = false);
 	bool CheckEvent(const CAEN_DGTZ_DPP_PSD_Event_t& event);
-	void SortEvents();
+	bool CheckEvent(const CaenHit& hit);
+	void SortEvents(ReadoutBuffer* buffer);
 	void WriteEvents(bool finish = false);
+	bool WritesEvents() const { return fOutputFile != nullptr || fHitOutput != nullptr; } // false if the hits aren't needed
+	int NumberOfDecodeThreads() const;
 
 	const CaenSettings* fSettings;
 	TFile* fOutputFile;
-	TTree* fTree;
+	CaenTreeWriter* fWriter; // owns the tree while a run is going
+	CaenRawWriter* fRawOutput; // not owned, only set while a run is going
+	CaenHitWriter* fHitOutput; // not owned, only set while a run is going
+	std::vector<CaenEvent*> fWrittenEvents; // events written to the hit file only, returned to the pool after each WriteEvents
 
-	CaenEvent* fEvent;
 	std::vector<int> fHandle;
-	// raw readout data
-	std::vector<char*>    fBuffer; 
-	std::vector<uint32_t> fBufferSize;
-	// DPP events
-	std::vector<CAEN_DGTZ_DPP_PSD_Event_t**> fEvents;
-	std::vector<std::vector<uint32_t> >      fNofEvents;
-	// waveforms
-	std::vector<CAEN_DGTZ_DPP_PSD_Waveforms_t*> fWaveforms;
+	std::vector<bool> fUseWaveforms; // false for boards in list mode
+	// the CAEN library doesn't say it can be used from several threads at once, so all calls using the handle of a board
+	// after the start of the readout (reading, and decoding a whole buffer with the library) hold the mutex of that board
+	std::vector<std::mutex> fHandleMutex;
+	// raw readout data, each board has a pool of buffers that are passed between its reader thread and the main thread
+	std::vector<std::vector<ReadoutBuffer> >   fBuffer;
+	std::vector<RingBuffer<ReadoutBuffer*>*>   fFilledBuffers; // reader thread -> main thread
+	std::vector<RingBuffer<ReadoutBuffer*>*>   fFreeBuffers;   // main thread -> reader thread
+	std::vector<ReadoutBuffer*>                fHeldBuffers;   // buffer each reader thread held when it stopped
+	std::vector<std::thread>                   fReadThreads;
+	std::atomic<bool>                          fReading;
+	std::atomic<int>                           fReadError;
+	std::atomic<uint64_t>                      fReadStalls; // how often a reader thread found no free buffer
+	// decoding, filled buffers are handed to the decode threads and collected again in the order they were handed out
+	std::vector<DecodeContext>   fDecodeContext; // one per decode thread (or one for decoding in the main thread)
+	std::vector<std::thread>     fDecodeThreads;
+	std::deque<ReadoutBuffer*>   fDecodeQueue;    // buffers waiting for a decode thread
+	std::deque<ReadoutBuffer*>   fPendingBuffers; // buffers handed out, in order, only used by the main thread
+	std::mutex                   fDecodeMutex;
+	std::condition_variable      fDecodeCondition;  // signals new buffers in fDecodeQueue
+	std::condition_variable      fDecodedCondition; // signals a buffer has been decoded
+	bool                         fDecoding;
+
+	// events are reused instead of deleted, they go from the decode threads through the sorter to the writer and back
+	CaenEventPool fEventPool;
 
-	// multiset to store and sort event
-	std::multiset<CaenEvent*, std::function<bool(const CaenEvent*, const CaenEvent*)> > fOrdered;
+	// time ordering of the events from all boards and channels
+	CaenSorter fSorter;
 
 	TStopwatch fStopwatch;
 
@@ -51,6 +118,7 @@ private:
 	double   fRunTime;
 	uint64_t fOldBytesRead;
 	uint64_t fOldEventsRead;
+	uint64_t fOldAllocated;
 	double   fOldRunTime;
 
 	bool fDebug;
@@ -2,14 +2,136 @@
 
 #include <iostream>
 
+#include "TBuffer.h"
+#include "TClass.h"
+
+#include "CaenTraceCodec.hh"
+#include "CaenUnpack.hh"
+
 ClassImp(CaenEvent)
 
+namespace {
+	// channel, board, flags, trigger time, extended timestamp, cfd, charge, short gate, format, format2, baseline, pur
+	const int kPackedSize = 4 + 1 + 1 + 4 + 2 + 2 + 2 + 2 + 4 + 4 + 2 + 2;
+	enum EPackedFlags : uint8_t { kLostTrigger = 0x1, kOverRange = 0x2, kKiloCount = 0x4, kNLostCount = 0x8 };
+
+	// big-endian, like everything else ROOT writes
+	inline void Pack(char*& buffer, uint32_t value, int nofBytes)
+	{
+		for(int i = nofBytes - 1; i >= 0; --i) {
+			*buffer++ = static_cast<char>((value >> (8*i)) & 0xff);
+		}
+	}
+
+	inline uint32_t Unpack(const char*& buffer, int nofBytes)
+	{
+		uint32_t value = 0;
+		for(int i = 0; i < nofBytes; ++i) {
+			value = (value << 8) | static_cast<uint8_t>(*buffer++);
+		}
+		return value;
+	}
+
+	// version 4 wrote the traces as they are
+	// the traces keep their capacity, so reading into the same event doesn't allocate once they are large enough
+	template<class Sample>
+	void ReadTraces(TBuffer& b, std::vector<std::vector<Sample> >& traces)
+	{
+		UChar_t nofTraces;
+		b >> nofTraces;
+		traces.resize(nofTraces);
+		for(auto& trace : traces) {
+			UInt_t nofSamples;
+			b >> nofSamples;
+			trace.resize(nofSamples);
+			b.ReadFastArray(trace.data(), nofSamples);
+		}
+	}
+
+	// since version 5 the traces are coded by CaenTraceCodec, each trace is written as the number of samples, the
+	// number of bytes, and the bytes
+	// the events are streamed by the tree writer thread and read by several threads in Histograms, so each thread
+	// needs its own buffer
+	thread_local std::vector<uint8_t> codecBuffer;
+
+	inline size_t MaxEncodedSize(const std::vector<uint16_t>& trace) { return MaxEncodedAnalogSize(trace.size()); }
+	inline size_t MaxEncodedSize(const std::vector<uint8_t>& trace)  { return MaxEncodedDigitalSize(trace.size()); }
+	inline size_t Encode(const std::vector<uint16_t>& trace, uint8_t* output) { return EncodeAnalog(trace.data(), trace.size(), output); }
+	inline size_t Encode(const std::vector<uint8_t>& trace, uint8_t* output)  { return EncodeDigital(trace.data(), trace.size(), output); }
+	inline bool Decode(const uint8_t* input, size_t size, std::vector<uint16_t>& trace) { return DecodeAnalog(input, size, trace.data(), trace.size()); }
+	inline bool Decode(const uint8_t* input, size_t size, std::vector<uint8_t>& trace)  { return DecodeDigital(input, size, trace.data(), trace.size()); }
+
+	template<class Sample>
+	void WriteEncodedTraces(TBuffer& b, const std::vector<std::vector<Sample> >& traces)
+	{
+		b << static_cast<UChar_t>(traces.size());
+		for(const auto& trace : traces) {
+			if(codecBuffer.size() < MaxEncodedSize(trace)) {
+				codecBuffer.resize(MaxEncodedSize(trace));
+			}
+			UInt_t size = Encode(trace, codecBuffer.data());
+			b << static_cast<UInt_t>(trace.size());
+			b << size;
+			b.WriteFastArray(codecBuffer.data(), size);
+		}
+	}
+
+	// writes nofTraces traces that are still coded, returns the bytes after them
+	const uint8_t* WriteCodedTraces(TBuffer& b, const uint8_t* bytes, const CaenCodedTrace* sizes, size_t nofTraces)
+	{
+		b << static_cast<UChar_t>(nofTraces);
+		for(size_t t = 0; t < nofTraces; ++t) {
+			b << static_cast<UInt_t>(sizes[t].fNofSamples);
+			b << static_cast<UInt_t>(sizes[t].fSize);
+			b.WriteFastArray(bytes, sizes[t].fSize);
+			bytes += sizes[t].fSize;
+		}
+		return bytes;
+	}
+
+	// appends the coded traces to bytes and their sizes to sizes without decoding them, returns the number of traces
+	size_t ReadCodedTraces(TBuffer& b, std::vector<uint8_t>& bytes, std::vector<CaenCodedTrace>& sizes)
+	{
+		UChar_t nofTraces;
+		b >> nofTraces;
+		for(UChar_t t = 0; t < nofTraces; ++t) {
+			UInt_t nofSamples;
+			UInt_t size;
+			b >> nofSamples;
+			b >> size;
+			size_t begin = bytes.size();
+			bytes.resize(begin + size);
+			b.ReadFastArray(bytes.data() + begin, size);
+			sizes.push_back(CaenCodedTrace{ nofSamples, size });
+		}
+		return nofTraces;
+	}
+
+	// returns false if any of the traces can't be decoded, those traces are left empty
+	template<class Sample>
+	bool DecodeTraces(const uint8_t*& bytes, const CaenCodedTrace* sizes, std::vector<std::vector<Sample> >& traces)
+	{
+		bool result = true;
+		for(auto& trace : traces) {
+			trace.resize(sizes->fNofSamples);
+			if(!Decode(bytes, sizes->fSize, trace)) {
+				trace.clear();
+				result = false;
+			}
+			bytes += sizes->fSize;
+			++sizes;
+		}
+		return result;
+	}
+}
+
 CaenEvent::CaenEvent()
 {
 	Clear();
 }
 
 CaenEvent::CaenEvent(int channel, const CAEN_DGTZ_DPP_PSD_Event_t& event, const CAEN_DGTZ_DPP_PSD_Waveforms_t* waveforms)
+	: fBoard(0), fTraceState(kTracesUnpacked), fDualTrace(false), fNofCodedWaveforms(0)
 {
 	Read(channel, event, waveforms);
 }
@@ -30,6 +152,8 @@ void CaenEvent::Read(int channel, const CAEN_DGTZ_DPP_PSD_Event_t& event, const
 	fFormat2 = event.Format2;
 	fBaseline = event.Baseline;
 	fPur = event.Pur;
+	// the traces keep their capacity, so reading into a reused event doesn't allocate once the traces are large enough
+	fTraceState = kTracesUnpacked;
 	fWaveforms.resize(2);
 	fDigitalWaveforms.resize(2);
 	if(waveforms != nullptr) {
@@ -37,12 +161,33 @@ void CaenEvent::Read(int channel, const CAEN_DGTZ_DPP_PSD_Event_t& event, const
 		fWaveforms[1].assign(waveforms->Trace2, waveforms->Trace2 + waveforms->Ns);
 		fDigitalWaveforms[0].assign(waveforms->DTrace1, waveforms->DTrace1 + waveforms->Ns);
 		fDigitalWaveforms[1].assign(waveforms->DTrace2, waveforms->DTrace2 + waveforms->Ns);
+	} else {
+		ClearWaveforms();
 	}
 }
 
+void CaenEvent::Read(const CaenHit& hit)
+{
+	fChannel = hit.fChannel;
+	fTriggerTime = hit.fTriggerTime;
+	fCharge = hit.fCharge;
+	fExtendedTimestamp = hit.fExtendedTimestamp;
+	fCfd = hit.fCfd;
+	fLostTrigger = hit.fLostTrigger;
+	fOverRange = hit.fOverRange;
+	fKiloCount = hit.fKiloCount;
+	fNLostCount = hit.fNLostCount;
+	fShortGate = hit.fShortGate;
+	fFormat = hit.fFormat;
+	fFormat2 = 0;
+	fBaseline = hit.fBaseline;
+	fPur = 0;
+}
+
 void CaenEvent::Clear()
 {
 	fChannel = -1;
+	fBoard = 0;
 	fTriggerTime = 0;
 	fCharge = 0;
 	fExtendedTimestamp = 0;
@@ -58,10 +203,17 @@ void CaenEvent::Clear()
 	fPur = 0;
 	fWaveforms.clear();
 	fDigitalWaveforms.clear();
+	fTraceState = kTracesUnpacked;
+	fSampleWords.clear();
+	fDualTrace = false;
+	fCodedTraces.clear();
+	fCodedSize.clear();
+	fNofCodedWaveforms = 0;
 }
 
 void CaenEvent::AddWaveformSample(size_t i, uint16_t sample)
 {
+	UnpackTraces();
 	if(i >= fWaveforms.size()) {
 		fWaveforms.resize(i+1); 
 	}
@@ -70,12 +222,100 @@ void CaenEvent::AddWaveformSample(size_t i, uint16_t sample)
 
 void CaenEvent::AddDigitalWaveformSample(size_t i, uint8_t sample)
 {
+	UnpackTraces();
 	if(i >= fDigitalWaveforms.size()) {
 		fDigitalWaveforms.resize(i+1);
 	}
 	fDigitalWaveforms[i].push_back(sample);
 }
 
+uint16_t* CaenEvent::ResizeWaveform(size_t i, size_t nofSamples)
+{
+	// the other traces have to stay as they are
+	UnpackTraces();
+	if(i >= fWaveforms.size()) {
+		fWaveforms.resize(i+1);
+	}
+	fWaveforms[i].resize(nofSamples);
+	return fWaveforms[i].data();
+}
+
+uint8_t* CaenEvent::ResizeDigitalWaveform(size_t i, size_t nofSamples)
+{
+	UnpackTraces();
+	if(i >= fDigitalWaveforms.size()) {
+		fDigitalWaveforms.resize(i+1);
+	}
+	fDigitalWaveforms[i].resize(nofSamples);
+	return fDigitalWaveforms[i].data();
+}
+
+uint32_t* CaenEvent::ResizeSampleWords(size_t nofWords, bool dualTrace)
+{
+	fTraceState = kTracesSampleWords;
+	fSampleWords.resize(nofWords);
+	fDualTrace = dualTrace;
+	return fSampleWords.data();
+}
+
+void CaenEvent::ClearWaveforms()
+{
+	fTraceState = kTracesUnpacked;
+	for(auto& trace : fWaveforms) trace.clear();
+	for(auto& trace : fDigitalWaveforms) trace.clear();
+}
+
+CaenTraceView<uint16_t> CaenEvent::Waveform(size_t i) const
+{
+	UnpackTraces();
+	const auto& trace = fWaveforms.at(i);
+	return CaenTraceView<uint16_t>(trace.data(), trace.size());
+}
+
+CaenTraceView<uint8_t> CaenEvent::DigitalWaveform(size_t i) const
+{
+	UnpackTraces();
+	const auto& trace = fDigitalWaveforms.at(i);
+	return CaenTraceView<uint8_t>(trace.data(), trace.size());
+}
+
+void CaenEvent::UnpackTraces() const
+{
+	if(fTraceState == kTracesSampleWords) {
+		UnpackSampleWords();
+	} else if(fTraceState == kTracesCoded) {
+		DecodeCodedTraces();
+	}
+	fTraceState = kTracesUnpacked;
+}
+
+void CaenEvent::UnpackSampleWords() const
+{
+	// same sizes as the decode sink of CaenDigitizer used to give the traces
+	size_t nofSamples = 2*fSampleWords.size();
+	size_t nofAnalogSamples = fDualTrace ? nofSamples/2 : nofSamples;
+	fWaveforms.resize(2);
+	fDigitalWaveforms.resize(2);
+	fWaveforms[0].resize(nofAnalogSamples);
+	fWaveforms[1].resize(fDualTrace ? nofAnalogSamples : 0);
+	fDigitalWaveforms[0].resize(nofSamples);
+	fDigitalWaveforms[1].resize(nofSamples);
+	CaenTraces traces = { { fWaveforms[0].data(), fWaveforms[1].data() }, { fDigitalWaveforms[0].data(), fDigitalWaveforms[1].data() }, nullptr };
+	UnpackSamples(fSampleWords.data(), fSampleWords.size(), fDualTrace, traces);
+}
+
+void CaenEvent::DecodeCodedTraces() const
+{
+	fWaveforms.resize(fNofCodedWaveforms);
+	fDigitalWaveforms.resize(fCodedSize.size() - fNofCodedWaveforms);
+	const uint8_t* bytes = fCodedTraces.data();
+	bool analog = DecodeTraces(bytes, fCodedSize.data(), fWaveforms);
+	bool digital = DecodeTraces(bytes, fCodedSize.data() + fNofCodedWaveforms, fDigitalWaveforms);
+	if(!analog || !digital) {
+		std::cerr<<"Failed to decode the traces of board "<<static_cast<int>(fBoard)<<", channel "<<fChannel<<", timestamp "<<GetTimestamp()<<std::endl;
+	}
+}
+
 uint64_t CaenEvent::GetTimestamp() const {
 	uint64_t timestamp = fExtendedTimestamp;
 	timestamp = (timestamp<<31) | fTriggerTime;
@@ -91,6 +331,7 @@ double CaenEvent::GetTime() const
 void CaenEvent::Print(Option_t*) const
 {
 	std::cout<<"event "<<this<<std::endl;
+	std::cout<<"board = "<<static_cast<int>(fBoard)<<", channel = "<<fChannel<<std::endl;
 	std::cout<<"trigger time = "<<fTriggerTime<<" = 0x"<<std::hex<<fTriggerTime<<std::dec<<std::endl;
 	std::cout<<"charge = "<<fCharge<<" = 0x"<<std::hex<<fCharge<<std::dec<<std::endl;
 	std::cout<<"extended TS = "<<fExtendedTimestamp<<" = 0x"<<std::hex<<fExtendedTimestamp<<std::dec<<std::endl;
@@ -104,6 +345,7 @@ void CaenEvent::Print(Option_t*) const
 	std::cout<<"format2 = "<<fFormat2<<" = 0x"<<std::hex<<fFormat2<<std::dec<<std::endl;
 	std::cout<<"baseline = "<<fBaseline<<" = 0x"<<std::hex<<fBaseline<<std::dec<<std::endl;
 	std::cout<<"pur = "<<fPur<<" = 0x"<<std::hex<<fPur<<std::dec<<std::endl;
+	UnpackTraces();
 	for(size_t i = 0; i < fWaveforms.size(); ++i) {
 		std::cout<<i<<". waveform with "<<fWaveforms[i].size()<<" samples"<<std::endl;
 	}
@@ -111,3 +353,89 @@ void CaenEvent::Print(Option_t*) const
 		std::cout<<i<<". digital waveform with "<<fDigitalWaveforms[i].size()<<" samples"<<std::endl;
 	}
 }
+
+void CaenEvent::Streamer(TBuffer& b)
+{
+	// the member-wise streamer wrote the TObject part and every member on its own, version 4 writes neither the
+	// TObject part (unique ID and bits are never used) nor the members one by one, version 5 also codes the traces
+	// (which are only decoded when they are accessed)
+	char packed[kPackedSize];
+	if(b.IsReading()) {
+		UInt_t start;
+		UInt_t count;
+		Version_t version = b.ReadVersion(&start, &count);
+		if(version < 4) {
+			// the traces are read as they are, coded traces of an earlier entry mustn't be decoded over them
+			fTraceState = kTracesUnpacked;
+			fCodedTraces.clear();
+			fCodedSize.clear();
+			b.ReadClassBuffer(CaenEvent::Class(), this, version, start, count);
+			if(version < 3) fBoard = 0;
+			return;
+		}
+		b.ReadFastArray(packed, kPackedSize);
+		const char* buffer = packed;
+		fChannel           = static_cast<int32_t>(Unpack(buffer, 4));
+		fBoard             = Unpack(buffer, 1);
+		uint8_t flags      = Unpack(buffer, 1);
+		fTriggerTime       = Unpack(buffer, 4);
+		fExtendedTimestamp = Unpack(buffer, 2);
+		fCfd               = Unpack(buffer, 2);
+		fCharge            = Unpack(buffer, 2);
+		fShortGate         = Unpack(buffer, 2);
+		fFormat            = Unpack(buffer, 4);
+		fFormat2           = Unpack(buffer, 4);
+		fBaseline          = Unpack(buffer, 2);
+		fPur               = Unpack(buffer, 2);
+		fLostTrigger = (flags & kLostTrigger) != 0;
+		fOverRange   = (flags & kOverRange) != 0;
+		fKiloCount   = (flags & kKiloCount) != 0;
+		fNLostCount  = (flags & kNLostCount) != 0;
+		if(version < 5) {
+			fTraceState = kTracesUnpacked;
+			fCodedTraces.clear();
+			fCodedSize.clear();
+			ReadTraces(b, fWaveforms);
+			ReadTraces(b, fDigitalWaveforms);
+		} else {
+			// decoded on first access
+			fTraceState = kTracesCoded;
+			fCodedTraces.clear();
+			fCodedSize.clear();
+			fNofCodedWaveforms = ReadCodedTraces(b, fCodedTraces, fCodedSize);
+			ReadCodedTraces(b, fCodedTraces, fCodedSize);
+		}
+		b.CheckByteCount(start, count, CaenEvent::Class());
+	} else {
+		UInt_t count = b.WriteVersion(CaenEvent::Class(), true);
+		uint8_t flags = 0;
+		if(fLostTrigger) flags |= kLostTrigger;
+		if(fOverRange)   flags |= kOverRange;
+		if(fKiloCount)   flags |= kKiloCount;
+		if(fNLostCount)  flags |= kNLostCount;
+		char* buffer = packed;
+		Pack(buffer, static_cast<uint32_t>(fChannel), 4);
+		Pack(buffer, fBoard, 1);
+		Pack(buffer, flags, 1);
+		Pack(buffer, fTriggerTime, 4);
+		Pack(buffer, fExtendedTimestamp, 2);
+		Pack(buffer, fCfd, 2);
+		Pack(buffer, fCharge, 2);
+		Pack(buffer, fShortGate, 2);
+		Pack(buffer, fFormat, 4);
+		Pack(buffer, fFormat2, 4);
+		Pack(buffer, fBaseline, 2);
+		Pack(buffer, fPur, 2);
+		b.WriteFastArray(packed, kPackedSize);
+		if(fTraceState == kTracesCoded) {
+			// traces that haven't been accessed since they were read are still coded
+			const uint8_t* bytes = WriteCodedTraces(b, fCodedTraces.data(), fCodedSize.data(), fNofCodedWaveforms);
+			WriteCodedTraces(b, bytes, fCodedSize.data() + fNofCodedWaveforms, fCodedSize.size() - fNofCodedWaveforms);
+		} else {
+			UnpackTraces();
+			WriteEncodedTraces(b, fWaveforms);
+			WriteEncodedTraces(b, fDigitalWaveforms);
+		}
+		b.SetByteCount(count, true);
+	}
+}
@@ -1,10 +1,52 @@
 #ifndef CAENEVENT_HH
 #define CAENEVENT_HH
 
+#include <vector>
+
 #include "TObject.h"
 
 #include "CAENDigitizer.h"
 
+#include "CaenHit.hh"
+
+// Non-owning view of the samples of one trace, only valid until the event is changed or read again.
+// It has the same interface as a const std::vector, so it can be used in range-based for loops and algorithms, and it
+// can still be assigned to a std::vector to get a copy of the trace.
+template<class Sample>
+class CaenTraceView {
+public:
+	CaenTraceView() : fData(nullptr), fSize(0) {}
+	CaenTraceView(const Sample* data, size_t size) : fData(data), fSize(size) {}
+
+	const Sample* data() const { return fData; }
+	size_t size() const { return fSize; }
+	bool empty() const { return fSize == 0; }
+	const Sample& operator[](size_t i) const { return fData[i]; }
+	const Sample* begin() const { return fData; }
+	const Sample* end() const { return fData + fSize; }
+
+	operator std::vector<Sample>() const { return std::vector<Sample>(fData, fData + fSize); }
+
+private:
+	const Sample* fData;
+	size_t fSize;
+};
+
+// Size of one trace coded by CaenTraceCodec, as read from a file.
+struct CaenCodedTrace {
+	uint32_t fNofSamples;
+	uint32_t fSize;
+};
+
+// Since version 4 CaenEvent is written by a hand-written streamer (see CaenEvent::Streamer), the fixed size members are
+// written as one packed block and the traces as length-prefixed arrays. Since version 5 the traces are compressed with
+// CaenTraceCodec before they are written. Older versions are still read.
+//
+// The traces are unpacked on first access: an event filled via ResizeSampleWords keeps the sample words of the
+// digitizer, and an event read from a version 5 file keeps the coded traces (which are written back as they are if the
+// traces haven't been accessed). So events that are only sorted, counted, or histogrammed never pay for the traces.
+// Always access the traces through the member functions, the data members are only filled once the traces are unpacked.
+// The first access changes the event, so it must not happen from several threads at once.
 class CaenEvent : public TObject {
 public:
 	CaenEvent();
@@ -13,9 +55,11 @@ public:
 
 	void Clear();
 	void Read(int channel, const CAEN_DGTZ_DPP_PSD_Event_t& event, const CAEN_DGTZ_DPP_PSD_Waveforms_t* waveforms);
+	void Read(const CaenHit& hit); // leaves the traces and the board untouched
 	void Print(Option_t* opt = NULL) const;
 
 	void Channel(int value) { fChannel = value; }
+	void Board(uint8_t value) { fBoard = value; }
 	void TriggerTime(uint32_t value) { fTriggerTime = value; }
 	void Charge(uint16_t value) { fCharge = value; }
 	void ExtendedTimestamp(uint16_t value) { fExtendedTimestamp = value; }
@@ -27,8 +71,16 @@ public:
 	void ShortGate(uint16_t value) { fShortGate = value; }
 	void AddWaveformSample(size_t i, uint16_t sample);
 	void AddDigitalWaveformSample(size_t i, uint8_t sample);
+	// resize trace i to nofSamples samples and return its data, so it can be filled in place
+	uint16_t* ResizeWaveform(size_t i, size_t nofSamples);
+	uint8_t*  ResizeDigitalWaveform(size_t i, size_t nofSamples);
+	// replace all traces with nofWords sample words that are unpacked on first access (see CaenUnpack.hh), returns the
+	// space for the words, so they can be filled in place
+	uint32_t* ResizeSampleWords(size_t nofWords, bool dualTrace);
+	void ClearWaveforms(); // empties all traces, but keeps their capacity
 
 	int Channel() const { return fChannel; }
+	uint8_t Board() const { return fBoard; }
 	uint32_t TriggerTime() const { return fTriggerTime; }
 	uint16_t Charge() const { return fCharge; }
 	uint16_t ExtendedTimestamp() const { return fExtendedTimestamp; }
@@ -38,16 +90,29 @@ public:
 	bool KiloCount() const { return fKiloCount; }
 	bool NLostCount() const { return fNLostCount; }
 	uint16_t ShortGate() const { return fShortGate; }
-	std::vector<uint16_t> Waveform(size_t i) const { return fWaveforms.at(i); }
-	std::vector<uint8_t>  DigitalWaveform(size_t i) const { return fDigitalWaveforms.at(i); }
+	uint32_t Format() const { return fFormat; }
+	uint16_t Baseline() const { return fBaseline; }
+	CaenTraceView<uint16_t> Waveform(size_t i) const;
+	CaenTraceView<uint8_t>  DigitalWaveform(size_t i) const;
+	const std::vector<std::vector<uint16_t> >& Waveforms() const { UnpackTraces(); return fWaveforms; }
+	const std::vector<std::vector<uint8_t> >&  DigitalWaveforms() const { UnpackTraces(); return fDigitalWaveforms; }
+	bool TracesUnpacked() const { return fTraceState == kTracesUnpacked; }
 
 	uint64_t GetTimestamp() const;
 	double GetTime() const;
+	uint64_t GetTimeKey() const { return (GetTimestamp()<<10) + fCfd; } // fixed point time in units of 1/512 ns, sorts like GetTime()
 
 	bool CheckTime() const { return (fExtendedTimestamp != 0 || fTriggerTime != 0 || fCfd != 0); }
 
 private:
+	enum ETraceState : uint8_t { kTracesUnpacked, kTracesSampleWords, kTracesCoded };
+
+	void UnpackTraces() const;
+	void UnpackSampleWords() const;
+	void DecodeCodedTraces() const;
+
 	int fChannel;
+	uint8_t fBoard;
 	uint32_t fTriggerTime;
 	uint16_t fCharge;
 	uint16_t fExtendedTimestamp;
@@ -61,9 +126,17 @@ private:
 	uint32_t fFormat2;
 	uint16_t fBaseline;
 	uint16_t fPur;
-	std::vector<std::vector<uint16_t> > fWaveforms;
-	std::vector<std::vector<uint8_t> >  fDigitalWaveforms;
+	mutable std::vector<std::vector<uint16_t> > fWaveforms;
+	mutable std::vector<std::vector<uint8_t> >  fDigitalWaveforms;
+
+	// packed traces, they all keep their capacity like the traces
+	mutable ETraceState fTraceState;        //!
+	std::vector<uint32_t> fSampleWords;     //! sample words as sent by the digitizer
+	bool fDualTrace;                        //!
+	std::vector<uint8_t> fCodedTraces;      //! all coded traces, one after the other
+	std::vector<CaenCodedTrace> fCodedSize; //! the analog traces, followed by the digital ones
+	uint8_t fNofCodedWaveforms;             //!
 
-	ClassDef(CaenEvent, 2)
+	ClassDef(CaenEvent, 5)
 };
 #endif
@@ -0,0 +1,47 @@
+#include "CaenEventPool.hh"
+
+CaenEventPool::CaenEventPool(size_t slabSize)
+	: fSlabSize(slabSize), fAllocated(0)
+{
+}
+
+CaenEventPool::~CaenEventPool()
+{
+	for(auto slab : fSlabs) {
+		delete[] slab;
+	}
+}
+
+void CaenEventPool::Get(std::vector<CaenEvent*>& events, size_t n)
+{
+	std::lock_guard<std::mutex> lock(fMutex);
+	while(fFree.size() < n) {
+		AllocateSlab();
+	}
+	events.insert(events.end(), fFree.end() - n, fFree.end());
+	fFree.resize(fFree.size() - n);
+}
+
+void CaenEventPool::Release(std::vector<CaenEvent*>& events)
+{
+	std::lock_guard<std::mutex> lock(fMutex);
+	fFree.insert(fFree.end(), events.begin(), events.end());
+	events.clear();
+}
+
+size_t CaenEventPool::Free()
+{
+	std::lock_guard<std::mutex> lock(fMutex);
+	return fFree.size();
+}
+
+void CaenEventPool::AllocateSlab()
+{
+	CaenEvent* slab = new CaenEvent[fSlabSize];
+	fSlabs.push_back(slab);
+	// hand out the events from the front of the slab first
+	for(size_t i = fSlabSize; i > 0; --i) {
+		fFree.push_back(slab + i - 1);
+	}
+	fAllocated += fSlabSize;
+}
@@ -0,0 +1,38 @@
+#ifndef CAENEVENTPOOL_HH
+#define CAENEVENTPOOL_HH
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+
+#include "CaenEvent.hh"
+
+// Pool of CaenEvents that are reused instead of being deleted.
+// Events are allocated in slabs and never freed until the pool is destroyed, so their waveform vectors keep the
+// capacity they grew to. Events are handed out and returned in batches to keep the locking out of the per hit work,
+// e.g. each decode thread keeps a small cache of free events that it refills with Get, and the tree writer returns a
+// whole batch of written events with Release.
+class CaenEventPool {
+public:
+	explicit CaenEventPool(size_t slabSize = 4096);
+	~CaenEventPool();
+
+	void Get(std::vector<CaenEvent*>& events, size_t n); // appends n free events to events
+	void Release(std::vector<CaenEvent*>& events);        // returns all events to the pool and clears the vector
+
+	uint64_t Allocated() const { return fAllocated; } // number of events allocated so far
+	size_t Free();
+
+private:
+	CaenEventPool(const CaenEventPool&) = delete;
+	CaenEventPool& operator=(const CaenEventPool&) = delete;
+
+	void AllocateSlab(); // needs fMutex to be locked
+
+	size_t fSlabSize;
+	std::vector<CaenEvent*> fSlabs;
+	std::vector<CaenEvent*> fFree;
+	std::mutex fMutex;
+	std::atomic<uint64_t> fAllocated;
+};
+#endif
@@ -0,0 +1,229 @@
+#include "CaenFlatTree.hh"
+
+#include <algorithm>
+#include <cstring>
+
+#include "TBranch.h"
+
+CaenFlatTree::CaenFlatTree()
+	: fChannel(0), fBoard(0), fTimestamp(0), fCfd(0), fCharge(0), fShortGate(0), fBaseline(0), fFlags(0),
+	  fNofWaveforms(0), fNofSamples(0), fNofDigitalWaveforms(0), fNofDigitalSamples(0),
+	  fTree(nullptr), fWaveforms(false), fSamplesBranch(nullptr), fDigitalSamplesBranch(nullptr), fNofSamplesBranch(nullptr), fNofDigitalSamplesBranch(nullptr),
+	  fSamplesAddress(nullptr), fDigitalSamplesAddress(nullptr)
+{
+	std::fill(fWaveformEnd, fWaveformEnd + kMaxTraces, 0);
+	std::fill(fDigitalWaveformEnd, fDigitalWaveformEnd + kMaxTraces, 0);
+	// the branches need a valid address even before the first hit with traces
+	fSamples.reserve(1);
+	fDigitalSamples.reserve(1);
+}
+
+void CaenFlatTree::Branch(TTree* tree, bool waveforms)
+{
+	fTree = tree;
+	fWaveforms = waveforms;
+	fTree->Branch("channel", &fChannel, "channel/b");
+	fTree->Branch("board", &fBoard, "board/b");
+	fTree->Branch("timestamp", &fTimestamp, "timestamp/l");
+	fTree->Branch("cfd", &fCfd, "cfd/s");
+	fTree->Branch("charge", &fCharge, "charge/s");
+	fTree->Branch("shortGate", &fShortGate, "shortGate/s");
+	fTree->Branch("baseline", &fBaseline, "baseline/s");
+	fTree->Branch("flags", &fFlags, "flags/b");
+	if(!fWaveforms) {
+		return;
+	}
+	fTree->Branch("nofWaveforms", &fNofWaveforms, "nofWaveforms/b");
+	fTree->Branch("waveformEnd", fWaveformEnd, "waveformEnd[nofWaveforms]/i");
+	fNofSamplesBranch = fTree->Branch("nofSamples", &fNofSamples, "nofSamples/i");
+	fSamplesAddress = fSamples.data();
+	fSamplesBranch = fTree->Branch("samples", fSamplesAddress, "samples[nofSamples]/s");
+	fTree->Branch("nofDigitalWaveforms", &fNofDigitalWaveforms, "nofDigitalWaveforms/b");
+	fTree->Branch("digitalWaveformEnd", fDigitalWaveformEnd, "digitalWaveformEnd[nofDigitalWaveforms]/i");
+	fNofDigitalSamplesBranch = fTree->Branch("nofDigitalSamples", &fNofDigitalSamples, "nofDigitalSamples/i");
+	fDigitalSamplesAddress = fDigitalSamples.data();
+	fDigitalSamplesBranch = fTree->Branch("digitalSamples", fDigitalSamplesAddress, "digitalSamples[nofDigitalSamples]/b");
+}
+
+bool CaenFlatTree::SetBranchAddresses(TTree* tree, bool waveforms)
+{
+	if(!IsFlat(tree)) {
+		return false;
+	}
+	fTree = tree;
+	fWaveforms = waveforms && tree->GetBranch("samples") != nullptr;
+	fTree->SetBranchAddress("channel", &fChannel);
+	fTree->SetBranchAddress("board", &fBoard);
+	fTree->SetBranchAddress("timestamp", &fTimestamp);
+	fTree->SetBranchAddress("cfd", &fCfd);
+	fTree->SetBranchAddress("charge", &fCharge);
+	fTree->SetBranchAddress("shortGate", &fShortGate);
+	fTree->SetBranchAddress("baseline", &fBaseline);
+	fTree->SetBranchAddress("flags", &fFlags);
+	if(!fWaveforms) {
+		fNofWaveforms = 0;
+		fNofSamples = 0;
+		fNofDigitalWaveforms = 0;
+		fNofDigitalSamples = 0;
+		return true;
+	}
+	fTree->SetBranchAddress("nofWaveforms", &fNofWaveforms);
+	fTree->SetBranchAddress("waveformEnd", fWaveformEnd);
+	fTree->SetBranchAddress("nofSamples", &fNofSamples);
+	fTree->SetBranchAddress("nofDigitalWaveforms", &fNofDigitalWaveforms);
+	fTree->SetBranchAddress("digitalWaveformEnd", fDigitalWaveformEnd);
+	fTree->SetBranchAddress("nofDigitalSamples", &fNofDigitalSamples);
+	fNofSamplesBranch = fTree->GetBranch("nofSamples");
+	fNofDigitalSamplesBranch = fTree->GetBranch("nofDigitalSamples");
+	fSamplesBranch = fTree->GetBranch("samples");
+	fDigitalSamplesBranch = fTree->GetBranch("digitalSamples");
+	fSamplesAddress = nullptr;
+	fDigitalSamplesAddress = nullptr;
+	UpdateAddresses();
+	return true;
+}
+
+void CaenFlatTree::Set(const CaenEvent& event)
+{
+	fChannel = event.Channel();
+	fBoard = event.Board();
+	fTimestamp = event.GetTimestamp();
+	fCfd = event.Cfd();
+	fCharge = event.Charge();
+	fShortGate = event.ShortGate();
+	fBaseline = event.Baseline();
+	fFlags = 0;
+	if(event.LostTrigger()) fFlags |= CaenHitColumns::kLostTrigger;
+	if(event.OverRange())   fFlags |= CaenHitColumns::kOverRange;
+	if(event.KiloCount())   fFlags |= CaenHitColumns::kKiloCount;
+	if(event.NLostCount())  fFlags |= CaenHitColumns::kNLostCount;
+	if((event.Format()>>31) == 0x1) fFlags |= CaenHitColumns::kDualTrace;
+	if(!fWaveforms) {
+		return;
+	}
+
+	const auto& waveforms = event.Waveforms();
+	fNofWaveforms = std::min<size_t>(waveforms.size(), kMaxTraces);
+	fSamples.clear();
+	for(uint8_t t = 0; t < fNofWaveforms; ++t) {
+		fSamples.insert(fSamples.end(), waveforms[t].begin(), waveforms[t].end());
+		fWaveformEnd[t] = fSamples.size();
+	}
+	fNofSamples = fSamples.size();
+
+	const auto& digitalWaveforms = event.DigitalWaveforms();
+	fNofDigitalWaveforms = std::min<size_t>(digitalWaveforms.size(), kMaxTraces);
+	fDigitalSamples.clear();
+	for(uint8_t t = 0; t < fNofDigitalWaveforms; ++t) {
+		fDigitalSamples.insert(fDigitalSamples.end(), digitalWaveforms[t].begin(), digitalWaveforms[t].end());
+		fDigitalWaveformEnd[t] = fDigitalSamples.size();
+	}
+	fNofDigitalSamples = fDigitalSamples.size();
+}
+
+void CaenFlatTree::Set(const CaenHitColumns& hits, size_t i)
+{
+	fChannel = hits.fChannel[i];
+	fBoard = hits.fBoard[i];
+	fTimestamp = hits.Timestamp(i);
+	fCfd = hits.fCfd[i];
+	fCharge = hits.fCharge[i];
+	fShortGate = hits.fShortGate[i];
+	fBaseline = hits.fBaseline[i];
+	fFlags = hits.fFlags[i];
+	if(!fWaveforms) {
+		return;
+	}
+
+	// the samples of a hit are already contiguous in the columns, two traces of each kind (like a CaenEvent)
+	size_t nofSamples = hits.NofSamples(i);
+	size_t nofDigitalSamples = hits.NofDigitalSamples(i);
+	bool dualTrace = (fFlags & CaenHitColumns::kDualTrace) != 0;
+	if(nofSamples == 0 && nofDigitalSamples == 0) {
+		fNofWaveforms = 0;
+		fNofSamples = 0;
+		fNofDigitalWaveforms = 0;
+		fNofDigitalSamples = 0;
+		return;
+	}
+	fNofWaveforms = 2;
+	fWaveformEnd[0] = nofSamples;
+	fWaveformEnd[1] = dualTrace ? 2*nofSamples : nofSamples;
+	fNofSamples = fWaveformEnd[1];
+	fSamples.assign(hits.Waveform(i, 0), hits.Waveform(i, 0) + fNofSamples);
+
+	fNofDigitalWaveforms = 2;
+	fDigitalWaveformEnd[0] = nofDigitalSamples;
+	fDigitalWaveformEnd[1] = 2*nofDigitalSamples;
+	fNofDigitalSamples = fDigitalWaveformEnd[1];
+	fDigitalSamples.assign(hits.DigitalWaveform(i, 0), hits.DigitalWaveform(i, 0) + fNofDigitalSamples);
+}
+
+void CaenFlatTree::Fill()
+{
+	if(fWaveforms) {
+		UpdateAddresses();
+	}
+	fTree->Fill();
+}
+
+void CaenFlatTree::GetEntry(Long64_t entry)
+{
+	if(fWaveforms) {
+		// read the number of samples first, so the buffers can be made large enough for the samples
+		fNofSamplesBranch->GetEntry(entry);
+		fNofDigitalSamplesBranch->GetEntry(entry);
+		if(fSamples.size() < fNofSamples) {
+			fSamples.resize(fNofSamples);
+		}
+		if(fDigitalSamples.size() < fNofDigitalSamples) {
+			fDigitalSamples.resize(fNofDigitalSamples);
+		}
+		UpdateAddresses();
+	}
+	fTree->GetEntry(entry);
+}
+
+void CaenFlatTree::Get(CaenEvent& event) const
+{
+	CaenHit hit;
+	hit.fChannel = fChannel;
+	hit.fTriggerTime = fTimestamp & 0x7fffffff;
+	hit.fExtendedTimestamp = fTimestamp>>31;
+	hit.fCfd = fCfd;
+	hit.fCharge = fCharge;
+	hit.fShortGate = fShortGate;
+	hit.fBaseline = fBaseline;
+	// only the dual trace bit of the format is kept
+	hit.fFormat = (fFlags & CaenHitColumns::kDualTrace) != 0 ? 0x80000000 : 0;
+	hit.fLostTrigger = (fFlags & CaenHitColumns::kLostTrigger) != 0;
+	hit.fOverRange = (fFlags & CaenHitColumns::kOverRange) != 0;
+	hit.fKiloCount = (fFlags & CaenHitColumns::kKiloCount) != 0;
+	hit.fNLostCount = (fFlags & CaenHitColumns::kNLostCount) != 0;
+	event.Read(hit);
+	event.Board(fBoard);
+
+	event.ClearWaveforms();
+	uint32_t begin = 0;
+	for(uint8_t t = 0; t < fNofWaveforms; ++t) {
+		std::memcpy(event.ResizeWaveform(t, fWaveformEnd[t] - begin), fSamples.data() + begin, (fWaveformEnd[t] - begin)*sizeof(uint16_t));
+		begin = fWaveformEnd[t];
+	}
+	begin = 0;
+	for(uint8_t t = 0; t < fNofDigitalWaveforms; ++t) {
+		std::memcpy(event.ResizeDigitalWaveform(t, fDigitalWaveformEnd[t] - begin), fDigitalSamples.data() + begin, (fDigitalWaveformEnd[t] - begin)*sizeof(uint8_t));
+		begin = fDigitalWaveformEnd[t];
+	}
+}
+
+void CaenFlatTree::UpdateAddresses()
+{
+	if(fSamples.data() != fSamplesAddress) {
+		fSamplesAddress = fSamples.data();
+		fSamplesBranch->SetAddress(fSamplesAddress);
+	}
+	if(fDigitalSamples.data() != fDigitalSamplesAddress) {
+		fDigitalSamplesAddress = fDigitalSamples.data();
+		fDigitalSamplesBranch->SetAddress(fDigitalSamplesAddress);
+	}
+}
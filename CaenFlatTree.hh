@@ -0,0 +1,69 @@
+#ifndef CAENFLATTREE_HH
+#define CAENFLATTREE_HH
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "TTree.h"
+
+#include "CaenEvent.hh"
+#include "CaenHitColumns.hh"
+
+// Flat output schema, an alternative to the single "event" branch holding the whole CaenEvent.
+// Each scalar of a hit has its own branch (channel, board, timestamp, cfd, charge, shortGate, baseline, flags), so
+// analyses that don't need the traces read only a small fraction of the file, and each branch compresses on its own.
+// The flags are the same bits as CaenHitColumns::EFlags.
+// The traces are optional: all analog samples of a hit are stored in one contiguous array (samples), the first trace
+// followed by the second one, with the end of each trace in waveformEnd (same for the digital traces in
+// digitalSamples and digitalWaveformEnd). Only the first kMaxTraces traces of each kind are stored.
+class CaenFlatTree {
+public:
+	static const int kMaxTraces = 4;
+
+	CaenFlatTree();
+
+	void Branch(TTree* tree, bool waveforms);             // creates the branches to write to
+	bool SetBranchAddresses(TTree* tree, bool waveforms); // to read, returns false if the tree doesn't have this schema
+	static bool IsFlat(TTree* tree) { return tree->GetBranch("timestamp") != nullptr; }
+
+	void Set(const CaenEvent& event);
+	void Set(const CaenHitColumns& hits, size_t i);
+	void Fill(); // fills the tree with what was set
+
+	void GetEntry(Long64_t entry);
+	void Get(CaenEvent& event) const; // copies what was read into event, reusing the event's trace storage
+
+	double Time() const { return fTimestamp*2. + fCfd/512.; } // same as CaenEvent::GetTime
+
+	uint8_t  fChannel;
+	uint8_t  fBoard;
+	uint64_t fTimestamp;
+	uint16_t fCfd;
+	uint16_t fCharge;
+	uint16_t fShortGate;
+	uint16_t fBaseline;
+	uint8_t  fFlags;
+
+	uint8_t  fNofWaveforms;
+	uint32_t fWaveformEnd[kMaxTraces];
+	uint32_t fNofSamples;
+	std::vector<uint16_t> fSamples;
+	uint8_t  fNofDigitalWaveforms;
+	uint32_t fDigitalWaveformEnd[kMaxTraces];
+	uint32_t fNofDigitalSamples;
+	std::vector<uint8_t> fDigitalSamples;
+
+private:
+	void UpdateAddresses();
+
+	TTree* fTree;
+	bool fWaveforms;
+	TBranch* fSamplesBranch;
+	TBranch* fDigitalSamplesBranch;
+	TBranch* fNofSamplesBranch;
+	TBranch* fNofDigitalSamplesBranch;
+	// the sample buffers can move when they grow, in which case the branches need their new address
+	void* fSamplesAddress;
+	void* fDigitalSamplesAddress;
+};
+#endif
@@ -0,0 +1,404 @@
+#include "CaenHistogramEngine.hh"
+
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+
+#include "TEnv.h"
+#include "TDirectory.h"
+#include "TH1.h"
+#include "TH2.h"
+
+namespace {
+	const char* kVariableNames[] = { "channel", "charge", "shortGate", "cfd", "timestamp", "time", "psd", "lastChannel", "tsDiff", "tDiff", "cfdDiff" };
+
+	HistogramDefinition Define(const char* name, const char* title, HistogramDefinition::EType type, const char* x, int xBins, double xLow, double xHigh, double xScale = 1., const char* y = "", int yBins = 0, double yLow = 0., double yHigh = 0.)
+	{
+		HistogramDefinition definition;
+		definition.fName = name;
+		definition.fTitle = title;
+		definition.fType = type;
+		definition.fX = x;
+		definition.fXBins = xBins;
+		definition.fXLow = xLow;
+		definition.fXHigh = xHigh;
+		definition.fXScale = xScale;
+		definition.fY = y;
+		definition.fYBins = yBins;
+		definition.fYLow = yLow;
+		definition.fYHigh = yHigh;
+		return definition;
+	}
+
+	// same as TAxis::FindFixBin, 0 is the underflow and bins+1 the overflow bin (also for NaN)
+	inline int Bin(double x, int bins, double low, double high)
+	{
+		if(x < low) return 0;
+		if(!(x < high)) return bins + 1;
+		return 1 + static_cast<int>(bins*(x - low)/(high - low));
+	}
+}
+
+CaenHistogramEngine::EVariable CaenHistogramEngine::Variable(const std::string& name)
+{
+	for(int v = 0; v < kNofVariables; ++v) {
+		if(name == kVariableNames[v]) {
+			return static_cast<EVariable>(v);
+		}
+	}
+	throw std::runtime_error("Unknown histogram variable \"" + name + "\"");
+}
+
+void CaenHistogramEngine::Read(const std::string& filename)
+{
+	TEnv settings;
+	if(settings.ReadFile(filename.c_str(), kEnvLocal) != 0) {
+		throw std::runtime_error("Failed to read histogram definitions from \"" + filename + "\"");
+	}
+	std::istringstream names(settings.GetValue("Histograms", ""));
+	std::string name;
+	while(names>>name) {
+		HistogramDefinition definition;
+		definition.fName = name;
+		definition.fTitle = settings.GetValue((name + ".Title").c_str(), name.c_str());
+		std::string type = settings.GetValue((name + ".Type").c_str(), "Single");
+		if(type == "Single") {
+			definition.fType = HistogramDefinition::kSingle;
+		} else if(type == "Coincidence") {
+			definition.fType = HistogramDefinition::kCoincidence;
+		} else if(type == "SameChannel") {
+			definition.fType = HistogramDefinition::kSameChannel;
+		} else {
+			throw std::runtime_error("Unknown type \"" + type + "\" of histogram \"" + name + "\", should be Single, Coincidence, or SameChannel");
+		}
+		definition.fX = settings.GetValue((name + ".X").c_str(), "");
+		definition.fXBins = settings.GetValue((name + ".XBins").c_str(), 0);
+		definition.fXLow = settings.GetValue((name + ".XLow").c_str(), 0.);
+		definition.fXHigh = settings.GetValue((name + ".XHigh").c_str(), 0.);
+		definition.fXScale = settings.GetValue((name + ".XScale").c_str(), 1.);
+		definition.fY = settings.GetValue((name + ".Y").c_str(), "");
+		definition.fYBins = settings.GetValue((name + ".YBins").c_str(), 0);
+		definition.fYLow = settings.GetValue((name + ".YLow").c_str(), 0.);
+		definition.fYHigh = settings.GetValue((name + ".YHigh").c_str(), 0.);
+		definition.fYScale = settings.GetValue((name + ".YScale").c_str(), 1.);
+		std::istringstream cuts(settings.GetValue((name + ".Cuts").c_str(), ""));
+		HistogramDefinition::Cut cut;
+		while(cuts>>cut.fVariable) {
+			if(!(cuts>>cut.fLow>>cut.fHigh)) {
+				throw std::runtime_error("Cut on \"" + cut.fVariable + "\" of histogram \"" + name + "\" needs a lower and an upper limit");
+			}
+			definition.fCuts.push_back(cut);
+		}
+		Add(definition);
+	}
+	if(fOperations.empty()) {
+		throw std::runtime_error("No histograms defined in \"" + filename + "\"");
+	}
+}
+
+void CaenHistogramEngine::Add(const HistogramDefinition& definition)
+{
+	Operation operation;
+	operation.fDefinition = definition;
+	bool pair = definition.fType != HistogramDefinition::kSingle;
+	if(definition.fX.empty()) {
+		throw std::runtime_error("Histogram \"" + definition.fName + "\" has no x-variable");
+	}
+	if(definition.fXBins < 1 || !(definition.fXLow < definition.fXHigh)) {
+		throw std::runtime_error("Histogram \"" + definition.fName + "\" needs at least one x-bin and a lower limit below the upper limit");
+	}
+	operation.fX = Variable(definition.fX);
+	operation.fNofBins = definition.fXBins + 2;
+	operation.fTwoDim = !definition.fY.empty();
+	operation.fY = operation.fX;
+	if(operation.fTwoDim) {
+		if(definition.fYBins < 1 || !(definition.fYLow < definition.fYHigh)) {
+			throw std::runtime_error("Histogram \"" + definition.fName + "\" needs at least one y-bin and a lower limit below the upper limit");
+		}
+		operation.fY = Variable(definition.fY);
+		operation.fNofBins *= definition.fYBins + 2;
+	}
+	for(auto& cut : definition.fCuts) {
+		operation.fCuts.push_back({ Variable(cut.fVariable), cut.fLow, cut.fHigh });
+	}
+
+	// check that all variables exist for this type
+	std::vector<EVariable> variables = { operation.fX, operation.fY };
+	for(auto& cut : operation.fCuts) {
+		variables.push_back(cut.fVariable);
+	}
+	if(pair) {
+		// needed to select the coincidences with the same or other channels
+		variables.push_back(kChannel);
+		variables.push_back(kLastChannel);
+	}
+	for(auto variable : variables) {
+		if(!pair && variable >= kLastChannel) {
+			throw std::runtime_error(std::string("Variable \"") + kVariableNames[variable] + "\" of histogram \"" + definition.fName + "\" only exists for coincidences");
+		}
+		Use(variable, pair);
+	}
+
+	fOperations.push_back(operation);
+}
+
+void CaenHistogramEngine::Use(EVariable variable, bool pair)
+{
+	auto& used = pair ? fPairVariables : fSingleVariables;
+	if(std::find(used.begin(), used.end(), variable) == used.end()) {
+		used.push_back(variable);
+	}
+}
+
+std::vector<HistogramDefinition> CaenHistogramEngine::DefaultDefinitions()
+{
+	std::vector<HistogramDefinition> definitions = {
+		Define("tsDiff", "#DeltaTS, different channels;#DeltaTS [sample]", HistogramDefinition::kCoincidence, "tsDiff", 100000, 0., 100000.),
+		Define("tDiff", "#Deltat, different channels;#Deltat [#mus]", HistogramDefinition::kCoincidence, "tDiff", 10000, 0., 1000., 1e-3),
+		Define("tDiffZoomVsCharge", "#Deltat, different channels vs. charge;charge [channels];#Deltat [ns]", HistogramDefinition::kCoincidence, "charge", 1000, 0., 65000., 1., "tDiff", 1280, 0., 10.),
+		Define("cfdDiffVsTsDiff", "#DeltaCFD vs. #DeltaTS;#DeltaTS [sample];#DeltaCFD [ns]", HistogramDefinition::kCoincidence, "tsDiff", 10, -0., 9.5, 1., "cfdDiff", 512, 0., 2.),
+		Define("tDiffSame", "#Deltat, same channel;Channel Number;#Deltat [#mus]", HistogramDefinition::kSameChannel, "channel", 2, -0., 1.5, 1., "tDiff", 1000, 0., 1000.),
+		Define("channelVsCharge", "Channel # vs. charge;charge [channels]", HistogramDefinition::kSingle, "charge", 1000, 0., 65000., 1., "channel", 8, -0.5, 7.5),
+		Define("channelVsShortGate", "Channel # vs. short gate;short gate [channels]", HistogramDefinition::kSingle, "shortGate", 1000, 0., 65000., 1., "channel", 8, -0.5, 7.5),
+		Define("psdVsCharge", "PSD (short gate/charge) vs. charge;charge [channels]", HistogramDefinition::kSingle, "charge", 1000, 0., 65000., 1., "psd", 1000, 0.2, 1.2)
+	};
+	definitions[4].fYScale = 1e-3;
+	definitions[7].fCuts.push_back({ "channel", 0., 0. });
+	return definitions;
+}
+
+CaenHistogramFiller::CaenHistogramFiller(const CaenHistogramEngine& engine, size_t batchSize)
+	: fEngine(engine), fBatchSize(std::max<size_t>(batchSize, 1)), fValues(CaenHistogramEngine::kNofVariables)
+{
+	fHits.reserve(fBatchSize);
+	fPairs.reserve(fBatchSize);
+	fBinIndices.reserve(fBatchSize);
+	fCounts.resize(fEngine.Operations().size());
+	for(size_t i = 0; i < fCounts.size(); ++i) {
+		fCounts[i].fBins.assign(fEngine.Operations()[i].fNofBins, 0.);
+		fCounts[i].fEntries = 0.;
+		std::fill(fCounts[i].fStats, fCounts[i].fStats + 7, 0.);
+	}
+}
+
+void CaenHistogramFiller::AddHit(const HistogramHit& hit)
+{
+	fHits.push_back(hit);
+	if(fHits.size() == fBatchSize) {
+		Fill(fHits, fEngine.SingleVariables(), false);
+		fHits.clear();
+	}
+}
+
+void CaenHistogramFiller::AddPair(const HistogramHit& hit, int lastChannel, uint64_t lastTimestamp, double lastTime, uint16_t lastCfd)
+{
+	fPairs.push_back({ hit, lastChannel, lastTimestamp, lastTime, lastCfd });
+	if(fPairs.size() == fBatchSize) {
+		Fill(fPairs, fEngine.PairVariables(), true);
+		fPairs.clear();
+	}
+}
+
+void CaenHistogramFiller::Flush()
+{
+	Fill(fHits, fEngine.SingleVariables(), false);
+	fHits.clear();
+	Fill(fPairs, fEngine.PairVariables(), true);
+	fPairs.clear();
+}
+
+void CaenHistogramFiller::Extract(const std::vector<HistogramHit>& batch, CaenHistogramEngine::EVariable variable, std::vector<double>& values)
+{
+	values.resize(batch.size());
+	size_t n = batch.size();
+	switch(variable) {
+		case CaenHistogramEngine::kChannel:   for(size_t i = 0; i < n; ++i) values[i] = batch[i].fChannel; break;
+		case CaenHistogramEngine::kCharge:    for(size_t i = 0; i < n; ++i) values[i] = batch[i].fCharge; break;
+		case CaenHistogramEngine::kShortGate: for(size_t i = 0; i < n; ++i) values[i] = batch[i].fShortGate; break;
+		case CaenHistogramEngine::kCfd:       for(size_t i = 0; i < n; ++i) values[i] = batch[i].fCfd; break;
+		case CaenHistogramEngine::kTimestamp: for(size_t i = 0; i < n; ++i) values[i] = batch[i].fTimestamp; break;
+		case CaenHistogramEngine::kTime:      for(size_t i = 0; i < n; ++i) values[i] = batch[i].fTime; break;
+		case CaenHistogramEngine::kPsd:       for(size_t i = 0; i < n; ++i) values[i] = static_cast<double>(batch[i].fShortGate)/static_cast<double>(batch[i].fCharge); break;
+		default: break; // only exist for pairs, checked when the histogram is added
+	}
+}
+
+void CaenHistogramFiller::Extract(const std::vector<HistogramPair>& batch, CaenHistogramEngine::EVariable variable, std::vector<double>& values)
+{
+	values.resize(batch.size());
+	size_t n = batch.size();
+	switch(variable) {
+		case CaenHistogramEngine::kChannel:     for(size_t i = 0; i < n; ++i) values[i] = batch[i].fHit.fChannel; break;
+		case CaenHistogramEngine::kCharge:      for(size_t i = 0; i < n; ++i) values[i] = batch[i].fHit.fCharge; break;
+		case CaenHistogramEngine::kShortGate:   for(size_t i = 0; i < n; ++i) values[i] = batch[i].fHit.fShortGate; break;
+		case CaenHistogramEngine::kCfd:         for(size_t i = 0; i < n; ++i) values[i] = batch[i].fHit.fCfd; break;
+		case CaenHistogramEngine::kTimestamp:   for(size_t i = 0; i < n; ++i) values[i] = batch[i].fHit.fTimestamp; break;
+		case CaenHistogramEngine::kTime:        for(size_t i = 0; i < n; ++i) values[i] = batch[i].fHit.fTime; break;
+		case CaenHistogramEngine::kPsd:         for(size_t i = 0; i < n; ++i) values[i] = static_cast<double>(batch[i].fHit.fShortGate)/static_cast<double>(batch[i].fHit.fCharge); break;
+		case CaenHistogramEngine::kLastChannel: for(size_t i = 0; i < n; ++i) values[i] = batch[i].fLastChannel; break;
+		// the difference of the timestamps wraps around like the unsigned integers do
+		case CaenHistogramEngine::kTsDiff:      for(size_t i = 0; i < n; ++i) values[i] = batch[i].fHit.fTimestamp - batch[i].fLastTimestamp; break;
+		case CaenHistogramEngine::kTDiff:       for(size_t i = 0; i < n; ++i) values[i] = batch[i].fHit.fTime - batch[i].fLastTime; break;
+		case CaenHistogramEngine::kCfdDiff:     for(size_t i = 0; i < n; ++i) values[i] = (batch[i].fHit.fCfd - batch[i].fLastCfd)/512.; break;
+		default: break;
+	}
+}
+
+template<class Record>
+void CaenHistogramFiller::Fill(const std::vector<Record>& batch, const std::vector<CaenHistogramEngine::EVariable>& variables, bool pairs)
+{
+	if(batch.empty()) {
+		return;
+	}
+	for(auto variable : variables) {
+		Extract(batch, variable, fValues[variable]);
+	}
+	size_t n = batch.size();
+	fBinIndices.resize(n);
+	int* bins = fBinIndices.data();
+
+	const auto& operations = fEngine.Operations();
+	for(size_t o = 0; o < operations.size(); ++o) {
+		const auto& operation = operations[o];
+		const auto& definition = operation.fDefinition;
+		if(pairs != (definition.fType != HistogramDefinition::kSingle)) {
+			continue;
+		}
+
+		// bin indices of all records, -1 for those that don't pass the cuts
+		const double* x = fValues[operation.fX].data();
+		const double* y = fValues[operation.fY].data();
+		double xScale = definition.fXScale;
+		double yScale = definition.fYScale;
+		int xBins = definition.fXBins;
+		for(size_t i = 0; i < n; ++i) {
+			bins[i] = Bin(x[i]*xScale, xBins, definition.fXLow, definition.fXHigh);
+		}
+		if(operation.fTwoDim) {
+			for(size_t i = 0; i < n; ++i) {
+				bins[i] += (xBins + 2)*Bin(y[i]*yScale, definition.fYBins, definition.fYLow, definition.fYHigh);
+			}
+		}
+		if(pairs) {
+			const double* channel = fValues[CaenHistogramEngine::kChannel].data();
+			const double* lastChannel = fValues[CaenHistogramEngine::kLastChannel].data();
+			bool same = definition.fType == HistogramDefinition::kSameChannel;
+			for(size_t i = 0; i < n; ++i) {
+				if((channel[i] == lastChannel[i]) != same) bins[i] = -1;
+			}
+		}
+		for(const auto& cut : operation.fCuts) {
+			const double* value = fValues[cut.fVariable].data();
+			for(size_t i = 0; i < n; ++i) {
+				if(!(value[i] >= cut.fLow && value[i] <= cut.fHigh)) bins[i] = -1;
+			}
+		}
+
+		// count them, the statistics only include entries that aren't in the under- or overflow bins (like TH1::Fill)
+		Counts& counts = fCounts[o];
+		double* content = counts.fBins.data();
+		double* stats = counts.fStats;
+		for(size_t i = 0; i < n; ++i) {
+			int bin = bins[i];
+			if(bin < 0) {
+				continue;
+			}
+			content[bin] += 1.;
+			counts.fEntries += 1.;
+			int xBin = bin%(xBins + 2);
+			int yBin = bin/(xBins + 2);
+			if(xBin == 0 || xBin > xBins || (operation.fTwoDim && (yBin == 0 || yBin > definition.fYBins))) {
+				continue;
+			}
+			double xValue = x[i]*xScale;
+			stats[0] += 1.;
+			stats[1] += 1.;
+			stats[2] += xValue;
+			stats[3] += xValue*xValue;
+			if(!operation.fTwoDim) {
+				continue;
+			}
+			double yValue = y[i]*yScale;
+			stats[4] += yValue;
+			stats[5] += yValue*yValue;
+			stats[6] += xValue*yValue;
+		}
+	}
+}
+
+void CaenHistogramFiller::Add(const CaenHistogramFiller& other)
+{
+	for(size_t o = 0; o < fCounts.size(); ++o) {
+		auto& counts = fCounts[o];
+		const auto& otherCounts = other.fCounts[o];
+		for(size_t bin = 0; bin < counts.fBins.size(); ++bin) {
+			counts.fBins[bin] += otherCounts.fBins[bin];
+		}
+		counts.fEntries += otherCounts.fEntries;
+		for(int s = 0; s < 7; ++s) {
+			counts.fStats[s] += otherCounts.fStats[s];
+		}
+	}
+}
+
+void CaenHistogramFiller::Write()
+{
+	Flush();
+	const auto& operations = fEngine.Operations();
+	for(size_t o = 0; o < operations.size(); ++o) {
+		const auto& definition = operations[o].fDefinition;
+		TH1* histogram;
+		if(operations[o].fTwoDim) {
+			histogram = new TH2F(definition.fName.c_str(), definition.fTitle.c_str(), definition.fXBins, definition.fXLow, definition.fXHigh, definition.fYBins, definition.fYLow, definition.fYHigh);
+		} else {
+			histogram = new TH1F(definition.fName.c_str(), definition.fTitle.c_str(), definition.fXBins, definition.fXLow, definition.fXHigh);
+		}
+		const auto& counts = fCounts[o];
+		for(size_t bin = 0; bin < counts.fBins.size(); ++bin) {
+			if(counts.fBins[bin] != 0.) {
+				histogram->SetBinContent(bin, counts.fBins[bin]);
+			}
+		}
+		// setting the bin contents changes the entries and statistics, so these have to be set afterwards
+		histogram->SetEntries(counts.fEntries);
+		double stats[7];
+		std::copy(counts.fStats, counts.fStats + 7, stats);
+		histogram->PutStats(stats);
+		histogram->Write();
+		delete histogram;
+	}
+}
+
+bool CaenHistogramFiller::Load(TDirectory* directory)
+{
+	const auto& operations = fEngine.Operations();
+	std::vector<TH1*> histograms(operations.size(), nullptr);
+	for(size_t o = 0; o < operations.size(); ++o) {
+		const auto& definition = operations[o].fDefinition;
+		TH1* histogram = dynamic_cast<TH1*>(directory->Get(definition.fName.c_str()));
+		if(histogram == nullptr || histogram->GetNcells() != static_cast<int>(operations[o].fNofBins) ||
+		   histogram->GetXaxis()->GetNbins() != definition.fXBins || histogram->GetXaxis()->GetXmin() != definition.fXLow || histogram->GetXaxis()->GetXmax() != definition.fXHigh ||
+		   (operations[o].fTwoDim && (histogram->GetYaxis()->GetNbins() != definition.fYBins || histogram->GetYaxis()->GetXmin() != definition.fYLow || histogram->GetYaxis()->GetXmax() != definition.fYHigh))) {
+			for(auto h : histograms) {
+				delete h;
+			}
+			delete histogram;
+			return false;
+		}
+		histograms[o] = histogram;
+	}
+	for(size_t o = 0; o < operations.size(); ++o) {
+		auto& counts = fCounts[o];
+		for(size_t bin = 0; bin < counts.fBins.size(); ++bin) {
+			counts.fBins[bin] += histograms[o]->GetBinContent(bin);
+		}
+		counts.fEntries += histograms[o]->GetEntries();
+		double stats[7] = { 0. };
+		histograms[o]->GetStats(stats);
+		for(int s = 0; s < (operations[o].fTwoDim ? 7 : 4); ++s) {
+			counts.fStats[s] += stats[s];
+		}
+		delete histograms[o];
+	}
+	return true;
+}
@@ -0,0 +1,169 @@
+#ifndef CAENHISTOGRAMENGINE_HH
+#define CAENHISTOGRAMENGINE_HH
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+class TDirectory;
+
+// Histograms defined in a settings file instead of in code, so any number of them can be filled in one pass over
+// the tree.
+//
+// The file lists the histograms and their settings, e.g.
+//   Histograms: psdVsCharge tDiff
+//   psdVsCharge.Title: PSD vs. charge;charge [channels]
+//   psdVsCharge.X: charge
+//   psdVsCharge.XBins: 1000
+//   psdVsCharge.XLow: 0
+//   psdVsCharge.XHigh: 65000
+//   psdVsCharge.Y: psd
+//   psdVsCharge.YBins: 1000
+//   psdVsCharge.YLow: 0.2
+//   psdVsCharge.YHigh: 1.2
+//   psdVsCharge.Cuts: channel 0 0
+//   tDiff.Type: Coincidence
+//   tDiff.X: tDiff
+//   tDiff.XScale: 0.001
+//   ...
+// Histograms without Y are one-dimensional. Cuts is a list of "variable low high" triplets, the hit is only used if
+// all variables are within [low, high]. XScale/YScale multiply the variable before it's filled (default 1).
+// Type selects what a histogram is filled with:
+//   Single      - every hit (default)
+//   Coincidence - every hit paired with the last hit of each other channel
+//   SameChannel - every hit paired with the last hit of its own channel
+// The variables of the hit are channel, charge, shortGate, cfd, timestamp, time (in ns), and psd (short gate/charge),
+// pairs also have lastChannel, tsDiff, tDiff (in ns), and cfdDiff (in ns).
+//
+// The definitions are compiled into a flat list of fill operations. CaenHistogramFiller collects hits and pairs in
+// batches, and fills each histogram for the whole batch at once: the variables used are extracted once per batch,
+// then the bin indices of each histogram are calculated and counted in plain arrays. The ROOT histograms are only
+// created when they are written, and can be loaded again to continue filling them.
+
+// the parts of an event the histograms can use
+struct HistogramHit {
+	int      fChannel;
+	uint64_t fTimestamp;
+	double   fTime;
+	uint16_t fCharge;
+	uint16_t fShortGate;
+	uint16_t fCfd;
+};
+
+struct HistogramPair {
+	HistogramHit fHit;
+	int      fLastChannel;
+	uint64_t fLastTimestamp;
+	double   fLastTime;
+	uint16_t fLastCfd;
+};
+
+struct HistogramDefinition {
+	enum EType { kSingle, kCoincidence, kSameChannel };
+	HistogramDefinition()
+		: fType(kSingle), fXBins(0), fXLow(0.), fXHigh(0.), fXScale(1.), fYBins(0), fYLow(0.), fYHigh(0.), fYScale(1.)
+	{
+	}
+
+	struct Cut {
+		std::string fVariable;
+		double fLow;
+		double fHigh;
+	};
+
+	std::string fName;
+	std::string fTitle;
+	EType fType;
+	std::string fX;
+	int fXBins;
+	double fXLow;
+	double fXHigh;
+	double fXScale;
+	std::string fY; // empty for one-dimensional histograms
+	int fYBins;
+	double fYLow;
+	double fYHigh;
+	double fYScale;
+	std::vector<Cut> fCuts;
+};
+
+class CaenHistogramEngine {
+public:
+	enum EVariable { kChannel, kCharge, kShortGate, kCfd, kTimestamp, kTime, kPsd, kLastChannel, kTsDiff, kTDiff, kCfdDiff, kNofVariables };
+
+	CaenHistogramEngine() {}
+
+	void Read(const std::string& filename); // adds the histograms defined in the file
+	void Add(const HistogramDefinition& definition);
+
+	// the histograms Histograms fills if no file is given
+	static std::vector<HistogramDefinition> DefaultDefinitions();
+
+	// one fill operation per histogram, with the variables as indices
+	struct Operation {
+		struct Cut {
+			EVariable fVariable;
+			double fLow;
+			double fHigh;
+		};
+
+		HistogramDefinition fDefinition;
+		EVariable fX;
+		EVariable fY;
+		bool fTwoDim;
+		std::vector<Cut> fCuts;
+		size_t fNofBins; // including under- and overflow bins
+	};
+
+	const std::vector<Operation>& Operations() const { return fOperations; }
+	// which variables are used by histograms of each type, so only those are extracted
+	const std::vector<EVariable>& SingleVariables() const { return fSingleVariables; }
+	const std::vector<EVariable>& PairVariables() const { return fPairVariables; }
+
+	static EVariable Variable(const std::string& name); // throws if the variable doesn't exist
+
+private:
+	void Use(EVariable variable, bool pair);
+
+	std::vector<Operation> fOperations;
+	std::vector<EVariable> fSingleVariables;
+	std::vector<EVariable> fPairVariables;
+};
+
+// Fills the histograms of an engine, each thread needs its own filler. Fillers can be added up at the end.
+class CaenHistogramFiller {
+public:
+	explicit CaenHistogramFiller(const CaenHistogramEngine& engine, size_t batchSize = 4096);
+
+	void AddHit(const HistogramHit& hit);
+	void AddPair(const HistogramHit& hit, int lastChannel, uint64_t lastTimestamp, double lastTime, uint16_t lastCfd);
+	void Flush(); // fills the histograms with everything in the batches
+
+	void Add(const CaenHistogramFiller& other);
+	void Write(); // flushes and writes the histograms to the current directory
+	// adds the contents of histograms written before, returns false (and adds nothing) if any of them is missing or has
+	// a different binning
+	bool Load(TDirectory* directory);
+
+private:
+	// bin contents and statistics of one histogram, same as TH1/TH2 would have them
+	struct Counts {
+		std::vector<double> fBins;
+		double fEntries;
+		double fStats[7]; // sum of weights, of squared weights, and of w*x, w*x^2, w*y, w*y^2, w*x*y
+	};
+
+	template<class Record>
+	void Fill(const std::vector<Record>& batch, const std::vector<CaenHistogramEngine::EVariable>& variables, bool pairs);
+	static void Extract(const std::vector<HistogramHit>& batch, CaenHistogramEngine::EVariable variable, std::vector<double>& values);
+	static void Extract(const std::vector<HistogramPair>& batch, CaenHistogramEngine::EVariable variable, std::vector<double>& values);
+
+	const CaenHistogramEngine& fEngine;
+	size_t fBatchSize;
+	std::vector<HistogramHit> fHits;
+	std::vector<HistogramPair> fPairs;
+	std::vector<Counts> fCounts; // one per operation
+	std::vector<std::vector<double> > fValues; // extracted variables of the current batch
+	std::vector<int> fBinIndices;
+};
+#endif
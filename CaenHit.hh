@@ -0,0 +1,31 @@
+#ifndef CAENHIT_HH
+#define CAENHIT_HH
+#include <cstdint>
+
+// Everything except the traces of one DPP-PSD hit, as decoded by ParseData (see CaenParser.hh).
+struct CaenHit {
+	uint32_t fTriggerTime;
+	uint32_t fFormat;            // second word of the channel aggregate header
+	uint16_t fChannel;
+	uint16_t fExtendedTimestamp;
+	uint16_t fCfd;
+	uint16_t fCharge;
+	uint16_t fShortGate;
+	uint16_t fBaseline;
+	bool     fLostTrigger;
+	bool     fOverRange;
+	bool     fKiloCount;
+	bool     fNLostCount;
+};
+
+// Where ParseData writes the traces of a hit, provided by the sink.
+// Single trace data has only the first analog trace with two samples per word, dual trace data has one sample per
+// word in each analog trace. The digital traces always have two samples per word.
+// If the sink sets fWords, the sample words are copied there as they are (nofSamples/2 words) instead of being
+// unpacked, and the other pointers are ignored (see CaenEvent::ResizeSampleWords).
+struct CaenTraces {
+	uint16_t* fAnalog[2];
+	uint8_t*  fDigital[2];
+	uint32_t* fWords;
+};
+#endif
@@ -0,0 +1,146 @@
+#include "CaenHitColumns.hh"
+
+#include <cstring>
+
+CaenHitColumns::CaenHitColumns()
+	: fPendingTraces(false), fCurrentBoard(0)
+{
+}
+
+void CaenHitColumns::Clear()
+{
+	fPendingTraces = false;
+	fChannel.clear();
+	fBoard.clear();
+	fTriggerTime.clear();
+	fExtendedTimestamp.clear();
+	fCfd.clear();
+	fCharge.clear();
+	fShortGate.clear();
+	fBaseline.clear();
+	fFormat.clear();
+	fFlags.clear();
+	fSamplesEnd.clear();
+	fDigitalSamplesEnd.clear();
+	fSamples.clear();
+	fDigitalSamples.clear();
+}
+
+void CaenHitColumns::Reserve(size_t nofHits, size_t nofSamples)
+{
+	fChannel.reserve(nofHits);
+	fBoard.reserve(nofHits);
+	fTriggerTime.reserve(nofHits);
+	fExtendedTimestamp.reserve(nofHits);
+	fCfd.reserve(nofHits);
+	fCharge.reserve(nofHits);
+	fShortGate.reserve(nofHits);
+	fBaseline.reserve(nofHits);
+	fFormat.reserve(nofHits);
+	fFlags.reserve(nofHits);
+	fSamplesEnd.reserve(nofHits);
+	fDigitalSamplesEnd.reserve(nofHits);
+	fSamples.reserve(nofSamples);
+	fDigitalSamples.reserve(2*nofSamples);
+}
+
+bool CaenHitColumns::Traces(size_t nofSamples, bool, CaenTraces& traces)
+{
+	// single trace has nofSamples samples in the first trace, dual trace nofSamples/2 in each, so it's always
+	// nofSamples analog samples in total
+	// drop samples of a hit that was never added (if ParseData gave up in the middle of it)
+	size_t analog = SamplesBegin(Size());
+	size_t digital = DigitalSamplesBegin(Size());
+	fPendingTraces = true;
+	fSamples.resize(analog + nofSamples);
+	fDigitalSamples.resize(digital + 2*nofSamples);
+	traces.fAnalog[0] = fSamples.data() + analog;
+	traces.fAnalog[1] = fSamples.data() + analog + nofSamples/2;
+	traces.fDigital[0] = fDigitalSamples.data() + digital;
+	traces.fDigital[1] = fDigitalSamples.data() + digital + nofSamples;
+	return true;
+}
+
+void CaenHitColumns::Add(const CaenHit& hit)
+{
+	fChannel.push_back(hit.fChannel);
+	fBoard.push_back(fCurrentBoard);
+	fTriggerTime.push_back(hit.fTriggerTime);
+	fExtendedTimestamp.push_back(hit.fExtendedTimestamp);
+	fCfd.push_back(hit.fCfd);
+	fCharge.push_back(hit.fCharge);
+	fShortGate.push_back(hit.fShortGate);
+	fBaseline.push_back(hit.fBaseline);
+	fFormat.push_back(hit.fFormat);
+	uint8_t flags = 0;
+	if(hit.fLostTrigger) flags |= kLostTrigger;
+	if(hit.fOverRange)   flags |= kOverRange;
+	if(hit.fKiloCount)   flags |= kKiloCount;
+	if(hit.fNLostCount)  flags |= kNLostCount;
+	if((hit.fFormat>>31) == 0x1) flags |= kDualTrace;
+	fFlags.push_back(flags);
+	// samples added by Traces since the last hit belong to this one
+	if(!fPendingTraces) {
+		fSamples.resize(SamplesBegin(Size() - 1));
+		fDigitalSamples.resize(DigitalSamplesBegin(Size() - 1));
+	}
+	fPendingTraces = false;
+	fSamplesEnd.push_back(fSamples.size());
+	fDigitalSamplesEnd.push_back(fDigitalSamples.size());
+}
+
+size_t CaenHitColumns::NofSamples(size_t i) const
+{
+	size_t samples = fSamplesEnd[i] - SamplesBegin(i);
+	return (fFlags[i] & kDualTrace) != 0 ? samples/2 : samples;
+}
+
+size_t CaenHitColumns::NofDigitalSamples(size_t i) const
+{
+	return (fDigitalSamplesEnd[i] - DigitalSamplesBegin(i))/2;
+}
+
+const uint16_t* CaenHitColumns::Waveform(size_t i, size_t trace) const
+{
+	return fSamples.data() + SamplesBegin(i) + trace*NofSamples(i);
+}
+
+const uint8_t* CaenHitColumns::DigitalWaveform(size_t i, size_t trace) const
+{
+	return fDigitalSamples.data() + DigitalSamplesBegin(i) + trace*NofDigitalSamples(i);
+}
+
+void CaenHitColumns::Fill(size_t i, CaenEvent& event) const
+{
+	CaenHit hit;
+	hit.fChannel = fChannel[i];
+	hit.fTriggerTime = fTriggerTime[i];
+	hit.fExtendedTimestamp = fExtendedTimestamp[i];
+	hit.fCfd = fCfd[i];
+	hit.fCharge = fCharge[i];
+	hit.fShortGate = fShortGate[i];
+	hit.fBaseline = fBaseline[i];
+	hit.fFormat = fFormat[i];
+	hit.fLostTrigger = (fFlags[i] & kLostTrigger) != 0;
+	hit.fOverRange = (fFlags[i] & kOverRange) != 0;
+	hit.fKiloCount = (fFlags[i] & kKiloCount) != 0;
+	hit.fNLostCount = (fFlags[i] & kNLostCount) != 0;
+	event.Read(hit);
+	event.Board(fBoard[i]);
+
+	size_t nofSamples = NofSamples(i);
+	size_t nofDigitalSamples = NofDigitalSamples(i);
+	if(nofSamples == 0 && nofDigitalSamples == 0) {
+		event.ClearWaveforms();
+		return;
+	}
+	bool dualTrace = (fFlags[i] & kDualTrace) != 0;
+	std::memcpy(event.ResizeWaveform(0, nofSamples), Waveform(i, 0), nofSamples*sizeof(uint16_t));
+	if(dualTrace) {
+		std::memcpy(event.ResizeWaveform(1, nofSamples), Waveform(i, 1), nofSamples*sizeof(uint16_t));
+	} else {
+		event.ResizeWaveform(1, 0);
+	}
+	std::memcpy(event.ResizeDigitalWaveform(0, nofDigitalSamples), DigitalWaveform(i, 0), nofDigitalSamples*sizeof(uint8_t));
+	std::memcpy(event.ResizeDigitalWaveform(1, nofDigitalSamples), DigitalWaveform(i, 1), nofDigitalSamples*sizeof(uint8_t));
+}
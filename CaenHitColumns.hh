@@ -0,0 +1,70 @@
+#ifndef CAENHITCOLUMNS_HH
+#define CAENHITCOLUMNS_HH
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "CaenHit.hh"
+#include "CaenEvent.hh"
+
+// Hits stored as columns, to be filled by ParseData (see CaenParser.hh).
+// All samples are kept in two arenas (one for the analog, one for the digital traces), each hit only stores where
+// its samples end. The analog samples of a hit are the first trace followed by the second trace (dual trace only),
+// the digital samples are the first digital trace followed by the second one.
+// Clear keeps the capacity of all columns, so once they are large enough, parsing doesn't allocate anything.
+class CaenHitColumns {
+public:
+	enum EFlags : uint8_t {
+		kLostTrigger = 0x1,
+		kOverRange   = 0x2,
+		kKiloCount   = 0x4,
+		kNLostCount  = 0x8,
+		kDualTrace   = 0x10
+	};
+
+	CaenHitColumns();
+
+	void Clear();
+	void Reserve(size_t nofHits, size_t nofSamples);
+	size_t Size() const { return fChannel.size(); }
+	bool Empty() const { return fChannel.empty(); }
+
+	// sink interface for ParseData
+	bool Traces(size_t nofSamples, bool dualTrace, CaenTraces& traces);
+	void Add(const CaenHit& hit);
+
+	uint64_t Timestamp(size_t i) const { return (static_cast<uint64_t>(fExtendedTimestamp[i])<<31) | fTriggerTime[i]; }
+	size_t NofSamples(size_t i) const;        // samples per analog trace
+	size_t NofDigitalSamples(size_t i) const; // samples per digital trace
+	const uint16_t* Waveform(size_t i, size_t trace) const;
+	const uint8_t* DigitalWaveform(size_t i, size_t trace) const;
+
+	void SetBoard(uint8_t board) { fCurrentBoard = board; } // board of the hits added from now on (the data doesn't have it)
+	void Fill(size_t i, CaenEvent& event) const; // copies hit i into event, reusing the event's trace storage
+
+	// columns, one entry per hit
+	std::vector<uint16_t> fChannel;
+	std::vector<uint8_t>  fBoard;
+	std::vector<uint32_t> fTriggerTime;
+	std::vector<uint16_t> fExtendedTimestamp;
+	std::vector<uint16_t> fCfd;
+	std::vector<uint16_t> fCharge;
+	std::vector<uint16_t> fShortGate;
+	std::vector<uint16_t> fBaseline;
+	std::vector<uint32_t> fFormat;
+	std::vector<uint8_t>  fFlags;
+	std::vector<size_t>   fSamplesEnd;        // end of the analog samples of this hit in fSamples
+	std::vector<size_t>   fDigitalSamplesEnd; // end of the digital samples of this hit in fDigitalSamples
+
+	// sample arenas
+	std::vector<uint16_t> fSamples;
+	std::vector<uint8_t>  fDigitalSamples;
+
+private:
+	size_t SamplesBegin(size_t i) const { return i == 0 ? 0 : fSamplesEnd[i-1]; }
+	size_t DigitalSamplesBegin(size_t i) const { return i == 0 ? 0 : fDigitalSamplesEnd[i-1]; }
+
+	bool fPendingTraces; // Traces was called for the hit that's being parsed
+	uint8_t fCurrentBoard;
+};
+#endif
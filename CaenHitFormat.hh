@@ -0,0 +1,91 @@
+#ifndef CAENHITFORMAT_HH
+#define CAENHITFORMAT_HH
+#include <cstdint>
+#include <cstddef>
+
+// Layout of the hit files written by CaenHitWriter (all numbers little endian):
+//
+//   HitFileHeader
+//   HitBlockHeader + HitRecord for each hit + trace data of the hits with traces + padding to a multiple of 8 bytes
+//   HitBlockHeader + ...
+//   ...
+//
+// The hits are the time ordered hits from the sorter, decoded but without any ROOT in the way, so the readout can write
+// them as fast as the disk allows and convert them to a tree afterwards (ConvertHits).
+// Each hit is a fixed size record, its timestamp is stored as the difference to the previous hit of the block (the
+// first hit of a block relative to the timestamp in the block header). A block ends early if the difference doesn't fit
+// into 32 bits, which also takes care of hits that were sorted late and are earlier than the hit before them.
+// The traces are optional, the trace data of a hit (if it has the kHitTraces flag) is a HitTraceHeader followed by
+// the analog samples (uint16_t) and the digital samples (uint8_t) of all traces, padded to a multiple of 4 bytes.
+// There is no index, the blocks are found by hopping from block header to block header, so files that weren't closed
+// properly (or are still being written) can be read up to the last complete block.
+
+const uint32_t kHitFileMagic  = 0x54494843; // "CHIT"
+const uint32_t kHitBlockMagic = 0x4b4c4248; // "HBLK"
+const uint16_t kHitFormatVersion = 1;
+const size_t   kHitBlockAlignment = 8;
+const size_t   kHitTraceAlignment = 4;
+
+enum EHitFileFlags : uint32_t {
+	kHitFileTraces = 0x1 // the traces were written
+};
+
+// same bits as CaenHitColumns::EFlags, plus whether the hit has traces
+enum EHitFlags : uint8_t {
+	kHitLostTrigger = 0x1,
+	kHitOverRange   = 0x2,
+	kHitKiloCount   = 0x4,
+	kHitNLostCount  = 0x8,
+	kHitDualTrace   = 0x10,
+	kHitTraces      = 0x20
+};
+
+struct HitFileHeader {
+	uint32_t fMagic;
+	uint16_t fVersion;
+	uint16_t fHeaderSize;     // sizeof(HitFileHeader), allows adding fields without breaking older readers
+	uint32_t fNofBoards;
+	uint32_t fFlags;          // EHitFileFlags
+	uint64_t fStartTime;      // wall time when the file was opened, in ns since the epoch
+};
+
+struct HitBlockHeader {
+	uint32_t fMagic;
+	uint32_t fNofHits;
+	uint32_t fSize;           // bytes following this header, including the padding
+	uint32_t fChecksum;       // CRC-32 of the bytes following this header
+	uint64_t fFirstTimestamp; // timestamp the difference of the first hit refers to
+	uint32_t fTraceSize;      // bytes of trace data following the hit records
+	uint32_t fReserved;
+};
+
+struct HitRecord {
+	int32_t  fTimestampDelta; // difference to the timestamp of the previous hit
+	uint32_t fFormat;
+	uint16_t fCfd;
+	uint16_t fCharge;
+	uint16_t fShortGate;
+	uint16_t fBaseline;
+	uint8_t  fChannel;
+	uint8_t  fBoard;
+	uint8_t  fFlags;          // EHitFlags
+	uint8_t  fReserved;
+};
+
+struct HitTraceHeader {
+	uint32_t fNofSamples[2];        // of each analog trace
+	uint32_t fNofDigitalSamples[2]; // of each digital trace
+};
+
+static_assert(sizeof(HitFileHeader) == 24, "unexpected padding in HitFileHeader");
+static_assert(sizeof(HitBlockHeader) == 32, "unexpected padding in HitBlockHeader");
+static_assert(sizeof(HitRecord) == 20, "unexpected padding in HitRecord");
+static_assert(sizeof(HitTraceHeader) == 16, "unexpected padding in HitTraceHeader");
+
+// bytes of trace data of a hit with these traces, including the padding
+inline size_t HitTraceSize(const HitTraceHeader& header)
+{
+	size_t size = sizeof(HitTraceHeader) + 2*(static_cast<size_t>(header.fNofSamples[0]) + header.fNofSamples[1]) + header.fNofDigitalSamples[0] + header.fNofDigitalSamples[1];
+	return (size + kHitTraceAlignment - 1) & ~(kHitTraceAlignment - 1);
+}
+#endif
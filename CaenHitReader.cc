@@ -0,0 +1,324 @@
+#include "CaenHitReader.hh"
+
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "TString.h"
+
+#include "CaenRawFormat.hh"
+
+bool CaenHitBlock::Set(const HitBlockHeader& header, const char* data)
+{
+	size_t recordBytes = static_cast<size_t>(header.fNofHits)*sizeof(HitRecord);
+	if(recordBytes + header.fTraceSize > header.fSize) {
+		return false;
+	}
+	fRecords = reinterpret_cast<const HitRecord*>(data);
+	fTraces = data + recordBytes;
+
+	fTimestamps.resize(header.fNofHits);
+	fTraceOffsets.resize(header.fNofHits);
+	uint64_t timestamp = header.fFirstTimestamp;
+	size_t offset = 0;
+	for(size_t i = 0; i < header.fNofHits; ++i) {
+		timestamp += static_cast<int64_t>(fRecords[i].fTimestampDelta);
+		fTimestamps[i] = timestamp;
+		if((fRecords[i].fFlags & kHitTraces) == 0) {
+			fTraceOffsets[i] = UINT32_MAX;
+			continue;
+		}
+		if(offset + sizeof(HitTraceHeader) > header.fTraceSize) {
+			return false;
+		}
+		fTraceOffsets[i] = offset;
+		offset += HitTraceSize(TraceHeader(i));
+		if(offset > header.fTraceSize) {
+			return false;
+		}
+	}
+	return true;
+}
+
+size_t CaenHitBlock::NofSamples(size_t i, size_t trace) const
+{
+	return HasTraces(i) ? TraceHeader(i).fNofSamples[trace] : 0;
+}
+
+size_t CaenHitBlock::NofDigitalSamples(size_t i, size_t trace) const
+{
+	return HasTraces(i) ? TraceHeader(i).fNofDigitalSamples[trace] : 0;
+}
+
+const uint16_t* CaenHitBlock::Waveform(size_t i, size_t trace) const
+{
+	if(!HasTraces(i)) {
+		return nullptr;
+	}
+	const HitTraceHeader& header = TraceHeader(i);
+	const char* samples = fTraces + fTraceOffsets[i] + sizeof(HitTraceHeader);
+	if(trace == 1) {
+		samples += header.fNofSamples[0]*sizeof(uint16_t);
+	}
+	return reinterpret_cast<const uint16_t*>(samples);
+}
+
+const uint8_t* CaenHitBlock::DigitalWaveform(size_t i, size_t trace) const
+{
+	if(!HasTraces(i)) {
+		return nullptr;
+	}
+	const HitTraceHeader& header = TraceHeader(i);
+	const char* samples = fTraces + fTraceOffsets[i] + sizeof(HitTraceHeader) + (header.fNofSamples[0] + header.fNofSamples[1])*sizeof(uint16_t);
+	if(trace == 1) {
+		samples += header.fNofDigitalSamples[0];
+	}
+	return reinterpret_cast<const uint8_t*>(samples);
+}
+
+void CaenHitBlock::Fill(size_t i, CaenEvent& event) const
+{
+	const HitRecord& record = fRecords[i];
+	CaenHit hit;
+	hit.fChannel = record.fChannel;
+	hit.fTriggerTime = fTimestamps[i] & 0x7fffffff;
+	hit.fExtendedTimestamp = fTimestamps[i]>>31;
+	hit.fCfd = record.fCfd;
+	hit.fCharge = record.fCharge;
+	hit.fShortGate = record.fShortGate;
+	hit.fBaseline = record.fBaseline;
+	hit.fFormat = record.fFormat;
+	hit.fLostTrigger = (record.fFlags & kHitLostTrigger) != 0;
+	hit.fOverRange = (record.fFlags & kHitOverRange) != 0;
+	hit.fKiloCount = (record.fFlags & kHitKiloCount) != 0;
+	hit.fNLostCount = (record.fFlags & kHitNLostCount) != 0;
+	event.Read(hit);
+	event.Board(record.fBoard);
+
+	if(!HasTraces(i)) {
+		event.ClearWaveforms();
+		return;
+	}
+	for(size_t trace = 0; trace < 2; ++trace) {
+		size_t nofSamples = NofSamples(i, trace);
+		std::memcpy(event.ResizeWaveform(trace, nofSamples), Waveform(i, trace), nofSamples*sizeof(uint16_t));
+		size_t nofDigitalSamples = NofDigitalSamples(i, trace);
+		std::memcpy(event.ResizeDigitalWaveform(trace, nofDigitalSamples), DigitalWaveform(i, trace), nofDigitalSamples*sizeof(uint8_t));
+	}
+}
+
+CaenHitReader::CaenHitReader(const std::string& filename, bool debug)
+	: fFilename(filename), fFile(-1), fFileSize(0), fNofHits(0), fNext(0), fDebug(debug), fMap(nullptr)
+{
+	fFile = open(fFilename.c_str(), O_RDONLY);
+	if(fFile < 0) {
+		throw std::runtime_error(Form("Failed to open hit file \"%s\": %s", fFilename.c_str(), std::strerror(errno)));
+	}
+	// the destructor isn't called if we throw, so the file has to be closed before
+	struct stat status;
+	if(fstat(fFile, &status) != 0) {
+		std::runtime_error error(Form("Failed to get size of hit file \"%s\": %s", fFilename.c_str(), std::strerror(errno)));
+		close(fFile);
+		throw error;
+	}
+	fFileSize = status.st_size;
+
+	if(fFileSize < sizeof(HitFileHeader) || !ReadAt(0, &fHeader, sizeof(fHeader)) || fHeader.fMagic != kHitFileMagic) {
+		close(fFile);
+		throw std::runtime_error(Form("\"%s\" is not a hit file", fFilename.c_str()));
+	}
+	if(fHeader.fVersion > kHitFormatVersion) {
+		close(fFile);
+		throw std::runtime_error(Form("Hit file \"%s\" has version %d, but only versions up to %d are supported", fFilename.c_str(), fHeader.fVersion, kHitFormatVersion));
+	}
+
+	ScanBlocks();
+	if(fDebug) std::cout<<"found "<<fNofHits<<" hits in "<<fBlocks.size()<<" blocks in \""<<fFilename<<"\""<<std::endl;
+}
+
+CaenHitReader::~CaenHitReader()
+{
+	if(fMap != nullptr) {
+		munmap(fMap, fFileSize);
+	}
+	if(fFile >= 0) {
+		close(fFile);
+	}
+}
+
+size_t CaenHitReader::FindTime(uint64_t timestamp) const
+{
+	auto it = std::upper_bound(fBlocks.begin(), fBlocks.end(), timestamp, [](uint64_t time, const HitBlockEntry& entry) { return time < entry.fFirstTimestamp; });
+	if(it == fBlocks.begin()) {
+		return 0;
+	}
+	return (it - fBlocks.begin()) - 1;
+}
+
+bool CaenHitReader::ReadBlock(size_t i, CaenHitBlock& block) const
+{
+	if(i >= fBlocks.size()) {
+		return false;
+	}
+	const HitBlockEntry& entry = fBlocks[i];
+	HitBlockHeader header;
+	const char* data;
+	if(fMap != nullptr) {
+		std::memcpy(&header, fMap + entry.fOffset, sizeof(header));
+		data = fMap + entry.fOffset + sizeof(header);
+	} else {
+		block.fBuffer.resize(entry.fSize);
+		if(!ReadAt(entry.fOffset, &header, sizeof(header)) || !ReadAt(entry.fOffset + sizeof(header), block.fBuffer.data(), entry.fSize)) {
+			std::cerr<<"Failed to read block "<<i<<" at "<<entry.fOffset<<" from \""<<fFilename<<"\""<<std::endl;
+			return false;
+		}
+		data = block.fBuffer.data();
+	}
+	if(header.fMagic != kHitBlockMagic || header.fSize != entry.fSize || header.fNofHits != entry.fNofHits) {
+		std::cerr<<"Block "<<i<<" at "<<entry.fOffset<<" in \""<<fFilename<<"\" changed since the file was opened"<<std::endl;
+		return false;
+	}
+	if(Crc32(data, header.fSize) != header.fChecksum) {
+		std::cerr<<"Checksum error in block "<<i<<" (hits "<<entry.fFirstHit<<" to "<<entry.fFirstHit + entry.fNofHits<<") of \""<<fFilename<<"\""<<std::endl;
+		return false;
+	}
+	if(!block.Set(header, data)) {
+		std::cerr<<"Trace data of block "<<i<<" in \""<<fFilename<<"\" is corrupted"<<std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool CaenHitReader::Next(CaenHitBlock& block)
+{
+	// skip blocks that can't be read
+	while(fNext < fBlocks.size()) {
+		if(ReadBlock(fNext++, block)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool CaenHitReader::Map()
+{
+	if(fMap != nullptr) {
+		return true;
+	}
+	if(fFileSize == 0) {
+		return false;
+	}
+	void* map = mmap(nullptr, fFileSize, PROT_READ, MAP_SHARED, fFile, 0);
+	if(map == MAP_FAILED) {
+		if(fDebug) std::cout<<"Failed to map \""<<fFilename<<"\": "<<std::strerror(errno)<<std::endl;
+		return false;
+	}
+	fMap = static_cast<char*>(map);
+	madvise(fMap, fFileSize, MADV_SEQUENTIAL);
+	return true;
+}
+
+void CaenHitReader::ScanBlocks()
+{
+	// hop from block header to block header until the end of the file or a block that's incomplete, anything that isn't
+	// a block header is skipped by searching for the next one
+	uint64_t offset = fHeader.fHeaderSize;
+	HitBlockHeader header;
+	while(offset + sizeof(header) <= fFileSize && ReadAt(offset, &header, sizeof(header))) {
+		if(!ValidHeader(header)) {
+			uint64_t next = FindBlock(offset + kHitBlockAlignment);
+			if(next >= fFileSize) {
+				std::cerr<<"Corrupted block header at "<<offset<<" in \""<<fFilename<<"\" and no block after it, skipping the last "<<fFileSize - offset<<" bytes"<<std::endl;
+				break;
+			}
+			std::cerr<<"Corrupted block header at "<<offset<<" in \""<<fFilename<<"\", skipping "<<next - offset<<" bytes to the next block"<<std::endl;
+			offset = next;
+			continue;
+		}
+		if(offset + sizeof(header) + header.fSize > fFileSize) {
+			std::cerr<<"Last block of \""<<fFilename<<"\" is incomplete, "<<header.fSize<<" bytes expected, but only "<<fFileSize - offset - sizeof(header)<<" bytes left"<<std::endl;
+			break;
+		}
+		HitBlockEntry entry;
+		entry.fOffset = offset;
+		entry.fFirstHit = fNofHits;
+		entry.fFirstTimestamp = header.fFirstTimestamp;
+		entry.fNofHits = header.fNofHits;
+		entry.fSize = header.fSize;
+		fBlocks.push_back(entry);
+		fNofHits += header.fNofHits;
+		offset += sizeof(header) + header.fSize;
+	}
+}
+
+bool CaenHitReader::ValidHeader(const HitBlockHeader& header)
+{
+	// the blocks are padded to the alignment, and the records and traces have to fit into the block
+	return header.fMagic == kHitBlockMagic && header.fSize%kHitBlockAlignment == 0 &&
+		static_cast<uint64_t>(header.fNofHits)*sizeof(HitRecord) + header.fTraceSize <= header.fSize;
+}
+
+uint64_t CaenHitReader::FindBlock(uint64_t offset) const
+{
+	// blocks start at multiples of the block alignment, so only those offsets need to be checked for the magic word
+	const size_t chunkSize = 1<<20;
+	std::vector<char> chunk(chunkSize);
+	offset = (offset + kHitBlockAlignment - 1) & ~static_cast<uint64_t>(kHitBlockAlignment - 1);
+	while(offset + sizeof(HitBlockHeader) <= fFileSize) {
+		size_t size = std::min<uint64_t>(chunkSize, fFileSize - offset);
+		if(!ReadAt(offset, chunk.data(), size)) {
+			break;
+		}
+		for(size_t i = 0; i + sizeof(uint32_t) <= size; i += kHitBlockAlignment) {
+			uint32_t magic;
+			std::memcpy(&magic, chunk.data() + i, sizeof(magic));
+			HitBlockHeader header;
+			if(magic == kHitBlockMagic && offset + i + sizeof(header) <= fFileSize && ReadAt(offset + i, &header, sizeof(header)) && ValidHeader(header)) {
+				return offset + i;
+			}
+		}
+		offset += size;
+	}
+	return fFileSize;
+}
+
+bool CaenHitReader::ReadAt(uint64_t offset, void* data, size_t size) const
+{
+	char* buffer = static_cast<char*>(data);
+	while(size > 0) {
+		ssize_t result = pread(fFile, buffer, size, static_cast<off_t>(offset));
+		if(result < 0 && errno == EINTR) {
+			continue;
+		}
+		if(result <= 0) {
+			return false;
+		}
+		buffer += result;
+		offset += result;
+		size -= result;
+	}
+	return true;
+}
+
+bool CaenHitIterator::Next()
+{
+	if(fStarted && fIndex + 1 < fBlock.Size()) {
+		++fIndex;
+		return true;
+	}
+	while(fReader.Next(fBlock)) {
+		if(fBlock.Size() > 0) {
+			fIndex = 0;
+			fStarted = true;
+			return true;
+		}
+	}
+	return false;
+}
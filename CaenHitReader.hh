@@ -0,0 +1,119 @@
+#ifndef CAENHITREADER_HH
+#define CAENHITREADER_HH
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "CaenEvent.hh"
+#include "CaenHitFormat.hh"
+
+// position of one block in a hit file
+struct HitBlockEntry {
+	uint64_t fOffset;         // file position of the block header
+	uint64_t fFirstHit;       // number of hits in the blocks before this one
+	uint64_t fFirstTimestamp;
+	uint32_t fNofHits;
+	uint32_t fSize;           // bytes following the block header
+};
+
+// One block of hits, pointing into the mapped file or into its own buffer.
+// The timestamps are decoded when the block is read, everything else is used in place.
+class CaenHitBlock {
+public:
+	CaenHitBlock() : fRecords(nullptr), fTraces(nullptr) {}
+
+	size_t Size() const { return fTimestamps.size(); }
+	const HitRecord& Record(size_t i) const { return fRecords[i]; }
+	uint64_t Timestamp(size_t i) const { return fTimestamps[i]; }
+	double Time(size_t i) const { return fTimestamps[i]*2. + fRecords[i].fCfd/512.; } // in ns, same as CaenEvent::GetTime
+
+	bool HasTraces(size_t i) const { return (fRecords[i].fFlags & kHitTraces) != 0; }
+	size_t NofSamples(size_t i, size_t trace) const;
+	size_t NofDigitalSamples(size_t i, size_t trace) const;
+	const uint16_t* Waveform(size_t i, size_t trace) const;
+	const uint8_t*  DigitalWaveform(size_t i, size_t trace) const;
+
+	void Fill(size_t i, CaenEvent& event) const;
+
+private:
+	friend class CaenHitReader;
+
+	bool Set(const HitBlockHeader& header, const char* data); // returns false if the trace data doesn't add up
+	const HitTraceHeader& TraceHeader(size_t i) const { return *reinterpret_cast<const HitTraceHeader*>(fTraces + fTraceOffsets[i]); }
+
+	const HitRecord* fRecords;
+	const char* fTraces;
+	std::vector<uint64_t> fTimestamps;
+	std::vector<uint32_t> fTraceOffsets; // offset of the trace data of each hit with traces
+	std::vector<char> fBuffer;           // data of the block if the file isn't mapped
+};
+
+// Reads hit files written by CaenHitWriter.
+// The blocks are found by hopping from block header to block header, a block that is incomplete (because the file
+// wasn't closed properly or is still being written) ends the file. ReadBlock only uses pread, so several threads can
+// read different blocks from the same reader. After Map the blocks are used in place instead of being copied.
+// The hits are in time order, so FindTime can find the block of any time without reading the blocks.
+class CaenHitReader {
+public:
+	explicit CaenHitReader(const std::string& filename, bool debug = false);
+	~CaenHitReader();
+
+	const HitFileHeader& Header() const { return fHeader; }
+	bool HasTraces() const { return (fHeader.fFlags & kHitFileTraces) != 0; }
+	uint64_t FileSize() const { return fFileSize; }
+
+	size_t NofBlocks() const { return fBlocks.size(); }
+	uint64_t NofHits() const { return fNofHits; }
+	const HitBlockEntry& Block(size_t i) const { return fBlocks[i]; }
+	size_t FindTime(uint64_t timestamp) const; // last block starting at or before timestamp
+
+	// returns false if the block can't be read or the checksum is wrong
+	bool ReadBlock(size_t i, CaenHitBlock& block) const;
+	// reads the block at the current position and advances it, returns false at the end of the file
+	bool Next(CaenHitBlock& block);
+	void Seek(size_t i) { fNext = i; }
+	size_t Tell() const { return fNext; }
+
+	// maps the file into memory, returns false if that's not possible
+	bool Map();
+	bool IsMapped() const { return fMap != nullptr; }
+
+private:
+	void ScanBlocks();
+	static bool ValidHeader(const HitBlockHeader& header);
+	uint64_t FindBlock(uint64_t offset) const; // offset of the next block header at or after offset, or the file size
+	bool ReadAt(uint64_t offset, void* data, size_t size) const;
+
+	std::string fFilename;
+	int fFile;
+	uint64_t fFileSize;
+	HitFileHeader fHeader;
+	std::vector<HitBlockEntry> fBlocks;
+	uint64_t fNofHits;
+	size_t fNext;
+	bool fDebug;
+	char* fMap;
+};
+
+// Iterates over all hits of a hit file, e.g.
+//   CaenHitIterator it(reader);
+//   while(it.Next()) it.Fill(event);
+class CaenHitIterator {
+public:
+	explicit CaenHitIterator(CaenHitReader& reader) : fReader(reader), fIndex(0), fStarted(false) {}
+
+	bool Next(); // advances to the next hit, returns false at the end of the file
+
+	const CaenHitBlock& Block() const { return fBlock; }
+	size_t Index() const { return fIndex; } // of the current hit in Block()
+	const HitRecord& Record() const { return fBlock.Record(fIndex); }
+	uint64_t Timestamp() const { return fBlock.Timestamp(fIndex); }
+	void Fill(CaenEvent& event) const { fBlock.Fill(fIndex, event); }
+
+private:
+	CaenHitReader& fReader;
+	CaenHitBlock fBlock;
+	size_t fIndex;
+	bool fStarted;
+};
+#endif
@@ -0,0 +1,283 @@
+#include "CaenHitWriter.hh"
+
+#include <iostream>
+#include <stdexcept>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "TString.h"
+
+#include "CaenRawFormat.hh"
+
+namespace {
+	// writes all parts, returns the number of bytes written, or -errno if the write failed
+	int64_t WriteParts(int file, struct iovec* parts, int nofParts)
+	{
+		int64_t written = 0;
+		int first = 0;
+		while(first < nofParts) {
+			ssize_t result = writev(file, parts + first, nofParts - first);
+			if(result < 0) {
+				if(errno == EINTR) {
+					continue;
+				}
+				return -errno;
+			}
+			written += result;
+			// skip the parts that were written completely, and the part of the next one that was
+			while(first < nofParts && static_cast<size_t>(result) >= parts[first].iov_len) {
+				result -= parts[first].iov_len;
+				++first;
+			}
+			if(first < nofParts) {
+				parts[first].iov_base = static_cast<char*>(parts[first].iov_base) + result;
+				parts[first].iov_len -= result;
+			}
+		}
+		return written;
+	}
+
+	const char kPadding[kHitBlockAlignment] = { 0 };
+}
+
+CaenHitWriter::CaenHitWriter(const std::string& filename, const CaenSettings& settings)
+	: fFilename(filename), fFile(-1), fBlockSize(settings.HitBlockSize()), fWaveforms(settings.HitWaveforms()), fCurrent(nullptr), fNofHits(0), fWriting(true), fBytesWritten(0), fWriteNanoseconds(0), fStalls(0), fError(0)
+{
+	fFile = open(fFilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fFile < 0) {
+		throw std::runtime_error(Form("Failed to open hit file \"%s\": %s", fFilename.c_str(), std::strerror(errno)));
+	}
+
+	HitFileHeader header;
+	header.fMagic = kHitFileMagic;
+	header.fVersion = kHitFormatVersion;
+	header.fHeaderSize = sizeof(HitFileHeader);
+	header.fNofBoards = settings.NumberOfBoards();
+	header.fFlags = fWaveforms ? kHitFileTraces : 0;
+	header.fStartTime = WallTime();
+	struct iovec part = { &header, sizeof(header) };
+	int64_t written = WriteParts(fFile, &part, 1);
+	if(written < 0) {
+		close(fFile);
+		fFile = -1;
+		throw std::runtime_error(Form("Failed to write header of hit file \"%s\": %s", fFilename.c_str(), std::strerror(-written)));
+	}
+	fBytesWritten = written;
+
+	fBlocks.resize(settings.HitBuffers());
+	for(auto& block : fBlocks) {
+		block.fRecords.reserve(fBlockSize);
+		block.fLastTimestamp = 0;
+		fFree.push_back(&block);
+	}
+	fCurrent = fFree.front();
+	fFree.pop_front();
+
+	fThread = std::thread(&CaenHitWriter::WriteBlocks, this);
+}
+
+CaenHitWriter::~CaenHitWriter()
+{
+	Close();
+}
+
+void CaenHitWriter::Add(const CaenEvent& event)
+{
+	// this is called from the readout loop, so a failed write only drops the hit, the loop checks Error() and stops
+	if(fError != 0) {
+		return;
+	}
+	uint64_t timestamp = event.GetTimestamp();
+	if(!fCurrent->fRecords.empty()) {
+		// start a new block if the difference doesn't fit into the record
+		int64_t delta = static_cast<int64_t>(timestamp - fCurrent->fLastTimestamp);
+		if(delta < INT32_MIN || delta > INT32_MAX) {
+			Submit();
+		}
+	}
+	if(fCurrent->fRecords.empty()) {
+		fCurrent->fHeader.fFirstTimestamp = timestamp;
+		fCurrent->fLastTimestamp = timestamp;
+	}
+
+	HitRecord record;
+	record.fTimestampDelta = static_cast<int32_t>(static_cast<int64_t>(timestamp - fCurrent->fLastTimestamp));
+	record.fFormat = event.Format();
+	record.fCfd = event.Cfd();
+	record.fCharge = event.Charge();
+	record.fShortGate = event.ShortGate();
+	record.fBaseline = event.Baseline();
+	record.fChannel = static_cast<uint8_t>(event.Channel());
+	record.fBoard = event.Board();
+	record.fFlags = 0;
+	if(event.LostTrigger()) record.fFlags |= kHitLostTrigger;
+	if(event.OverRange())   record.fFlags |= kHitOverRange;
+	if(event.KiloCount())   record.fFlags |= kHitKiloCount;
+	if(event.NLostCount())  record.fFlags |= kHitNLostCount;
+	if((event.Format()>>31) == 0x1) record.fFlags |= kHitDualTrace;
+	record.fReserved = 0;
+	if(fWaveforms) {
+		for(const auto& trace : event.Waveforms()) {
+			if(!trace.empty()) record.fFlags |= kHitTraces;
+		}
+		for(const auto& trace : event.DigitalWaveforms()) {
+			if(!trace.empty()) record.fFlags |= kHitTraces;
+		}
+		if((record.fFlags & kHitTraces) != 0) {
+			AddTraces(event, *fCurrent);
+		}
+	}
+	fCurrent->fRecords.push_back(record);
+	fCurrent->fLastTimestamp = timestamp;
+	++fNofHits;
+
+	if(fCurrent->fRecords.size() >= fBlockSize) {
+		Submit();
+	}
+}
+
+void CaenHitWriter::AddTraces(const CaenEvent& event, Block& block)
+{
+	const auto& analog = event.Waveforms();
+	const auto& digital = event.DigitalWaveforms();
+	HitTraceHeader header;
+	for(size_t i = 0; i < 2; ++i) {
+		header.fNofSamples[i] = i < analog.size() ? analog[i].size() : 0;
+		header.fNofDigitalSamples[i] = i < digital.size() ? digital[i].size() : 0;
+	}
+	// resize zeroes the padding
+	size_t begin = block.fTraces.size();
+	block.fTraces.resize(begin + HitTraceSize(header));
+	char* data = block.fTraces.data() + begin;
+	std::memcpy(data, &header, sizeof(header));
+	data += sizeof(header);
+	for(size_t i = 0; i < 2; ++i) {
+		if(header.fNofSamples[i] == 0) continue;
+		std::memcpy(data, analog[i].data(), header.fNofSamples[i]*sizeof(uint16_t));
+		data += header.fNofSamples[i]*sizeof(uint16_t);
+	}
+	for(size_t i = 0; i < 2; ++i) {
+		if(header.fNofDigitalSamples[i] == 0) continue;
+		std::memcpy(data, digital[i].data(), header.fNofDigitalSamples[i]);
+		data += header.fNofDigitalSamples[i];
+	}
+}
+
+void CaenHitWriter::Flush()
+{
+	if(fCurrent != nullptr && !fCurrent->fRecords.empty()) {
+		Submit();
+	}
+}
+
+void CaenHitWriter::Submit()
+{
+	HitBlockHeader& header = fCurrent->fHeader;
+	size_t size = fCurrent->fRecords.size()*sizeof(HitRecord) + fCurrent->fTraces.size();
+	header.fMagic = kHitBlockMagic;
+	header.fNofHits = fCurrent->fRecords.size();
+	header.fSize = (size + kHitBlockAlignment - 1) & ~(kHitBlockAlignment - 1);
+	header.fChecksum = 0; // calculated by the background thread
+	header.fTraceSize = fCurrent->fTraces.size();
+	header.fReserved = 0;
+
+	std::unique_lock<std::mutex> lock(fMutex);
+	fFull.push_back(fCurrent);
+	fFullCondition.notify_one();
+	if(fFree.empty()) {
+		++fStalls;
+		fFreeCondition.wait(lock, [this]() { return !fFree.empty(); });
+	}
+	fCurrent = fFree.front();
+	fFree.pop_front();
+}
+
+void CaenHitWriter::Close()
+{
+	if(fFile < 0) {
+		return;
+	}
+	if(fError == 0) {
+		Flush();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(fMutex);
+		fWriting = false;
+	}
+	fFullCondition.notify_one();
+	fThread.join();
+
+	close(fFile);
+	fFile = -1;
+	if(fError != 0) {
+		std::cerr<<"Failed to write to hit file \""<<fFilename<<"\": "<<std::strerror(fError)<<std::endl;
+	}
+}
+
+double CaenHitWriter::Rate() const
+{
+	if(fWriteNanoseconds == 0) {
+		return 0.;
+	}
+	return fBytesWritten/1024./1024./(fWriteNanoseconds/1e9);
+}
+
+size_t CaenHitWriter::QueueDepth()
+{
+	std::lock_guard<std::mutex> lock(fMutex);
+	return fFull.size();
+}
+
+void CaenHitWriter::WriteBlock(Block* block)
+{
+	auto start = std::chrono::steady_clock::now();
+	HitBlockHeader& header = block->fHeader;
+	size_t recordBytes = block->fRecords.size()*sizeof(HitRecord);
+	size_t padding = header.fSize - recordBytes - block->fTraces.size();
+	header.fChecksum = Crc32(reinterpret_cast<const char*>(block->fRecords.data()), recordBytes);
+	header.fChecksum = Crc32(block->fTraces.data(), block->fTraces.size(), header.fChecksum);
+	header.fChecksum = Crc32(kPadding, padding, header.fChecksum);
+
+	struct iovec parts[4] = {
+		{ &header, sizeof(header) },
+		{ block->fRecords.data(), recordBytes },
+		{ block->fTraces.data(), block->fTraces.size() },
+		{ const_cast<char*>(kPadding), padding }
+	};
+	int64_t written = WriteParts(fFile, parts, 4);
+	if(written < 0) {
+		fError = -written;
+	} else {
+		fBytesWritten += written;
+	}
+	fWriteNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+void CaenHitWriter::WriteBlocks()
+{
+	std::unique_lock<std::mutex> lock(fMutex);
+	while(true) {
+		fFullCondition.wait(lock, [this]() { return !fFull.empty() || !fWriting; });
+		if(fFull.empty()) {
+			break;
+		}
+		Block* block = fFull.front();
+		fFull.pop_front();
+		lock.unlock();
+		// once a write failed, the blocks are only recycled, Add drops all further hits
+		if(fError == 0) {
+			WriteBlock(block);
+		}
+		block->fRecords.clear();
+		block->fTraces.clear();
+		lock.lock();
+		fFree.push_back(block);
+		fFreeCondition.notify_one();
+	}
+}
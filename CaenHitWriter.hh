@@ -0,0 +1,72 @@
+#ifndef CAENHITWRITER_HH
+#define CAENHITWRITER_HH
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+
+#include "CaenSettings.hh"
+#include "CaenEvent.hh"
+#include "CaenHitFormat.hh"
+
+// Writes the sorted hits to a hit file (see CaenHitFormat.hh) from a background thread, without ROOT.
+// Add encodes a hit straight into the current block, so the event can be reused right away. Full blocks (HitBlockSize
+// hits) are written by the background thread with one large sequential write each while the next block is being filled.
+// If all HitBuffers blocks are waiting to be written, Add waits for the background thread. Once a background write has
+// failed all further hits are dropped, callers check Error() and stop the run.
+class CaenHitWriter {
+public:
+	CaenHitWriter(const std::string& filename, const CaenSettings& settings);
+	~CaenHitWriter();
+
+	void Add(const CaenEvent& event);
+	void Flush(); // hands the current block to the background thread, even if it isn't full
+	void Close(); // writes the remaining hits and closes the file, called by the destructor if necessary
+
+	bool IsOpen() const { return fFile >= 0; }
+	int Error() const { return fError; } // errno of a failed background write, 0 if all writes succeeded so far
+	uint64_t NofHits() const { return fNofHits; }
+	uint64_t BytesWritten() const { return fBytesWritten; }
+	double Rate() const;        // sustained rate of the background writes in MB/s
+	size_t QueueDepth();        // number of blocks waiting to be written
+	uint64_t Stalls() const { return fStalls; } // how often Add had to wait for the background thread
+
+private:
+	struct Block {
+		HitBlockHeader fHeader;
+		std::vector<HitRecord> fRecords;
+		std::vector<char> fTraces;
+		uint64_t fLastTimestamp;
+	};
+
+	void AddTraces(const CaenEvent& event, Block& block);
+	void Submit();        // hands the current block to the background thread
+	void WriteBlocks();   // background thread
+	void WriteBlock(Block* block);
+
+	std::string fFilename;
+	int fFile;
+	size_t fBlockSize;
+	bool fWaveforms;
+	std::vector<Block> fBlocks;
+	Block* fCurrent;
+	std::deque<Block*> fFree;
+	std::deque<Block*> fFull;
+	uint64_t fNofHits;
+
+	std::thread fThread;
+	std::mutex fMutex;
+	std::condition_variable fFreeCondition;
+	std::condition_variable fFullCondition;
+	bool fWriting;
+
+	std::atomic<uint64_t> fBytesWritten;
+	std::atomic<uint64_t> fWriteNanoseconds; // time spent in the background writes
+	uint64_t fStalls;
+	std::atomic<int> fError; // errno of a failed write from the background thread
+};
+#endif
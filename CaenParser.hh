@@ -1,18 +1,157 @@
 #ifndef CAENPARSER_HH
 #define CAENPARSER_HH
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
 
-// This contains a single function to parse data from a DT5730 digitizer into (custom) CaenEvents
+#include "CaenEvent.hh"
+#include "CaenHit.hh"
+#include "CaenUnpack.hh"
 
-std::vector<CaenEvent*> ParseData(char* bank, int bankSize, int debug) {
-	if(debug > 4) {
-		std::cout<<"starting to read bank "<<static_cast<void*>(bank)<<" of size "<<bankSize<<std::endl;
+// This contains the functions to parse data from a DT5730 digitizer running DPP-PSD firmware.
+//
+// ParseData(data, nofWords, sink, debug) decodes the board aggregates in data and hands each hit to the sink, which
+// needs two member functions:
+//   bool Traces(size_t nofSamples, bool dualTrace, CaenTraces& traces)
+//      called before the samples of a hit are decoded, nofSamples is the number of samples per digital trace. Returns
+//      false if the traces aren't needed, otherwise the pointers in traces have to point to enough space for the
+//      samples, or fWords to space for the sample words if the sink unpacks them itself later (see CaenTraces).
+//   void Add(const CaenHit& hit)
+//      called once the hit has been decoded, the traces (if any) belong to this hit.
+// This doesn't allocate anything itself, so with a sink that reuses its storage decoding doesn't allocate at all.
+// Returns false if the data is corrupted, the hits before the corruption are still handed to the sink.
+//
+// ParseData(bank, bankSize, debug) returns the hits as new CaenEvents.
+//
+// For data that doesn't come in complete board aggregates use CaenStreamParser (see CaenStreamParser.hh).
+
+inline void PrintWord(const uint32_t* data, size_t w)
+{
+	std::cout<<w<<" - 0x"<<std::hex<<std::setw(8)<<std::setfill('0')<<data[w]<<std::dec<<std::setfill(' ')<<std::endl;
+}
+
+// Decodes the nofEvents hits of one channel aggregate starting at word w, returns the word after the last hit.
+// The format of the hits is fixed for the whole aggregate, so it's a template parameter and the compiler can drop all
+// checks of it from the loop. ExtraFormat is only used if Extras is true, -1 stands for the formats that don't contain
+// anything we keep (lost/total trigger counters, CFD samples).
+template<bool Waveform, bool DualTrace, bool Extras, int ExtraFormat, class Sink>
+size_t ParseHits(const uint32_t* data, size_t w, size_t nofEvents, size_t numSampleWords, uint8_t channel, uint32_t format, Sink& sink, int debug)
+{
+	CaenHit hit;
+	CaenTraces traces;
+	// these stay the same for all hits of this format
+	hit.fFormat = format;
+	hit.fExtendedTimestamp = 0;
+	hit.fCfd = 0;
+	hit.fBaseline = 0;
+	hit.fLostTrigger = false;
+	hit.fKiloCount = false;
+	hit.fNLostCount = false;
+	for(size_t ev = 0; ev < nofEvents; ++ev) {
+		if(debug > 6) {
+			std::cout<<"--------------------"<<std::endl;
+			PrintWord(data, w);
+		}
+		hit.fChannel = channel + (data[w]>>31); // highest bit indicates odd channel
+		hit.fTriggerTime = data[w++] & 0x7fffffff;
+		if(Waveform) {
+			traces.fWords = nullptr;
+			if(sink.Traces(2*numSampleWords, DualTrace, traces)) {
+				if(debug > 7) {
+					for(size_t s = 0; s < numSampleWords; ++s) {
+						PrintWord(data, w + s);
+					}
+				}
+				if(traces.fWords != nullptr) {
+					std::memcpy(traces.fWords, data + w, numSampleWords*sizeof(uint32_t));
+				} else {
+					UnpackSamples(data + w, numSampleWords, DualTrace, traces);
+				}
+			}
+			w += numSampleWords;
+		}
+		if(Extras) {
+			if(debug > 6) {
+				PrintWord(data, w);
+			}
+			switch(ExtraFormat) {
+				case 0: // [31:16] extended time stamp, [15:0] baseline*4
+					hit.fBaseline = data[w]&0xffff;
+					hit.fExtendedTimestamp = data[w]>>16;
+					break;
+				case 1: // [31:16] extended time stamp, 15 trigger lost, 14 over range, 13 1024 triggers, 12 n lost triggers
+					hit.fNLostCount = ((data[w]>>12)&0x1) == 0x1;
+					hit.fKiloCount = ((data[w]>>13)&0x1) == 0x1;
+					hit.fLostTrigger = ((data[w]>>15)&0x1) == 0x1;
+					hit.fExtendedTimestamp = data[w]>>16;
+					break;
+				case 2: // [31:16] extended time stamp,  15 trigger lost, 14 over range, 13 1024 triggers, 12 n lost triggers, [9:0] fine time stamp
+					hit.fCfd = data[w]&0x3ff;
+					hit.fNLostCount = ((data[w]>>12)&0x1) == 0x1;
+					hit.fKiloCount = ((data[w]>>13)&0x1) == 0x1;
+					hit.fLostTrigger = ((data[w]>>15)&0x1) == 0x1;
+					hit.fExtendedTimestamp = data[w]>>16;
+					break;
+				case 7: // fixed value of 0x12345678
+					if(data[w] != 0x12345678) {
+						std::cerr<<"Failed to get debug data word 0x12345678, got "<<std::hex<<std::setw(8)<<std::setfill('0')<<data[w]<<std::dec<<std::setfill(' ')<<std::endl;
+					}
+					break;
+				default: // 4: [31:16] lost trigger counter, [15:0] total trigger counter, 5: [31:16] CFD sample after zero cross., [15:0] CFD sample before zero cross.
+					break;
+			}
+			++w;
+		}
+		if(debug > 6) {
+			PrintWord(data, w);
+		}
+		// the over range flag of the extras is overwritten by the one in the charge word
+		hit.fShortGate = data[w]&0x7fff;
+		hit.fOverRange = ((data[w]>>15) & 0x1) == 0x1;
+		hit.fCharge = data[w++]>>16;
+		sink.Add(hit);
 	}
-	std::vector<CaenEvent*> result;
-	uint32_t* data = reinterpret_cast<uint32_t*>(bank);
+	return w;
+}
+
+template<bool Waveform, bool DualTrace, class Sink>
+size_t ParseHits(const uint32_t* data, size_t w, size_t nofEvents, size_t numSampleWords, uint8_t channel, uint32_t format, bool extras, uint8_t extraFormat, Sink& sink, int debug)
+{
+	if(!extras) {
+		return ParseHits<Waveform, DualTrace, false, -1>(data, w, nofEvents, numSampleWords, channel, format, sink, debug);
+	}
+	switch(extraFormat) {
+		case 0:  return ParseHits<Waveform, DualTrace, true, 0>(data, w, nofEvents, numSampleWords, channel, format, sink, debug);
+		case 1:  return ParseHits<Waveform, DualTrace, true, 1>(data, w, nofEvents, numSampleWords, channel, format, sink, debug);
+		case 2:  return ParseHits<Waveform, DualTrace, true, 2>(data, w, nofEvents, numSampleWords, channel, format, sink, debug);
+		case 7:  return ParseHits<Waveform, DualTrace, true, 7>(data, w, nofEvents, numSampleWords, channel, format, sink, debug);
+		default: return ParseHits<Waveform, DualTrace, true, -1>(data, w, nofEvents, numSampleWords, channel, format, sink, debug);
+	}
+}
 
+// picks the specialisation of ParseHits for the format of this channel aggregate
+template<class Sink>
+size_t ParseChannelAggregate(const uint32_t* data, size_t w, size_t nofEvents, size_t numSampleWords, uint8_t channel, uint32_t format, bool waveform, bool dualTrace, bool extras, uint8_t extraFormat, Sink& sink, int debug)
+{
+	if(!waveform) {
+		// without waveform the dual trace flag doesn't matter
+		return ParseHits<false, false>(data, w, nofEvents, numSampleWords, channel, format, extras, extraFormat, sink, debug);
+	}
+	if(dualTrace) {
+		return ParseHits<true, true>(data, w, nofEvents, numSampleWords, channel, format, extras, extraFormat, sink, debug);
+	}
+	return ParseHits<true, false>(data, w, nofEvents, numSampleWords, channel, format, extras, extraFormat, sink, debug);
+}
+
+template<class Sink>
+bool ParseData(const uint32_t* data, size_t nofWords, Sink& sink, int debug = 0)
+{
 	if(debug > 5) {
 		std::cout<<std::hex<<std::setfill('0');
-		for(int w = 0; w < bankSize; ++w) {
+		for(size_t w = 0; w < nofWords; ++w) {
 			std::cout<<"0x"<<std::setw(8)<<data[w]<<" ";
 			if(w%10 == 9) {
 				std::cout<<std::endl;
@@ -21,31 +160,34 @@ std::vector<CaenEvent*> ParseData(char* bank, int bankSize, int debug) {
 		std::cout<<std::dec<<std::setfill(' ')<<std::endl;
 	}
 
-	int w = 0;
-	for(int board = 0; w < bankSize; ++board) {
+	size_t w = 0;
+	for(int board = 0; w < nofWords; ++board) {
 		if(debug > 5) {
 			std::cout<<"----------------------------------------"<<std::endl;
-			std::cout<<w<<" - 0x"<<std::hex<<std::setw(8)<<std::setfill('0')<<data[w]<<std::dec<<std::setfill(' ')<<std::endl;
+			PrintWord(data, w);
 		}
 		// read board aggregate header
 		if(data[w]>>28 != 0xa) {
 			if(data[w] == 0x0) {
-				while(w < bankSize) {
+				// the rest should be padding
+				while(w < nofWords) {
 					if(data[w++] != 0x0) {
 						std::cerr<<board<<". board - failed on first word, found empty word, but not all following words were empty: "<<w-1<<" 0x"<<std::hex<<std::setw(8)<<std::setfill('0')<<data[w-1]<<std::dec<<std::setfill(' ')<<std::endl;
-						return result;
+						return false;
 					}
 				}
-				return result;
+				return true;
 			}
 			std::cerr<<board<<". board - failed on first word 0x"<<std::hex<<std::setw(8)<<std::setfill('0')<<data[w]<<std::dec<<std::setfill(' ')<<", highest nibble should have been 0xa!"<<std::endl;
-			return result;
+			return false;
 		}
-		int32_t numWordsBoard = data[w++]&0xfffffff; // this is the number of 32-bit words from this board
-		if(w - 1 + numWordsBoard > bankSize) { 
-			std::cerr<<"0 - Missing words, at word "<<w-1<<", expecting "<<numWordsBoard<<" more words for board "<<board<<" (bank size "<<bankSize<<")"<<std::endl;
-			return result;
+		size_t numWordsBoard = data[w]&0xfffffff; // this is the number of 32-bit words from this board
+		if(numWordsBoard < 4 || w + numWordsBoard > nofWords) {
+			std::cerr<<"0 - Missing words, at word "<<w<<", expecting "<<numWordsBoard<<" more words for board "<<board<<" (bank size "<<nofWords<<")"<<std::endl;
+			return false;
 		}
+		size_t boardEnd = w + numWordsBoard;
+		++w;
 		uint8_t boardId = data[w]>>27; // GEO address of board (can be set via register 0xef08 for VME)
 		uint16_t pattern = (data[w]>>8) & 0x7fff; // value read from LVDS I/O (VME only)
 		uint8_t channelMask = data[w++]&0xff; // which channels are in this board aggregate
@@ -64,21 +206,21 @@ std::vector<CaenEvent*> ParseData(char* bank, int bankSize, int debug) {
 				continue;
 			}
 			// read channel aggregate header
+			if(w + 2 > boardEnd) {
+				std::cerr<<"1 - Missing words, got only "<<w<<" words for channel "<<static_cast<int>(channel)<<" (board aggregate ends at "<<boardEnd<<")"<<std::endl;
+				return false;
+			}
 			if(data[w]>>31 != 0x1) {
 				std::cerr<<"Failed on first word 0x"<<std::hex<<std::setw(8)<<std::setfill('0')<<data[w]<<std::dec<<std::setfill(' ')<<", highest bit should have been set!"<<std::endl;
-				return result;
+				return false;
 			}
-			int32_t numWords = data[w++]&0x3fffff;//per channel
+			size_t numWords = data[w++]&0x3fffff; // per channel
 			if(debug > 6) {
-				std::cout<<w<<" - 0x"<<std::hex<<std::setw(8)<<std::setfill('0')<<data[w]<<std::dec<<std::setfill(' ')<<std::endl;
-			}
-			if(w >= bankSize) {
-				std::cerr<<"1 - Missing words, got only "<<w-1<<" words for channel "<<channel<<" (bank size "<<bankSize<<")"<<std::endl;
-				return result;
+				PrintWord(data, w);
 			}
 			if(((data[w]>>29) & 0x3) != 0x3) {
 				std::cerr<<"Failed on second word 0x"<<std::hex<<std::setw(8)<<std::setfill('0')<<data[w]<<std::dec<<std::setfill(' ')<<", bits 29 and 30 should have been set!"<<std::endl;
-				return result;
+				return false;
 			}
 			bool dualTrace = ((data[w]>>31) == 0x1);
 			bool extras    = (((data[w]>>28) & 0x1) == 0x1);
@@ -89,118 +231,74 @@ std::vector<CaenEvent*> ParseData(char* bank, int bankSize, int debug) {
 			//            else          00 = "Input", 01 = "CFD"
 			//bits 19,20,21: 000 = "Long gate",  001 = "over thres.", 010 = "shaped TRG", 011 = "TRG Val. Accept. Win.", 100 = "Pile Up", 101 = "Coincidence", 110 = reserved, 111 = "Trigger"
 			//bits 16,17,18: 000 = "Short gate", 001 = "over thres.", 010 = "TRG valid.", 011 = "TRG HoldOff",           100 = "Pile Up", 101 = "Coincidence", 110 = reserved, 111 = "Trigger"
-			int numSampleWords = 4*(data[w++]&0xffff);// this is actually the number of samples divided by eight, 2 sample per word => 4*
-			if(w >= bankSize) {
-				std::cerr<<"2 - Missing words, got only "<<w-1<<" words for channel "<<channel<<" (bank size "<<bankSize<<")"<<std::endl;
-				return result;
-			}
-			int eventSize = numSampleWords+2; // +2 = trigger time words and charge word
+			uint32_t format = data[w];
+			size_t numSampleWords = waveform ? 4*(data[w]&0xffff) : 0; // this is actually the number of samples divided by eight, 2 sample per word => 4*
+			++w;
+			size_t eventSize = numSampleWords+2; // +2 = trigger time words and charge word
 			if(extras) ++eventSize;
 			if(debug > 5) {
-				std::cout<<"supposed to have "<<numWords<<" words in this channel, "<<(waveform?"w/":"w/o")<<" waveform(s), "<<(dualTrace?"w/":"w/o")<<" dual trace, "<<(extras?"w/":"w/o")<<" extras in format "<<static_cast<uint16_t>(extraFormat)<<", with "<<numSampleWords<<" sample words, at word "<<w<<"/"<<bankSize<<", event size "<<eventSize<<" => "<<(numWords-2)/eventSize<<" events"<<std::endl;
+				std::cout<<"supposed to have "<<numWords<<" words in this channel, "<<(waveform?"w/":"w/o")<<" waveform(s), "<<(dualTrace?"w/":"w/o")<<" dual trace, "<<(extras?"w/":"w/o")<<" extras in format "<<static_cast<uint16_t>(extraFormat)<<", with "<<numSampleWords<<" sample words, at word "<<w<<"/"<<nofWords<<", event size "<<eventSize<<" => "<<(numWords-2)/eventSize<<" events"<<std::endl;
 			}
-			if(numWords%eventSize != 2) {
+			if(numWords < 2 || (numWords-2)%eventSize != 0) {
 				std::cerr<<numWords<<" words in channel aggregate, event size is "<<eventSize<<" => "<<static_cast<double>(numWords-2.)/static_cast<double>(eventSize)<<" events?"<<std::endl;
-				return result;
+				return false;
+			}
+			if(w - 2 + numWords > boardEnd) {
+				std::cerr<<"2 - Missing words, channel "<<static_cast<int>(channel)<<" needs "<<numWords<<" words, but board aggregate ends at "<<boardEnd<<std::endl;
+				return false;
 			}
 
 			// read channel data
-			for(int ev = 0; ev < (numWords-2)/eventSize; ++ev) { // -2 = 2 header words for channel aggregate
-				if(debug > 6) {
-					std::cout<<"--------------------"<<std::endl;
-					std::cout<<w<<" - 0x"<<std::hex<<std::setw(8)<<std::setfill('0')<<data[w]<<std::dec<<std::setfill(' ')<<std::endl;
-				}
-				auto event = new CaenEvent;
-				event->Channel(channel + (data[w]>>31)); // highest bit indicates odd channel
-				event->TriggerTime(data[w++] & 0x7fffffff);
-				if(waveform) {
-					if(w + numSampleWords >= bankSize) { // need to read at least the sample words plus the charge/extra word
-						std::cerr<<"3 - Missing "<<numSampleWords<<" waveform words, got only "<<w-1<<" words for channel "<<channel<<" (bank size "<<bankSize<<")"<<std::endl;
-						return result;
-					}
-					for(int s = 0; s < numSampleWords && w < bankSize; ++s, ++w) {
-						if(debug > 7) {
-							std::cout<<w<<" - 0x"<<std::hex<<std::setw(8)<<std::setfill('0')<<data[w]<<std::dec<<std::setfill(' ')<<std::endl;
-						}
-						event->AddDigitalWaveformSample(0, (data[w]>>14)&0x1);
-						event->AddDigitalWaveformSample(1, (data[w]>>15)&0x1);
-						if(dualTrace) {
-							// all even samples are from the first trace, all odd ones from the second trace
-							event->AddWaveformSample(1, data[w]&0x3fff);
-							event->AddWaveformSample(0, (data[w]>>16)&0x3fff);
-						} else {
-							// both samples are from the first trace
-							event->AddWaveformSample(0, data[w]&0x3fff);
-							event->AddWaveformSample(0, (data[w]>>16)&0x3fff);
-						}
-						event->AddDigitalWaveformSample(0, (data[w]>>30)&0x1);
-						event->AddDigitalWaveformSample(1, (data[w]>>31)&0x1);
-					}
-				} else {
-					if(w >= bankSize) { // need to read at least the sample words plus the charge/extra word
-						std::cerr<<"3 - Missing words, got only "<<w-1<<" words for channel "<<channel<<" (bank size "<<bankSize<<")"<<std::endl;
-						return result;
-					}
-				}
-				if(extras) {
-					if(debug > 6) {
-						std::cout<<w<<" - 0x"<<std::hex<<std::setw(8)<<std::setfill('0')<<data[w]<<std::dec<<std::setfill(' ')<<std::endl;
-					}
-					switch(extraFormat) {
-						case 0: // [31:16] extended time stamp, [15:0] baseline*4
-							//event->Baseline(data[w]&0xffff);
-							event->ExtendedTimestamp(data[w++]>>16);
-							break;
-						case 1: // [31:16] extended time stamp, 15 trigger lost, 14 over range, 13 1024 triggers, 12 n lost triggers
-							event->NLostCount(((data[w]>>12)&0x1) == 0x1);
-							event->KiloCount(((data[w]>>13)&0x1) == 0x1);
-							event->OverRange(((data[w]>>14)&0x1) == 0x1);
-							event->LostTrigger(((data[w]>>15)&0x1) == 0x1);
-							event->ExtendedTimestamp(data[w++]>>16);
-							break;
-						case 2: // [31:16] extended time stamp,  15 trigger lost, 14 over range, 13 1024 triggers, 12 n lost triggers, [9:0] fine time stamp
-							event->Cfd(data[w]&0x3ff);
-							event->NLostCount(((data[w]>>12)&0x1) == 0x1);
-							event->KiloCount(((data[w]>>13)&0x1) == 0x1);
-							event->OverRange(((data[w]>>14)&0x1) == 0x1);
-							event->LostTrigger(((data[w]>>15)&0x1) == 0x1);
-							event->ExtendedTimestamp(data[w++]>>16);
-							break;
-						case 4: // [31:16] lost trigger counter, [15:0] total trigger counter
-							//event->LostTriggerCount(data[w]&0xffff);
-							//event->TotalTriggerCount(data[w++]>>16);
-							break;
-						case 5: // [31:16] CFD sample after zero cross., [15:0] CFD sample before zero cross.
-							//event->CfdAfterZC(data[w]&0xffff);
-							//event->CfdBeforeZC(data[w++]>>16);
-							break;
-						case 7: // fixed value of 0x12345678
-							if(data[w++] != 0x12345678) {
-								std::cerr<<"Failed to get debug data word 0x12345678, got "<<std::hex<<std::setw(8)<<std::setfill('0')<<data[w]<<std::dec<<std::setfill(' ')<<std::endl;
-								break;
-							}
-							break;
-						default:
-							break;
-					}
-				}
-				if(debug > 6) {
-					std::cout<<w<<" - 0x"<<std::hex<<std::setw(8)<<std::setfill('0')<<data[w]<<std::dec<<std::setfill(' ')<<std::endl;
-				}
-				//if(w >= bankSize) {
-				//	std::cerr<<"4 - Missing words, got only "<<w-1<<" words for channel "<<channel<<" (bank size "<<bankSize<<")"<<std::endl;
-				//}
-				event->ShortGate(data[w]&0x7fff);
-				event->OverRange((data[w]>>15) & 0x1);
-				event->Charge(data[w++]>>16);
-				result.push_back(event);
-				if(debug > 5) {
-					event->Print();
-				}
-			} // while(w < bankSize)
+			size_t nofEvents = (numWords-2)/eventSize; // -2 = 2 header words for channel aggregate
+			w = ParseChannelAggregate(data, w, nofEvents, numSampleWords, channel, format, waveform, dualTrace, extras, extraFormat, sink, debug);
 		} // for(uint8_t channel = 0; channel < 16; channel += 2)
-	} // for(int board = 0; w < bankSize; ++board)
+		// skip anything left in this board aggregate
+		w = boardEnd;
+	} // for(int board = 0; w < nofWords; ++board)
 
+	return true;
+}
+
+// sink that creates a new CaenEvent for each hit
+class CaenEventListSink {
+public:
+	CaenEventListSink(std::vector<CaenEvent*>& events, int debug) : fEvents(events), fEvent(nullptr), fDebug(debug) {}
+
+	bool Traces(size_t nofSamples, bool dualTrace, CaenTraces& traces)
+	{
+		// the traces are only unpacked if they are used
+		fEvent = new CaenEvent;
+		traces.fWords = fEvent->ResizeSampleWords(nofSamples/2, dualTrace);
+		return true;
+	}
+
+	void Add(const CaenHit& hit)
+	{
+		if(fEvent == nullptr) {
+			fEvent = new CaenEvent;
+		}
+		fEvent->Read(hit);
+		if(fDebug > 5) {
+			fEvent->Print();
+		}
+		fEvents.push_back(fEvent);
+		fEvent = nullptr;
+	}
+
+private:
+	std::vector<CaenEvent*>& fEvents;
+	CaenEvent* fEvent;
+	int fDebug;
+};
+
+inline std::vector<CaenEvent*> ParseData(char* bank, int bankSize, int debug)
+{
+	if(debug > 4) {
+		std::cout<<"starting to read bank "<<static_cast<void*>(bank)<<" of size "<<bankSize<<std::endl;
+	}
+	std::vector<CaenEvent*> result;
+	CaenEventListSink sink(result, debug);
+	ParseData(reinterpret_cast<const uint32_t*>(bank), bankSize, sink, debug);
 	return result;
 }
 #endif
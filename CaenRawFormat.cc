@@ -0,0 +1,57 @@
+#include "CaenRawFormat.hh"
+
+#include <chrono>
+#include <cstring>
+
+namespace {
+	// lookup tables for slice-by-8, table[0] is the classic byte-wise table
+	struct Crc32Tables {
+		uint32_t fTable[8][256];
+
+		Crc32Tables()
+		{
+			for(uint32_t i = 0; i < 256; ++i) {
+				uint32_t crc = i;
+				for(int bit = 0; bit < 8; ++bit) {
+					crc = (crc>>1) ^ (0xedb88320 & (0 - (crc & 1)));
+				}
+				fTable[0][i] = crc;
+			}
+			for(uint32_t i = 0; i < 256; ++i) {
+				for(int t = 1; t < 8; ++t) {
+					fTable[t][i] = (fTable[t-1][i]>>8) ^ fTable[0][fTable[t-1][i] & 0xff];
+				}
+			}
+		}
+	};
+
+	const Crc32Tables crcTables;
+}
+
+uint32_t Crc32(const char* data, size_t size, uint32_t crc)
+{
+	const uint32_t (&table)[8][256] = crcTables.fTable;
+	const unsigned char* byte = reinterpret_cast<const unsigned char*>(data);
+	crc = ~crc;
+	// eight bytes at a time (assumes little endian like the rest of the raw format)
+	while(size >= 8) {
+		uint32_t low;
+		uint32_t high;
+		std::memcpy(&low, byte, 4);
+		std::memcpy(&high, byte + 4, 4);
+		low ^= crc;
+		crc = table[7][low & 0xff] ^ table[6][(low>>8) & 0xff] ^ table[5][(low>>16) & 0xff] ^ table[4][low>>24] ^
+		      table[3][high & 0xff] ^ table[2][(high>>8) & 0xff] ^ table[1][(high>>16) & 0xff] ^ table[0][high>>24];
+		byte += 8;
+		size -= 8;
+	}
+	while(size-- > 0) {
+		crc = (crc>>8) ^ table[0][(crc ^ *byte++) & 0xff];
+	}
+	return ~crc;
+}
+
+uint64_t WallTime()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,76 @@
+#ifndef CAENRAWFORMAT_HH
+#define CAENRAWFORMAT_HH
+#include <cstdint>
+#include <cstddef>
+
+// Layout of the raw data files written by CaenRawWriter (all numbers little endian):
+//
+//   RawFileHeader
+//   RawBlockHeader (data)  + data of one readout of one board
+//   RawBlockHeader (data)  + ...
+//   RawBlockHeader (index) + uint64_t offset of the previous index block + RawIndexEntry for each data block since then
+//   ...
+//   RawBlockHeader (index) + ... (covering the data blocks after the last index block)
+//   RawFileTrailer
+//
+// The index blocks are chained from the trailer backwards, so a reader can find all data blocks without reading
+// them. If the file was not closed properly the trailer is missing, and the blocks can still be found by hopping from
+// block header to block header.
+// Files without the file header magic are from before this format and contain the readout data without any framing.
+
+const uint32_t kRawFileMagic    = 0x4e454143; // "CAEN"
+const uint32_t kRawBlockMagic   = 0x4b4c4243; // "CBLK"
+const uint32_t kRawTrailerMagic = 0x444e4543; // "CEND"
+const uint16_t kRawFormatVersion = 1;
+const uint64_t kRawNoIndex = UINT64_MAX;      // offset of the previous index block of the first index block
+
+enum ERawBlockType : uint16_t {
+	kRawData  = 0,
+	kRawIndex = 1
+};
+
+struct RawFileHeader {
+	uint32_t fMagic;
+	uint16_t fVersion;
+	uint16_t fHeaderSize;    // sizeof(RawFileHeader), allows adding fields without breaking older readers
+	uint32_t fNofBoards;
+	uint32_t fReserved;
+	uint64_t fStartTime;     // wall time when the file was opened, in ns since the epoch
+};
+
+struct RawBlockHeader {
+	uint32_t fMagic;
+	uint16_t fType;          // ERawBlockType
+	uint16_t fBoard;
+	uint32_t fSize;          // bytes following this header
+	uint32_t fChecksum;      // CRC-32 of the bytes following this header
+	uint64_t fSequence;      // readout number of this board
+	uint64_t fWallTime;      // time of the readout, in ns since the epoch
+};
+
+struct RawIndexEntry {
+	uint64_t fOffset;        // file position of the block header
+	uint64_t fWallTime;
+	uint64_t fSequence;
+	uint32_t fSize;          // bytes of data following the block header
+	uint16_t fBoard;
+	uint16_t fReserved;
+};
+
+struct RawFileTrailer {
+	uint32_t fMagic;
+	uint32_t fReserved;
+	uint64_t fLastIndex;     // file position of the last index block
+	uint64_t fNofBlocks;     // number of data blocks in the file
+};
+
+static_assert(sizeof(RawFileHeader) == 24, "unexpected padding in RawFileHeader");
+static_assert(sizeof(RawBlockHeader) == 32, "unexpected padding in RawBlockHeader");
+static_assert(sizeof(RawIndexEntry) == 32, "unexpected padding in RawIndexEntry");
+static_assert(sizeof(RawFileTrailer) == 24, "unexpected padding in RawFileTrailer");
+
+// CRC-32 (IEEE 802.3), crc is the checksum of the preceding data to allow calculating it piece by piece
+uint32_t Crc32(const char* data, size_t size, uint32_t crc = 0);
+
+uint64_t WallTime(); // current time in ns since the epoch
+#endif
@@ -0,0 +1,343 @@
+#include "CaenRawReader.hh"
+
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "TString.h"
+
+const uint32_t CaenRawReader::kLegacyChunkSize;
+const uint64_t CaenRawReader::kReadAhead;
+
+CaenRawReader::CaenRawReader(const std::string& filename, bool debug)
+	: fFilename(filename), fFile(-1), fFileSize(0), fLegacy(false), fIndexed(false), fNext(0), fDebug(debug),
+	  fMap(nullptr), fPageSize(sysconf(_SC_PAGESIZE)), fReleased(0), fReadAhead(0)
+{
+	fFile = open(fFilename.c_str(), O_RDONLY);
+	if(fFile < 0) {
+		throw std::runtime_error(Form("Failed to open raw data file \"%s\": %s", fFilename.c_str(), std::strerror(errno)));
+	}
+	struct stat status;
+	if(fstat(fFile, &status) != 0) {
+		throw std::runtime_error(Form("Failed to get size of raw data file \"%s\": %s", fFilename.c_str(), std::strerror(errno)));
+	}
+	fFileSize = status.st_size;
+	std::memset(&fHeader, 0, sizeof(fHeader));
+
+	if(!ReadHeader()) {
+		// file from before the framed format, split it into chunks so it doesn't have to be read at once
+		if(fDebug) std::cout<<"\""<<fFilename<<"\" has no raw data file header, reading it as unframed data"<<std::endl;
+		fLegacy = true;
+		RawIndexEntry entry;
+		std::memset(&entry, 0, sizeof(entry));
+		for(uint64_t offset = 0; offset < fFileSize; offset += kLegacyChunkSize) {
+			entry.fOffset = offset;
+			entry.fSize = std::min<uint64_t>(kLegacyChunkSize, fFileSize - offset);
+			fBlocks.push_back(entry);
+			++entry.fSequence;
+		}
+	} else if(!ReadIndex()) {
+		std::cerr<<"Failed to read the index of \""<<fFilename<<"\", the file probably wasn't closed properly. Scanning for blocks instead."<<std::endl;
+		ScanBlocks();
+	}
+
+	for(size_t i = 0; i < fBlocks.size(); ++i) {
+		if(fBlocks[i].fBoard >= fBoardBlocks.size()) {
+			fBoardBlocks.resize(fBlocks[i].fBoard + 1);
+		}
+		fBoardBlocks[fBlocks[i].fBoard].push_back(i);
+	}
+	if(fDebug) std::cout<<"found "<<fBlocks.size()<<" blocks from "<<fBoardBlocks.size()<<" boards in \""<<fFilename<<"\""<<std::endl;
+}
+
+CaenRawReader::~CaenRawReader()
+{
+	if(fMap != nullptr) {
+		munmap(fMap, fFileSize);
+	}
+	if(fFile >= 0) {
+		close(fFile);
+	}
+}
+
+const std::vector<size_t>& CaenRawReader::BoardBlocks(int board) const
+{
+	static const std::vector<size_t> empty;
+	if(board < 0 || static_cast<size_t>(board) >= fBoardBlocks.size()) {
+		return empty;
+	}
+	return fBoardBlocks[board];
+}
+
+size_t CaenRawReader::FindTime(int board, uint64_t wallTime) const
+{
+	// the blocks of one board are read by one thread, so their wall times are in order
+	const std::vector<size_t>& blocks = BoardBlocks(board);
+	auto it = std::lower_bound(blocks.begin(), blocks.end(), wallTime, [this](size_t i, uint64_t time) { return fBlocks[i].fWallTime < time; });
+	if(it == blocks.end()) {
+		return fBlocks.size();
+	}
+	return *it;
+}
+
+size_t CaenRawReader::FindTime(uint64_t wallTime) const
+{
+	// blocks of different boards are interleaved in the order they were processed, which isn't strictly by wall time
+	size_t result = fBlocks.size();
+	for(size_t board = 0; board < fBoardBlocks.size(); ++board) {
+		result = std::min(result, FindTime(board, wallTime));
+	}
+	return result;
+}
+
+bool CaenRawReader::ReadBlock(size_t i, RawBlock& block) const
+{
+	if(i >= fBlocks.size()) {
+		return false;
+	}
+	const RawIndexEntry& entry = fBlocks[i];
+	block.fBoard = entry.fBoard;
+	block.fSequence = entry.fSequence;
+	block.fWallTime = entry.fWallTime;
+	block.fData.resize(entry.fSize);
+	if(fLegacy) {
+		return ReadAt(entry.fOffset, block.fData.data(), entry.fSize);
+	}
+
+	RawBlockHeader header;
+	if(!ReadAt(entry.fOffset, &header, sizeof(header)) || !ReadAt(entry.fOffset + sizeof(header), block.fData.data(), entry.fSize)) {
+		std::cerr<<"Failed to read block "<<i<<" at "<<entry.fOffset<<" from \""<<fFilename<<"\""<<std::endl;
+		return false;
+	}
+	return CheckBlock(i, header, block.fData.data());
+}
+
+bool CaenRawReader::CheckBlock(size_t i, const RawBlockHeader& header, const char* data) const
+{
+	const RawIndexEntry& entry = fBlocks[i];
+	if(header.fMagic != kRawBlockMagic || header.fType != kRawData || header.fSize != entry.fSize || header.fBoard != entry.fBoard) {
+		std::cerr<<"Block "<<i<<" at "<<entry.fOffset<<" in \""<<fFilename<<"\" doesn't match the index"<<std::endl;
+		return false;
+	}
+	if(Crc32(data, entry.fSize) != header.fChecksum) {
+		std::cerr<<"Checksum error in block "<<i<<" (board "<<entry.fBoard<<", readout "<<entry.fSequence<<") of \""<<fFilename<<"\""<<std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool CaenRawReader::Next(RawBlock& block)
+{
+	// skip blocks that can't be read
+	while(fNext < fBlocks.size()) {
+		if(ReadBlock(fNext++, block)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool CaenRawReader::Map()
+{
+	if(fMap != nullptr) {
+		return true;
+	}
+	if(fFileSize == 0) {
+		return false;
+	}
+	void* map = mmap(nullptr, fFileSize, PROT_READ, MAP_SHARED, fFile, 0);
+	if(map == MAP_FAILED) {
+		if(fDebug) std::cout<<"Failed to map \""<<fFilename<<"\": "<<std::strerror(errno)<<std::endl;
+		return false;
+	}
+	fMap = static_cast<char*>(map);
+	madvise(fMap, fFileSize, MADV_SEQUENTIAL);
+	fReleased = 0;
+	fReadAhead = 0;
+	return true;
+}
+
+bool CaenRawReader::ViewBlock(size_t i, RawBlockView& view, RawBlock& buffer) const
+{
+	if(i >= fBlocks.size()) {
+		return false;
+	}
+	const RawIndexEntry& entry = fBlocks[i];
+	view.fBoard = entry.fBoard;
+	view.fSequence = entry.fSequence;
+	view.fWallTime = entry.fWallTime;
+	view.fSize = entry.fSize;
+	if(fMap == nullptr) {
+		if(!ReadBlock(i, buffer)) {
+			return false;
+		}
+		view.fData = buffer.fData.data();
+		return true;
+	}
+	if(fLegacy) {
+		view.fData = fMap + entry.fOffset;
+		return true;
+	}
+	// the index could be corrupted, don't trust it to stay within the file
+	if(entry.fOffset + sizeof(RawBlockHeader) + entry.fSize > fFileSize) {
+		std::cerr<<"Block "<<i<<" at "<<entry.fOffset<<" extends beyond the end of \""<<fFilename<<"\""<<std::endl;
+		return false;
+	}
+	RawBlockHeader header;
+	std::memcpy(&header, fMap + entry.fOffset, sizeof(header));
+	view.fData = fMap + entry.fOffset + sizeof(header);
+	return CheckBlock(i, header, view.fData);
+}
+
+bool CaenRawReader::Next(RawBlockView& view, RawBlock& buffer)
+{
+	while(fNext < fBlocks.size()) {
+		if(fMap != nullptr) {
+			Advise(fBlocks[fNext].fOffset);
+		}
+		if(ViewBlock(fNext++, view, buffer)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void CaenRawReader::Release(size_t first, size_t last) const
+{
+	if(fMap == nullptr || first >= last || last > fBlocks.size()) {
+		return;
+	}
+	// only pages that are completely inside these blocks, the others might still be used for the neighbouring blocks
+	uint64_t begin = (fBlocks[first].fOffset + fPageSize - 1) & ~(fPageSize - 1);
+	const RawIndexEntry& entry = fBlocks[last - 1];
+	uint64_t end = (entry.fOffset + (fLegacy ? 0 : sizeof(RawBlockHeader)) + entry.fSize) & ~(fPageSize - 1);
+	if(end > begin) {
+		madvise(fMap + begin, end - begin, MADV_DONTNEED);
+	}
+}
+
+void CaenRawReader::Advise(uint64_t offset)
+{
+	// drop the pages of the blocks before this one
+	uint64_t release = offset & ~(fPageSize - 1);
+	if(release > fReleased) {
+		madvise(fMap + fReleased, release - fReleased, MADV_DONTNEED);
+		fReleased = release;
+	}
+	// and make sure the next kReadAhead bytes are on their way, requesting them in steps of half of that
+	if(offset + kReadAhead/2 > fReadAhead && fReadAhead < fFileSize) {
+		uint64_t begin = std::max(fReadAhead, release);
+		uint64_t end = std::min((offset + kReadAhead + fPageSize - 1) & ~(fPageSize - 1), fFileSize);
+		if(end > begin) {
+			madvise(fMap + begin, end - begin, MADV_WILLNEED);
+		}
+		fReadAhead = end;
+	}
+}
+
+bool CaenRawReader::ReadHeader()
+{
+	if(fFileSize < sizeof(RawFileHeader)) {
+		return false;
+	}
+	if(!ReadAt(0, &fHeader, sizeof(fHeader)) || fHeader.fMagic != kRawFileMagic) {
+		return false;
+	}
+	if(fHeader.fVersion > kRawFormatVersion) {
+		throw std::runtime_error(Form("Raw data file \"%s\" has version %d, but only versions up to %d are supported", fFilename.c_str(), fHeader.fVersion, kRawFormatVersion));
+	}
+	return true;
+}
+
+bool CaenRawReader::ReadIndex()
+{
+	// follow the chain of index blocks from the trailer backwards
+	RawFileTrailer trailer;
+	if(fFileSize < fHeader.fHeaderSize + sizeof(trailer) || !ReadAt(fFileSize - sizeof(trailer), &trailer, sizeof(trailer)) || trailer.fMagic != kRawTrailerMagic) {
+		return false;
+	}
+	std::vector<std::vector<RawIndexEntry> > indexBlocks;
+	uint64_t offset = trailer.fLastIndex;
+	std::vector<char> data;
+	while(offset != kRawNoIndex) {
+		RawBlockHeader header;
+		if(offset + sizeof(header) > fFileSize || !ReadAt(offset, &header, sizeof(header))) {
+			return false;
+		}
+		if(header.fMagic != kRawBlockMagic || header.fType != kRawIndex || header.fSize < sizeof(uint64_t) || (header.fSize - sizeof(uint64_t))%sizeof(RawIndexEntry) != 0) {
+			return false;
+		}
+		data.resize(header.fSize);
+		if(!ReadAt(offset + sizeof(header), data.data(), header.fSize) || Crc32(data.data(), header.fSize) != header.fChecksum) {
+			return false;
+		}
+		uint64_t previous;
+		std::memcpy(&previous, data.data(), sizeof(previous));
+		// index blocks always point backwards, anything else would send us into a loop
+		if(previous != kRawNoIndex && previous >= offset) {
+			return false;
+		}
+		indexBlocks.emplace_back((header.fSize - sizeof(uint64_t))/sizeof(RawIndexEntry));
+		std::memcpy(indexBlocks.back().data(), data.data() + sizeof(uint64_t), header.fSize - sizeof(uint64_t));
+		offset = previous;
+	}
+	for(auto it = indexBlocks.rbegin(); it != indexBlocks.rend(); ++it) {
+		fBlocks.insert(fBlocks.end(), it->begin(), it->end());
+	}
+	if(fBlocks.size() != trailer.fNofBlocks) {
+		std::cerr<<"Index of \""<<fFilename<<"\" has "<<fBlocks.size()<<" blocks, but the trailer says there should be "<<trailer.fNofBlocks<<std::endl;
+		fBlocks.clear();
+		return false;
+	}
+	fIndexed = true;
+	return true;
+}
+
+void CaenRawReader::ScanBlocks()
+{
+	// hop from block header to block header until the end of the file or a block that's incomplete
+	uint64_t offset = fHeader.fHeaderSize;
+	RawBlockHeader header;
+	while(offset + sizeof(header) <= fFileSize && ReadAt(offset, &header, sizeof(header)) && header.fMagic == kRawBlockMagic) {
+		if(offset + sizeof(header) + header.fSize > fFileSize) {
+			std::cerr<<"Last block of \""<<fFilename<<"\" is incomplete, "<<header.fSize<<" bytes expected, but only "<<fFileSize - offset - sizeof(header)<<" bytes left"<<std::endl;
+			break;
+		}
+		if(header.fType == kRawData) {
+			RawIndexEntry entry;
+			entry.fOffset = offset;
+			entry.fWallTime = header.fWallTime;
+			entry.fSequence = header.fSequence;
+			entry.fSize = header.fSize;
+			entry.fBoard = header.fBoard;
+			entry.fReserved = 0;
+			fBlocks.push_back(entry);
+		}
+		offset += sizeof(header) + header.fSize;
+	}
+}
+
+bool CaenRawReader::ReadAt(uint64_t offset, void* data, size_t size) const
+{
+	char* buffer = static_cast<char*>(data);
+	while(size > 0) {
+		ssize_t result = pread(fFile, buffer, size, static_cast<off_t>(offset));
+		if(result < 0 && errno == EINTR) {
+			continue;
+		}
+		if(result <= 0) {
+			return false;
+		}
+		buffer += result;
+		offset += result;
+		size -= result;
+	}
+	return true;
+}
@@ -0,0 +1,95 @@
+#ifndef CAENRAWREADER_HH
+#define CAENRAWREADER_HH
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "CaenRawFormat.hh"
+
+// one readout block of one board
+struct RawBlock {
+	int      fBoard;
+	uint64_t fSequence;
+	uint64_t fWallTime;
+	std::vector<char> fData;
+};
+
+// one readout block of one board, pointing into the mapped file or a RawBlock holding the data
+struct RawBlockView {
+	int         fBoard;
+	uint64_t    fSequence;
+	uint64_t    fWallTime;
+	const char* fData;
+	size_t      fSize;
+};
+
+// Reads raw data files written by CaenRawWriter.
+// The list of data blocks is taken from the index blocks, or, if the file wasn't closed properly, by hopping from block
+// header to block header. Older files without framing are returned as consecutive chunks of kLegacyChunkSize bytes
+// (of board 0), which split board aggregates anywhere, so they need to be decoded with a CaenStreamParser.
+// ReadBlock only uses pread, so several threads can read different blocks from the same reader.
+// After Map the blocks can also be accessed in place with ViewBlock (also thread-safe) or Next(view, buffer), which
+// reads the file sequentially: it asks the kernel to read ahead of the current block and drops the pages of the blocks
+// before it, so the resident memory stays the same no matter how large the file is.
+class CaenRawReader {
+public:
+	static const uint32_t kLegacyChunkSize = 16*1024*1024;
+	static const uint64_t kReadAhead = 64*1024*1024; // bytes read ahead of the current block when mapped
+
+	explicit CaenRawReader(const std::string& filename, bool debug = false);
+	~CaenRawReader();
+
+	bool IsLegacy() const { return fLegacy; }
+	bool IsIndexed() const { return fIndexed; } // false if the blocks had to be found by scanning the file
+	const RawFileHeader& Header() const { return fHeader; }
+	uint64_t FileSize() const { return fFileSize; }
+
+	// all data blocks in the order they were written
+	size_t NofBlocks() const { return fBlocks.size(); }
+	const RawIndexEntry& Block(size_t i) const { return fBlocks[i]; }
+	const std::vector<size_t>& BoardBlocks(int board) const; // indices of all blocks of this board
+	size_t FindTime(uint64_t wallTime) const;                // first block of any board at or after wallTime
+	size_t FindTime(int board, uint64_t wallTime) const;     // first block of this board at or after wallTime
+
+	// returns false if the block can't be read or the checksum is wrong
+	bool ReadBlock(size_t i, RawBlock& block) const;
+	// reads the block at the current position and advances it, returns false at the end of the file
+	bool Next(RawBlock& block);
+	void Seek(size_t i) { fNext = i; fReleased = 0; fReadAhead = 0; }
+
+	// maps the file into memory, returns false if that's not possible
+	bool Map();
+	bool IsMapped() const { return fMap != nullptr; }
+	// view of block i, the data is only read into buffer if the file isn't mapped
+	bool ViewBlock(size_t i, RawBlockView& view, RawBlock& buffer) const;
+	// view of the block at the current position, only valid until the next call
+	bool Next(RawBlockView& view, RawBlock& buffer);
+	// drops the pages of blocks first to last-1 from memory, for threads working on separate ranges of blocks
+	void Release(size_t first, size_t last) const;
+	size_t Tell() const { return fNext; }
+
+private:
+	bool ReadHeader();
+	bool ReadIndex();
+	void ScanBlocks();
+	bool ReadAt(uint64_t offset, void* data, size_t size) const;
+	bool CheckBlock(size_t i, const RawBlockHeader& header, const char* data) const;
+	void Advise(uint64_t offset);
+
+	std::string fFilename;
+	int fFile;
+	uint64_t fFileSize;
+	bool fLegacy;
+	bool fIndexed;
+	RawFileHeader fHeader;
+	std::vector<RawIndexEntry> fBlocks;
+	std::vector<std::vector<size_t> > fBoardBlocks;
+	size_t fNext;
+	bool fDebug;
+
+	char* fMap;
+	uint64_t fPageSize;
+	uint64_t fReleased;  // pages before this are dropped
+	uint64_t fReadAhead; // pages up to this were requested
+};
+#endif
@@ -0,0 +1,341 @@
+#include "CaenRawWriter.hh"
+
+#include <iostream>
+#include <stdexcept>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef USE_IO_URING
+#include <liburing.h>
+#endif
+
+#include "TString.h"
+
+// O_DIRECT needs page aligned buffers, sizes, and file positions
+static const size_t kDirectAlignment = 4096;
+
+CaenRawWriter::CaenRawWriter(const std::string& filename, const CaenSettings& settings)
+	: fFilename(filename), fFile(-1), fDirectIO(settings.RawDirectIO()), fCurrent(nullptr), fOffset(0), fLastIndex(kRawNoIndex), fNofBlocks(0), fIndexInterval(settings.RawIndexInterval()), fWriting(true), fBytesWritten(0), fWriteNanoseconds(0), fOpened(std::chrono::steady_clock::now()), fStalls(0), fError(0)
+{
+	// buffer size needs to be a multiple of the page size for O_DIRECT
+	fBufferSize = (static_cast<size_t>(settings.RawBufferSize()*1024*1024) + kDirectAlignment - 1) & ~(kDirectAlignment - 1);
+
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+	if(fDirectIO) {
+		flags |= O_DIRECT;
+	}
+	fFile = open(fFilename.c_str(), flags, 0644);
+	if(fFile < 0 && fDirectIO) {
+		// not all file systems support O_DIRECT, so try again without it
+		std::cerr<<"Failed to open \""<<fFilename<<"\" with O_DIRECT ("<<std::strerror(errno)<<"), using buffered writes"<<std::endl;
+		fDirectIO = false;
+		fFile = open(fFilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if(fFile < 0) {
+		throw std::runtime_error(Form("Failed to open raw data file \"%s\": %s", fFilename.c_str(), std::strerror(errno)));
+	}
+
+	if(settings.RawPreallocate() > 0) {
+		// keep the file size at zero, we only want the blocks to be reserved
+		if(fallocate(fFile, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(settings.RawPreallocate()*1024*1024)) != 0) {
+			std::cerr<<"Failed to preallocate "<<settings.RawPreallocate()<<" MB for \""<<fFilename<<"\": "<<std::strerror(errno)<<std::endl;
+		}
+	}
+
+	fBuffers.resize(settings.RawBuffers());
+	for(auto& buffer : fBuffers) {
+		void* data = nullptr;
+		if(posix_memalign(&data, kDirectAlignment, fBufferSize) != 0) {
+			throw std::runtime_error(Form("Failed to allocate %lu bytes for raw data staging buffer", fBufferSize));
+		}
+		buffer.fData = static_cast<char*>(data);
+		buffer.fSize = 0;
+		buffer.fOffset = 0;
+		fFree.push_back(&buffer);
+	}
+	fCurrent = fFree.front();
+	fFree.pop_front();
+
+	fThread = std::thread(&CaenRawWriter::WriteBuffers, this);
+
+	RawFileHeader header;
+	header.fMagic = kRawFileMagic;
+	header.fVersion = kRawFormatVersion;
+	header.fHeaderSize = sizeof(RawFileHeader);
+	header.fNofBoards = settings.NumberOfBoards();
+	header.fReserved = 0;
+	header.fStartTime = WallTime();
+	Write(reinterpret_cast<const char*>(&header), sizeof(header));
+	fIndex.reserve(fIndexInterval);
+}
+
+CaenRawWriter::~CaenRawWriter()
+{
+	Close();
+	for(auto& buffer : fBuffers) {
+		free(buffer.fData);
+	}
+}
+
+void CaenRawWriter::Write(const char* data, size_t size)
+{
+	// this is called from the readout loop, so a failed write only drops the data, the loop checks Error() and stops
+	if(fError != 0) {
+		return;
+	}
+	// copy the data into the staging buffers, handing them on as they fill up
+	while(size > 0) {
+		size_t bytes = std::min(size, fBufferSize - fCurrent->fSize);
+		std::memcpy(fCurrent->fData + fCurrent->fSize, data, bytes);
+		fCurrent->fSize += bytes;
+		data += bytes;
+		size -= bytes;
+		if(fCurrent->fSize == fBufferSize) {
+			Submit();
+		}
+	}
+}
+
+void CaenRawWriter::WriteBlock(int board, uint64_t sequence, uint64_t wallTime, const char* data, uint32_t size)
+{
+	RawIndexEntry entry;
+	entry.fOffset = Position();
+	entry.fWallTime = wallTime;
+	entry.fSequence = sequence;
+	entry.fSize = size;
+	entry.fBoard = board;
+	entry.fReserved = 0;
+	fIndex.push_back(entry);
+	++fNofBlocks;
+
+	RawBlockHeader header;
+	header.fMagic = kRawBlockMagic;
+	header.fType = kRawData;
+	header.fBoard = board;
+	header.fSize = size;
+	header.fChecksum = Crc32(data, size);
+	header.fSequence = sequence;
+	header.fWallTime = wallTime;
+	Write(reinterpret_cast<const char*>(&header), sizeof(header));
+	Write(data, size);
+
+	if(fIndex.size() >= fIndexInterval) {
+		WriteIndex();
+	}
+}
+
+void CaenRawWriter::WriteIndex()
+{
+	// index block: offset of the previous index block followed by the entries
+	uint64_t offset = Position();
+	uint32_t size = sizeof(fLastIndex) + fIndex.size()*sizeof(RawIndexEntry);
+	const char* entries = reinterpret_cast<const char*>(fIndex.data());
+
+	RawBlockHeader header;
+	header.fMagic = kRawBlockMagic;
+	header.fType = kRawIndex;
+	header.fBoard = 0;
+	header.fSize = size;
+	header.fChecksum = Crc32(entries, fIndex.size()*sizeof(RawIndexEntry), Crc32(reinterpret_cast<const char*>(&fLastIndex), sizeof(fLastIndex)));
+	header.fSequence = 0;
+	header.fWallTime = WallTime();
+	Write(reinterpret_cast<const char*>(&header), sizeof(header));
+	Write(reinterpret_cast<const char*>(&fLastIndex), sizeof(fLastIndex));
+	Write(entries, fIndex.size()*sizeof(RawIndexEntry));
+
+	fLastIndex = offset;
+	fIndex.clear();
+}
+
+void CaenRawWriter::Submit()
+{
+	std::unique_lock<std::mutex> lock(fMutex);
+	fCurrent->fOffset = fOffset;
+	fOffset += fCurrent->fSize;
+	fFull.push_back(fCurrent);
+	fFullCondition.notify_one();
+	if(fFree.empty()) {
+		++fStalls;
+		fFreeCondition.wait(lock, [this]() { return !fFree.empty(); });
+	}
+	fCurrent = fFree.front();
+	fFree.pop_front();
+}
+
+void CaenRawWriter::Close()
+{
+	if(fFile < 0) {
+		return;
+	}
+	if(fError == 0) {
+		// always write at least one index block, so readers don't have to handle a trailer without index
+		if(!fIndex.empty() || fLastIndex == kRawNoIndex) {
+			WriteIndex();
+		}
+		RawFileTrailer trailer;
+		trailer.fMagic = kRawTrailerMagic;
+		trailer.fReserved = 0;
+		trailer.fLastIndex = fLastIndex;
+		trailer.fNofBlocks = fNofBlocks;
+		Write(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(fMutex);
+		fWriting = false;
+	}
+	fFullCondition.notify_one();
+	fThread.join();
+
+	// the last buffer isn't full, so it can't be written with O_DIRECT
+	if(fCurrent->fSize > 0) {
+		if(fDirectIO) {
+			fcntl(fFile, F_SETFL, fcntl(fFile, F_GETFL) & ~O_DIRECT);
+		}
+		fCurrent->fOffset = fOffset;
+		fOffset += fCurrent->fSize;
+		WriteBuffer(fCurrent);
+		fCurrent->fSize = 0;
+	}
+	// remove whatever was preallocated but not used
+	if(ftruncate(fFile, static_cast<off_t>(fOffset)) != 0) {
+		std::cerr<<"Failed to truncate \""<<fFilename<<"\" to "<<fOffset<<" bytes: "<<std::strerror(errno)<<std::endl;
+	}
+	close(fFile);
+	fFile = -1;
+	if(fError != 0) {
+		std::cerr<<"Failed to write to raw data file \""<<fFilename<<"\": "<<std::strerror(fError)<<std::endl;
+	}
+}
+
+double CaenRawWriter::Rate() const
+{
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - fOpened).count();
+	if(seconds <= 0.) {
+		return 0.;
+	}
+	return fBytesWritten/1024./1024./seconds;
+}
+
+double CaenRawWriter::WriteRate() const
+{
+	if(fWriteNanoseconds == 0) {
+		return 0.;
+	}
+	return fBytesWritten/1024./1024./(fWriteNanoseconds/1e9);
+}
+
+size_t CaenRawWriter::QueueDepth()
+{
+	std::lock_guard<std::mutex> lock(fMutex);
+	return fFull.size();
+}
+
+void CaenRawWriter::WriteBuffer(StagingBuffer* buffer, size_t written)
+{
+	auto start = std::chrono::steady_clock::now();
+	size_t alreadyWritten = written;
+	while(written < buffer->fSize) {
+		// with O_DIRECT every write has to start on an aligned position, so after a short write the bytes since the last
+		// aligned position are written again (the buffer and its file position are aligned)
+		size_t begin = fDirectIO ? (written & ~(kDirectAlignment - 1)) : written;
+		ssize_t result = pwrite(fFile, buffer->fData + begin, buffer->fSize - begin, static_cast<off_t>(buffer->fOffset + begin));
+		if(result < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			fError = errno;
+			break;
+		}
+		written = std::max(written, begin + result);
+	}
+	fBytesWritten += written - alreadyWritten;
+	fWriteNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+void CaenRawWriter::WriteBuffers()
+{
+#ifdef USE_IO_URING
+	if(WriteBuffersIoUring()) {
+		return;
+	}
+#endif
+	std::unique_lock<std::mutex> lock(fMutex);
+	while(true) {
+		fFullCondition.wait(lock, [this]() { return !fFull.empty() || !fWriting; });
+		if(fFull.empty()) {
+			break;
+		}
+		StagingBuffer* buffer = fFull.front();
+		fFull.pop_front();
+		lock.unlock();
+		WriteBuffer(buffer);
+		buffer->fSize = 0;
+		lock.lock();
+		fFree.push_back(buffer);
+		fFreeCondition.notify_one();
+	}
+}
+
+#ifdef USE_IO_URING
+bool CaenRawWriter::WriteBuffersIoUring()
+{
+	// all full buffers are submitted at once, so the kernel can keep several writes in flight
+	// returns false if io_uring isn't available, in which case the buffers are written with pwrite
+	struct io_uring ring;
+	if(io_uring_queue_init(fBuffers.size(), &ring, 0) < 0) {
+		return false;
+	}
+	size_t inFlight = 0;
+	std::unique_lock<std::mutex> lock(fMutex);
+	while(true) {
+		if(inFlight == 0) {
+			fFullCondition.wait(lock, [this]() { return !fFull.empty() || !fWriting; });
+			if(fFull.empty()) {
+				break;
+			}
+		}
+		while(!fFull.empty()) {
+			StagingBuffer* buffer = fFull.front();
+			fFull.pop_front();
+			struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+			io_uring_prep_write(sqe, fFile, buffer->fData, buffer->fSize, buffer->fOffset);
+			io_uring_sqe_set_data(sqe, buffer);
+			++inFlight;
+		}
+		lock.unlock();
+		auto start = std::chrono::steady_clock::now();
+		io_uring_submit(&ring);
+		struct io_uring_cqe* cqe;
+		if(io_uring_wait_cqe(&ring, &cqe) == 0) {
+			fWriteNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+			StagingBuffer* buffer = static_cast<StagingBuffer*>(io_uring_cqe_get_data(cqe));
+			if(cqe->res < 0) {
+				fError = -cqe->res;
+			} else {
+				fBytesWritten += cqe->res;
+				if(static_cast<size_t>(cqe->res) < buffer->fSize) {
+					// short write, write the rest synchronously (WriteBuffer keeps the writes aligned for O_DIRECT)
+					WriteBuffer(buffer, cqe->res);
+				}
+			}
+			io_uring_cqe_seen(&ring, cqe);
+			--inFlight;
+			buffer->fSize = 0;
+			lock.lock();
+			fFree.push_back(buffer);
+			fFreeCondition.notify_one();
+		} else {
+			lock.lock();
+		}
+	}
+	io_uring_queue_exit(&ring);
+	return true;
+}
+#endif
@@ -0,0 +1,84 @@
+#ifndef CAENRAWWRITER_HH
+#define CAENRAWWRITER_HH
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "CaenSettings.hh"
+#include "CaenRawFormat.hh"
+
+// Writes the raw readout data to file from a background thread.
+// Each readout is framed by a block header, and an index of the blocks is written every RawIndexInterval blocks and
+// when the file is closed (see CaenRawFormat.hh for the layout).
+// The data is copied into large, page aligned staging buffers, full buffers are written by the background thread (with
+// pwrite, or io_uring if compiled with USE_IO_URING) while the next buffer is being filled. The file can be
+// preallocated, and written with O_DIRECT to bypass the page cache. If all staging buffers are waiting to be written,
+// Write waits for the background thread. Once a background write has failed all further data is dropped, callers check
+// Error() and stop the run.
+class CaenRawWriter {
+public:
+	CaenRawWriter(const std::string& filename, const CaenSettings& settings);
+	~CaenRawWriter();
+
+	void WriteBlock(int board, uint64_t sequence, uint64_t wallTime, const char* data, uint32_t size);
+	void Close(); // writes the remaining data, the index, and closes the file, called by the destructor if necessary
+
+	bool IsOpen() const { return fFile >= 0; }
+	int Error() const { return fError; } // errno of a failed background write, 0 if all writes succeeded so far
+	uint64_t BytesWritten() const { return fBytesWritten; }
+	double Rate() const;        // MB written per second since the file was opened
+	double WriteRate() const;   // MB written per second spent in the background writes
+	size_t QueueDepth();        // number of staging buffers waiting to be written
+	uint64_t Stalls() const { return fStalls; } // how often Write had to wait for the background thread
+
+private:
+	struct StagingBuffer {
+		char*    fData;
+		size_t   fSize;   // bytes used
+		uint64_t fOffset; // position in the file
+	};
+
+	void Write(const char* data, size_t size);
+	void WriteIndex();
+	uint64_t Position() const { return fOffset + fCurrent->fSize; } // file position of the next byte written
+	void Submit();         // hands the current buffer to the background thread
+	void WriteBuffers();   // background thread
+#ifdef USE_IO_URING
+	bool WriteBuffersIoUring();
+#endif
+	void WriteBuffer(StagingBuffer* buffer, size_t written = 0); // written = bytes of the buffer already written
+
+	std::string fFilename;
+	int fFile;
+	bool fDirectIO;
+	size_t fBufferSize;
+	std::vector<StagingBuffer> fBuffers;
+	StagingBuffer* fCurrent;
+	std::deque<StagingBuffer*> fFree;
+	std::deque<StagingBuffer*> fFull;
+	uint64_t fOffset;      // file position of the next buffer
+
+	std::vector<RawIndexEntry> fIndex; // data blocks since the last index block
+	uint64_t fLastIndex;   // file position of the last index block
+	uint64_t fNofBlocks;
+	size_t fIndexInterval;
+
+	std::thread fThread;
+	std::mutex fMutex;
+	std::condition_variable fFreeCondition;
+	std::condition_variable fFullCondition;
+	bool fWriting;
+
+	std::atomic<uint64_t> fBytesWritten;
+	std::atomic<uint64_t> fWriteNanoseconds; // time spent in the background writes
+	std::chrono::steady_clock::time_point fOpened;
+	uint64_t fStalls;
+	std::atomic<int> fError; // errno of a failed write from the background thread
+};
+#endif
@@ -3,17 +3,19 @@
 #include <string>
 #include <thread>
 #include <chrono>
-#include <fstream>
 
 #include <curses.h>
 #include <signal.h>
 
 #include "TFile.h"
 #include "TTree.h"
+#include "TROOT.h"
 
 #include "CommandLineInterface.hh"
 #include "CaenSettings.hh"
 #include "CaenDigitizer.hh"
+#include "CaenRawWriter.hh"
+#include "CaenHitWriter.hh"
 
 bool controlC = false;
 int  nRows, nCols;
@@ -66,6 +68,8 @@ static void CatchSignals()
 int main(int argc, char** argv) {
    std::atexit(AtExitHandler);
    CatchSignals();
+	// the tree is filled from a separate thread
+	ROOT::EnableThreadSafety();
 
 	CommandLineInterface interface;
 	std::string settingsFilename;
@@ -74,6 +78,8 @@ int main(int argc, char** argv) {
 	interface.Add("-o", "output file (required, together with -r this is just the base name)", &outputFilename);
 	std::string dataOutputFilename;
 	interface.Add("-df", "data output file (optional, writes out the binary data)", &dataOutputFilename);
+	std::string hitOutputFilename;
+	interface.Add("-hf", "hit output file (optional, writes the sorted hits without ROOT, convert it with ConvertHits)", &hitOutputFilename);
 	uint64_t numberOfTriggers = 0;
 	interface.Add("-n", "number of triggers to record (either this, -r, or -t required)", &numberOfTriggers);
 	uint32_t secondsToRun = 0;
@@ -91,8 +97,8 @@ int main(int argc, char** argv) {
 		std::cerr<<"You need to provide a settings file (-s flag)"<<std::endl;
 		return 1;
 	}
-	if(outputFilename.empty() && dataOutputFilename.empty()) {
-		std::cerr<<"Warning, neither root output file (-o flag), nor data output file (-df flag) provided."<<std::endl;
+	if(outputFilename.empty() && dataOutputFilename.empty() && hitOutputFilename.empty()) {
+		std::cerr<<"Warning, neither root output file (-o flag), nor data output file (-df flag), nor hit output file (-hf flag) provided."<<std::endl;
 		char c = '\0';
 		do {
 			std::cout<<"Do you want to proceed without writing any output file? [y/n]"<<std::endl;
@@ -140,16 +146,20 @@ int main(int argc, char** argv) {
 	int ch = 0; //character read from input
 
 	if(runNumber == 0) {
-		std::ofstream dataFile;
-		if(!dataOutputFilename.empty()) {
-			dataFile.open(dataOutputFilename, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
-		}
+		CaenRawWriter* dataFile = nullptr;
+		CaenHitWriter* hitFile = nullptr;
 		TFile* output = nullptr;
 		if(!outputFilename.empty()) {
 			output = new TFile(outputFilename.c_str(), "recreate");
 		}
 		try {
-			settings.RunLength(digitizer->Run(output, dataFile, numberOfTriggers, secondsToRun));
+			if(!dataOutputFilename.empty()) {
+				dataFile = new CaenRawWriter(dataOutputFilename, settings);
+			}
+			if(!hitOutputFilename.empty()) {
+				hitFile = new CaenHitWriter(hitOutputFilename, settings);
+			}
+			settings.RunLength(digitizer->Run(output, dataFile, hitFile, numberOfTriggers, secondsToRun));
 		} catch(const std::runtime_error& e) {
 			printw("%s\n", e.what());
 			return 1;
@@ -158,8 +168,13 @@ int main(int argc, char** argv) {
 			settings.Write();
 			output->Close();
 		}
-		if(dataFile.is_open()) {
-			dataFile.close();
+		if(dataFile != nullptr) {
+			dataFile->Close();
+			delete dataFile;
+		}
+		if(hitFile != nullptr) {
+			hitFile->Close();
+			delete hitFile;
 		}
 	} else {
 		printw("use 's' to start/stop a run, and 'q' to quit the program\n");
@@ -169,16 +184,21 @@ int main(int argc, char** argv) {
 					case 's':
 						{
 							printw("starting run %03d\n", runNumber);
-							std::ofstream dataFile;
-							if(!dataOutputFilename.empty()) {
-								dataFile.open(Form("%s_%03d.dat", dataOutputFilename.c_str(), runNumber), std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
-							}
+							CaenRawWriter* dataFile = nullptr;
+							CaenHitWriter* hitFile = nullptr;
 							TFile* output = nullptr;
 							if(!outputFilename.empty()) {
-								output = new TFile(Form("%s_%03d.root", outputFilename.c_str(), runNumber++), "recreate");
+								output = new TFile(Form("%s_%03d.root", outputFilename.c_str(), runNumber), "recreate");
 							}
 							try {
-								settings.RunLength(digitizer->Run(output, dataFile));
+								if(!dataOutputFilename.empty()) {
+									dataFile = new CaenRawWriter(Form("%s_%03d.dat", dataOutputFilename.c_str(), runNumber), settings);
+								}
+								if(!hitOutputFilename.empty()) {
+									hitFile = new CaenHitWriter(Form("%s_%03d.hits", hitOutputFilename.c_str(), runNumber), settings);
+								}
+								++runNumber;
+								settings.RunLength(digitizer->Run(output, dataFile, hitFile));
 							} catch(const std::runtime_error& e) {
 								std::cout<<e.what()<<std::endl;
 								return 1;
@@ -187,8 +207,13 @@ int main(int argc, char** argv) {
 								settings.Write();
 								output->Close();
 							}
-							if(dataFile.is_open()) {
-								dataFile.close();
+							if(dataFile != nullptr) {
+								dataFile->Close();
+								delete dataFile;
+							}
+							if(hitFile != nullptr) {
+								hitFile->Close();
+								delete hitFile;
 							}
 							break;
 						}
@@ -203,17 +228,21 @@ int main(int argc, char** argv) {
 	}
 #else
 	std::cout<<"Opening file"<<std::endl;
-	std::ofstream dataFile;
-	if(!dataOutputFilename.empty()) {
-		dataFile.open(dataOutputFilename, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
-	}
+	CaenRawWriter* dataFile = nullptr;
+	CaenHitWriter* hitFile = nullptr;
    TFile* output = nullptr;
 	if(!outputFilename.empty()) {
 		output = new TFile(outputFilename.c_str(), "recreate");
 	}
 
    try {
-      settings.RunLength(digitizer->Run(output, dataFile, numberOfTriggers, secondsToRun));
+		if(!dataOutputFilename.empty()) {
+			dataFile = new CaenRawWriter(dataOutputFilename, settings);
+		}
+		if(!hitOutputFilename.empty()) {
+			hitFile = new CaenHitWriter(hitOutputFilename, settings);
+		}
+      settings.RunLength(digitizer->Run(output, dataFile, hitFile, numberOfTriggers, secondsToRun));
    } catch(const std::runtime_error& e) {
       std::cout<<e.what()<<std::endl;
       return 1;
@@ -222,10 +251,20 @@ int main(int argc, char** argv) {
 		settings.Write();
 		output->Close();
 	}
-	if(dataFile.is_open()) {
-		dataFile.close();
+	if(dataFile != nullptr) {
+		dataFile->Close();
+		delete dataFile;
+	}
+	if(hitFile != nullptr) {
+		hitFile->Close();
+		delete hitFile;
 	}
 #endif
 
+	// Run returns a negative run length if reading the boards or writing the output failed
+	if(settings.RunLength() < 0.) {
+		return 1;
+	}
+
 	return 0;
 }
@@ -33,7 +33,49 @@ CaenSettings::CaenSettings(const std::string& filename, bool debug)
 		printw("%d maximum channels is not possible!\n", fNumberOfChannels);
 		throw;
 	}
-	fBufferSize = settings->GetValue("BufferSize", 100000);
+	fBufferSize = settings->GetValue("BufferSize", 0);
+	fSortMargin = settings->GetValue("SortMargin", 1000.);
+	fMaxLatency = settings->GetValue("MaxLatency", 5.);
+	fWriterBatchSize = settings->GetValue("WriterBatchSize", 10000);
+	fWriterBatches = settings->GetValue("WriterBatches", 3);
+	if(fWriterBatchSize < 1 || fWriterBatches < 2) {
+		printw("%lu events per batch and %d batches for the writer is not possible, need at least one event and two batches!\n", fWriterBatchSize, fWriterBatches);
+		throw;
+	}
+	fTreeSaveInterval = settings->GetValue("TreeSaveInterval", 10.);
+	fFlatTree = settings->GetValue("FlatTree", true);
+	fFlatTreeWaveforms = settings->GetValue("FlatTreeWaveforms", true);
+	fRawBufferSize = settings->GetValue("RawBufferSize", 16.);
+	fRawBuffers = settings->GetValue("RawBuffers", 4);
+	fRawPreallocate = settings->GetValue("RawPreallocate", 0.);
+	fRawDirectIO = settings->GetValue("RawDirectIO", false);
+	if(fRawBufferSize <= 0. || fRawBuffers < 2) {
+		printw("%.1f MB per buffer and %d buffers for the raw data is not possible, need a positive size and at least two buffers!\n", fRawBufferSize, fRawBuffers);
+		throw;
+	}
+	fRawIndexInterval = settings->GetValue("RawIndexInterval", 1000);
+	if(fRawIndexInterval < 1) {
+		printw("%d blocks between raw data index blocks is not possible!\n", fRawIndexInterval);
+		throw;
+	}
+	fHitBlockSize = settings->GetValue("HitBlockSize", 16384);
+	fHitBuffers = settings->GetValue("HitBuffers", 4);
+	fHitWaveforms = settings->GetValue("HitWaveforms", true);
+	if(fHitBlockSize < 1 || fHitBuffers < 2) {
+		printw("%lu hits per block and %d blocks for the hit file is not possible, need at least one hit and two blocks!\n", fHitBlockSize, fHitBuffers);
+		throw;
+	}
+	fReadoutBuffers = settings->GetValue("ReadoutBuffers", 8);
+	if(fReadoutBuffers < 2) {
+		printw("%d readout buffers is not possible, need at least two!\n", fReadoutBuffers);
+		throw;
+	}
+	fDecodeThreads = settings->GetValue("DecodeThreads", 1);
+	if(fDecodeThreads < 0) {
+		printw("%d decode threads is not possible!\n", fDecodeThreads);
+		throw;
+	}
+	fNativeDecoder = settings->GetValue("NativeDecoder", false);
 
 	fLinkType.resize(fNumberOfBoards);
 	fVmeBaseAddress.resize(fNumberOfBoards);
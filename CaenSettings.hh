@@ -38,6 +38,24 @@ public:
 	CAEN_DGTZ_DPP_PSD_Params_t* ChannelParameter(int i) const { return fChannelParameter[i]; }
 
 	size_t BufferSize() const { return fBufferSize; }
+	double SortMargin() const { return fSortMargin; }
+	double MaxLatency() const { return fMaxLatency; }
+	size_t WriterBatchSize() const { return fWriterBatchSize; }
+	int WriterBatches() const { return fWriterBatches; }
+	double TreeSaveInterval() const { return fTreeSaveInterval; }
+	bool FlatTree() const { return fFlatTree; }
+	bool FlatTreeWaveforms() const { return fFlatTreeWaveforms; }
+	double RawBufferSize() const { return fRawBufferSize; }
+	int RawBuffers() const { return fRawBuffers; }
+	double RawPreallocate() const { return fRawPreallocate; }
+	bool RawDirectIO() const { return fRawDirectIO; }
+	int RawIndexInterval() const { return fRawIndexInterval; }
+	size_t HitBlockSize() const { return fHitBlockSize; }
+	int HitBuffers() const { return fHitBuffers; }
+	bool HitWaveforms() const { return fHitWaveforms; }
+	int ReadoutBuffers() const { return fReadoutBuffers; }
+	int DecodeThreads() const { return fDecodeThreads; }
+	bool NativeDecoder() const { return fNativeDecoder; }
 
 	double RunLength() const { return fRunLength; }
 	double Update() const { return fUpdate; }
@@ -63,11 +81,29 @@ private:
 	int fNumberOfChannels;
 	std::vector<CAEN_DGTZ_DPP_PSD_Params_t*> fChannelParameter;
 
-	size_t fBufferSize;
+	size_t fBufferSize;   // maximum number of events waiting to be sorted, 0 = no limit
+	double fSortMargin;   // in ns, events are written once all channels have seen hits at least this much later
+	double fMaxLatency;   // in s, channels without new hits for this long don't hold back the writing of events
+	size_t fWriterBatchSize; // number of events handed to the writer thread at once
+	int fWriterBatches;      // number of batches of events, 2 = double buffering, 3 = triple buffering, ...
+	double fTreeSaveInterval; // in s, time between auto-saves of the tree, 0 = only at the end
+	bool fFlatTree;          // write the tree with one branch per member (see CaenFlatTree) instead of one branch of CaenEvents (default)
+	bool fFlatTreeWaveforms; // write the traces to the flat tree
+	double fRawBufferSize;   // in MB, size of the staging buffers for the raw data file
+	int fRawBuffers;         // number of staging buffers for the raw data file
+	double fRawPreallocate;  // in MB, space reserved for the raw data file when it's opened
+	bool fRawDirectIO;       // write the raw data file with O_DIRECT
+	int fRawIndexInterval;   // number of data blocks between index blocks in the raw data file
+	size_t fHitBlockSize;    // number of hits per block of the hit file
+	int fHitBuffers;         // number of blocks of the hit file that can wait to be written
+	bool fHitWaveforms;      // write the traces to the hit file
+	int fReadoutBuffers; // number of readout buffers per board, shared between reader thread and decoding
+	int fDecodeThreads;  // 0 = decode in main thread, at most one per board without fNativeDecoder
+	bool fNativeDecoder; // decode the raw data with ParseData instead of the CAEN library
 
 	double fRunLength;
 	double fUpdate;
 
-	ClassDef(CaenSettings, 4);
+	ClassDef(CaenSettings, 14);
 };
 #endif
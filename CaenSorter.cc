@@ -0,0 +1,128 @@
+#include "CaenSorter.hh"
+
+#include <algorithm>
+#include <limits>
+
+CaenSorter::CaenSorter()
+	: fSize(0), fOutOfOrder(0), fReleased(false), fReleasedKey(0), fLate(0), fMaxLateness(0)
+{
+}
+
+CaenSorter::Run& CaenSorter::GetRun(int board, int channel, size_t& index)
+{
+	if(static_cast<size_t>(board) >= fRunIndex.size()) {
+		fRunIndex.resize(board + 1);
+	}
+	std::vector<size_t>& boardIndex = fRunIndex[board];
+	if(static_cast<size_t>(channel) >= boardIndex.size()) {
+		boardIndex.resize(channel + 1, 0);
+	}
+	if(boardIndex[channel] == 0) {
+		Run run;
+		run.fBoard = board;
+		run.fChannel = channel;
+		run.fHead = 0;
+		run.fNewestKey = 0;
+		run.fLastArrival = 0.;
+		fRuns.push_back(run);
+		boardIndex[channel] = fRuns.size();
+	}
+	index = boardIndex[channel] - 1;
+	return fRuns[index];
+}
+
+bool CaenSorter::Later(size_t a, size_t b) const
+{
+	const Run& runA = fRuns[a];
+	const Run& runB = fRuns[b];
+	if(runA.Front().fKey != runB.Front().fKey) {
+		return runA.Front().fKey > runB.Front().fKey;
+	}
+	if(runA.fBoard != runB.fBoard) {
+		return runA.fBoard > runB.fBoard;
+	}
+	return runA.fChannel > runB.fChannel;
+}
+
+void CaenSorter::Add(int board, CaenEvent* event, double now)
+{
+	Hit hit = { event->GetTimeKey(), event };
+	size_t index;
+	Run& run = GetRun(board, event->Channel(), index);
+	auto later = [this](size_t a, size_t b) { return Later(a, b); };
+	++fSize;
+
+	run.fNewestKey = std::max(run.fNewestKey, hit.fKey);
+	run.fLastArrival = now;
+	if(fReleased && hit.fKey < fReleasedKey) {
+		++fLate;
+		fMaxLateness = std::max(fMaxLateness, fReleasedKey - hit.fKey);
+	}
+
+	if(run.Empty()) {
+		run.fHits.push_back(hit);
+		fHeap.push_back(index);
+		std::push_heap(fHeap.begin(), fHeap.end(), later);
+		return;
+	}
+	if(hit.fKey >= run.fHits.back().fKey) {
+		// the usual case, hits of one channel are in order
+		run.fHits.push_back(hit);
+		return;
+	}
+	// out of order hit, insert it after all hits with the same or an earlier time
+	++fOutOfOrder;
+	auto it = std::upper_bound(run.fHits.begin() + run.fHead, run.fHits.end(), hit, [](const Hit& a, const Hit& b) { return a.fKey < b.fKey; });
+	bool newFront = (it == run.fHits.begin() + run.fHead);
+	run.fHits.insert(it, hit);
+	if(newFront) {
+		// the start of this run changed, so the heap needs to be rebuilt
+		std::make_heap(fHeap.begin(), fHeap.end(), later);
+	}
+}
+
+uint64_t CaenSorter::Watermark(double now, double maxLatency, uint64_t margin) const
+{
+	uint64_t watermark = std::numeric_limits<uint64_t>::max();
+	for(const auto& run : fRuns) {
+		if(now - run.fLastArrival > maxLatency) {
+			continue;
+		}
+		if(run.fNewestKey < margin) {
+			return 0;
+		}
+		watermark = std::min(watermark, run.fNewestKey - margin);
+	}
+	return watermark;
+}
+
+uint64_t CaenSorter::TopKey() const
+{
+	return fRuns[fHeap.front()].Front().fKey;
+}
+
+CaenEvent* CaenSorter::Pop()
+{
+	auto later = [this](size_t a, size_t b) { return Later(a, b); };
+	std::pop_heap(fHeap.begin(), fHeap.end(), later);
+	Run& run = fRuns[fHeap.back()];
+	CaenEvent* event = run.Front().fEvent;
+	fReleased = true;
+	fReleasedKey = std::max(fReleasedKey, run.Front().fKey);
+	--fSize;
+
+	++run.fHead;
+	if(run.Empty()) {
+		run.fHits.clear();
+		run.fHead = 0;
+		fHeap.pop_back();
+		return event;
+	}
+	// drop popped hits once they make up most of the run, keeping the capacity
+	if(run.fHead >= 1024 && 2*run.fHead >= run.fHits.size()) {
+		run.fHits.erase(run.fHits.begin(), run.fHits.begin() + run.fHead);
+		run.fHead = 0;
+	}
+	std::push_heap(fHeap.begin(), fHeap.end(), later);
+	return event;
+}
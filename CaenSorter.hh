@@ -0,0 +1,67 @@
+#ifndef CAENSORTER_HH
+#define CAENSORTER_HH
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "CaenEvent.hh"
+
+// Time sorter for events from several boards and channels.
+// Hits from one channel arrive (almost always) in time order, so each (board, channel) keeps its own sorted run,
+// and the runs are merged using a heap over the first hit of each run. The time is cached as an integer key (see
+// CaenEvent::GetTimeKey), hits with the same key are ordered by board, channel, and the order they were added in.
+//
+// Events can be released once they are older than the watermark, the newest time seen on all channels minus a
+// safety margin. Channels that haven't delivered anything within the maximum latency are ignored, so a quiet channel
+// can't hold back the others forever. Events that arrive after newer events have already been released are counted
+// as late.
+class CaenSorter {
+public:
+	CaenSorter();
+	~CaenSorter() {}
+
+	void Add(int board, CaenEvent* event, double now = 0.); // now = wall-clock time in seconds
+	CaenEvent* Pop();          // removes and returns the earliest event, must not be called if the sorter is empty
+	uint64_t TopKey() const;   // time key of the earliest event, must not be called if the sorter is empty
+
+	// time key up to which all events can be released (everything if no channel was active within maxLatency seconds)
+	uint64_t Watermark(double now, double maxLatency, uint64_t margin) const;
+	bool Ready(uint64_t watermark) const { return fSize > 0 && TopKey() <= watermark; }
+
+	bool Empty() const { return fSize == 0; }
+	size_t Size() const { return fSize; }
+	uint64_t OutOfOrder() const { return fOutOfOrder; } // hits that were older than the last hit of their channel
+	uint64_t Late() const { return fLate; }             // hits that were older than the last released hit
+	uint64_t MaxLateness() const { return fMaxLateness; } // in time key units
+
+private:
+	struct Hit {
+		uint64_t   fKey;
+		CaenEvent* fEvent;
+	};
+	struct Run {
+		int fBoard;
+		int fChannel;
+		std::vector<Hit> fHits; // hits before fHead have already been popped
+		size_t fHead;
+		uint64_t fNewestKey;    // newest time seen on this channel
+		double fLastArrival;    // wall-clock time the last hit was added
+
+		bool Empty() const { return fHead == fHits.size(); }
+		const Hit& Front() const { return fHits[fHead]; }
+	};
+
+	Run& GetRun(int board, int channel, size_t& index);
+	bool Later(size_t a, size_t b) const; // used as comparison for the heap, true if run a starts after run b
+
+	std::vector<Run> fRuns;
+	std::vector<std::vector<size_t> > fRunIndex; // [board][channel] -> index in fRuns + 1 (0 = no run yet)
+	std::vector<size_t> fHeap; // indices of all non-empty runs
+	size_t fSize;
+	uint64_t fOutOfOrder;
+	bool fReleased;        // true once any event has been popped
+	uint64_t fReleasedKey; // newest time key popped so far
+	uint64_t fLate;
+	uint64_t fMaxLateness;
+};
+#endif
@@ -0,0 +1,298 @@
+#ifndef CAENSTREAMPARSER_HH
+#define CAENSTREAMPARSER_HH
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#include "CaenHit.hh"
+#include "CaenParser.hh"
+
+// Decodes DPP-PSD data that arrives in chunks of arbitrary size, e.g. from a pipe, a socket, a file that's still being
+// written, or a file that's too large to load at once.
+// Feed can be called with any number of bytes, board aggregates, hits, and even single words can be split between
+// calls. Each hit is handed to the sink (same interface as for ParseData, see CaenParser.hh) as soon as all of its
+// words have arrived. Incomplete hits and headers are kept in a carry-over buffer, which never holds more than one hit
+// (at most 1 MB for the longest possible record length), so the memory needed doesn't depend on the amount of data.
+//
+// Unlike ParseData this doesn't give up on corrupted data: anything that isn't a board aggregate header is skipped
+// until the next header is found, and a corrupted channel aggregate skips the rest of its board aggregate.
+
+// a board aggregate can't be larger than the memory of the board (16 channels with 5.12 MS of 2 bytes each for the
+// largest memory option of the x730), so headers claiming more words are garbage
+const uint32_t kMaxBoardAggregateWords = 16*5120*1024*2/4;
+
+template<class Sink>
+class CaenStreamParser {
+public:
+	CaenStreamParser(Sink& sink, int debug = 0)
+		: fSink(sink), fDebug(debug), fErrors(0), fSkippedWords(0), fSkippedSinceReport(0)
+	{
+		Reset();
+	}
+
+	// decodes as much of the data as possible, keeps the rest for the next call
+	void Feed(const char* data, size_t size)
+	{
+		while(size > 0 || (fCarryBytes > 0 && fCarryBytes >= 4*NeedWords())) {
+			size_t need = 4*NeedWords();
+			if(fCarryBytes > 0 || size < need || reinterpret_cast<uintptr_t>(data)%alignof(uint32_t) != 0) {
+				// assemble the next header/hit in the carry-over buffer
+				if(fCarryBytes < need) {
+					if(fCarry.size() < need/4) {
+						fCarry.resize(need/4);
+					}
+					size_t n = std::min(size, need - fCarryBytes);
+					std::memcpy(reinterpret_cast<char*>(fCarry.data()) + fCarryBytes, data, n);
+					fCarryBytes += n;
+					data += n;
+					size -= n;
+					if(fCarryBytes < need) {
+						break;
+					}
+				}
+				// skipping words can leave some of the carry-over, keep those for the next round
+				size_t used = 4*Process(fCarry.data(), fCarryBytes/4);
+				fCarryBytes -= used;
+				std::memmove(fCarry.data(), reinterpret_cast<char*>(fCarry.data()) + used, fCarryBytes);
+			} else {
+				size_t used = 4*Process(reinterpret_cast<const uint32_t*>(data), size/4);
+				data += used;
+				size -= used;
+			}
+		}
+	}
+
+	// to be called at the end of the data, returns false (and resets the parser) if it ended in the middle of a board
+	// aggregate
+	bool Finish()
+	{
+		// a few words of padding can be left over
+		bool complete = fState == kBoardHeader && std::all_of(reinterpret_cast<const char*>(fCarry.data()), reinterpret_cast<const char*>(fCarry.data()) + fCarryBytes, [](char c) { return c == 0; });
+		if(!complete) {
+			std::cerr<<"Data ended in the middle of a board aggregate, "<<fBoardLeft<<" words of it weren't decoded ("<<fCarryBytes<<" bytes of an incomplete hit/header were left)"<<std::endl;
+			++fErrors;
+		}
+		ReportSkipped();
+		Reset();
+		return complete;
+	}
+
+	// forgets any partially decoded data
+	void Reset()
+	{
+		fState = kBoardHeader;
+		fCarryBytes = 0;
+		fBoardLeft = 0;
+		fChannelMask = 0;
+		fChannel = 0;
+		fHitsLeft = 0;
+	}
+
+	size_t CarryBytes() const { return fCarryBytes; }
+	size_t Errors() const { return fErrors; }             // number of corrupted board aggregates
+	size_t SkippedWords() const { return fSkippedWords; } // words skipped while looking for a board aggregate header
+
+private:
+	enum EState { kBoardHeader, kChannelHeader, kHits, kSkip };
+
+	// number of words needed to make progress in the current state
+	size_t NeedWords() const
+	{
+		switch(fState) {
+			case kBoardHeader:   return 4;
+			case kChannelHeader: return 2;
+			case kHits:          return fEventSize;
+			default:             return 1;
+		}
+	}
+
+	// processes complete headers/hits from nofWords words (at least NeedWords()), returns the number of words used
+	size_t Process(const uint32_t* data, size_t nofWords)
+	{
+		size_t w = 0;
+		while(nofWords - w >= NeedWords()) {
+			switch(fState) {
+				case kBoardHeader:
+					w += BoardHeader(data + w);
+					break;
+				case kChannelHeader:
+					ChannelHeader(data + w);
+					w += 2;
+					break;
+				case kHits:
+					{
+						size_t nofEvents = std::min(fHitsLeft, (nofWords - w)/fEventSize);
+						w = ParseChannelAggregate(data, w, nofEvents, fNumSampleWords, fChannel, fFormat, fWaveform, fDualTrace, fExtras, fExtraFormat, fSink, fDebug);
+						fHitsLeft -= nofEvents;
+						fBoardLeft -= nofEvents*fEventSize;
+						if(fHitsLeft == 0) {
+							fChannel += 2;
+							NextChannel();
+						}
+					}
+					break;
+				case kSkip:
+					{
+						size_t skip = std::min(fBoardLeft, nofWords - w);
+						w += skip;
+						fBoardLeft -= skip;
+						if(fBoardLeft == 0) {
+							fState = kBoardHeader;
+						}
+					}
+					break;
+			}
+		}
+		return w;
+	}
+
+	// returns the number of words used: 4 for a valid header, 1 if the first word is skipped
+	size_t BoardHeader(const uint32_t* data)
+	{
+		if(fDebug > 5) {
+			std::cout<<"----------------------------------------"<<std::endl;
+			PrintWord(data, 0);
+		}
+		if(data[0]>>28 != 0xa || (data[0]&0xfffffff) < 4 || (data[0]&0xfffffff) > kMaxBoardAggregateWords) {
+			// padding (empty words) is expected, anything else is reported once we found the next header
+			if(data[0] != 0x0) {
+				if(fDebug > 0) {
+					std::cout<<"0x"<<std::hex<<std::setw(8)<<std::setfill('0')<<data[0]<<std::dec<<std::setfill(' ')<<": not a board aggregate header, skipping"<<std::endl;
+				}
+				++fSkippedWords;
+				++fSkippedSinceReport;
+			}
+			return 1;
+		}
+		ReportSkipped();
+		fBoardLeft = (data[0]&0xfffffff) - 4; // number of 32-bit words from this board, minus the header
+		uint8_t boardId = data[1]>>27; // GEO address of board (can be set via register 0xef08 for VME)
+		uint16_t pattern = (data[1]>>8) & 0x7fff; // value read from LVDS I/O (VME only)
+		fChannelMask = data[1]&0xff; // which channels are in this board aggregate
+		uint32_t boardCounter = data[2]&0x7fffff;
+		uint32_t boardTime = data[3];
+		if(fDebug > 5) {
+			std::cout<<"pattern 0x"<<std::hex<<std::setw(8)<<std::setfill('0')<<pattern<<std::dec<<std::setfill(' ')<<", counter "<<boardCounter<<", time "<<boardTime<<", board ID "<<static_cast<int>(boardId)<<std::endl;
+			std::cout<<"channel mask 0x"<<std::hex<<std::setw(8)<<std::setfill('0')<<static_cast<int>(fChannelMask)<<std::dec<<std::setfill(' ')<<std::endl;
+		}
+		fChannel = 0;
+		NextChannel();
+		return 4;
+	}
+
+	void ChannelHeader(const uint32_t* data)
+	{
+		if(data[0]>>31 != 0x1) {
+			std::cerr<<"Failed on first word 0x"<<std::hex<<std::setw(8)<<std::setfill('0')<<data[0]<<std::dec<<std::setfill(' ')<<", highest bit should have been set!"<<std::endl;
+			SkipBoard(2);
+			return;
+		}
+		size_t numWords = data[0]&0x3fffff; // per channel
+		if(fDebug > 6) {
+			PrintWord(data, 1);
+		}
+		if(((data[1]>>29) & 0x3) != 0x3) {
+			std::cerr<<"Failed on second word 0x"<<std::hex<<std::setw(8)<<std::setfill('0')<<data[1]<<std::dec<<std::setfill(' ')<<", bits 29 and 30 should have been set!"<<std::endl;
+			SkipBoard(2);
+			return;
+		}
+		fDualTrace = ((data[1]>>31) == 0x1);
+		fExtras    = (((data[1]>>28) & 0x1) == 0x1);
+		fWaveform  = (((data[1]>>27) & 0x1) == 0x1);
+		fExtraFormat = ((data[1]>>24) & 0x7);
+		fFormat = data[1];
+		fNumSampleWords = fWaveform ? 4*(data[1]&0xffff) : 0; // this is actually the number of samples divided by eight, 2 sample per word => 4*
+		fEventSize = fNumSampleWords+2; // +2 = trigger time words and charge word
+		if(fExtras) ++fEventSize;
+		if(fDebug > 5) {
+			std::cout<<"supposed to have "<<numWords<<" words in this channel, "<<(fWaveform?"w/":"w/o")<<" waveform(s), "<<(fDualTrace?"w/":"w/o")<<" dual trace, "<<(fExtras?"w/":"w/o")<<" extras in format "<<static_cast<uint16_t>(fExtraFormat)<<", with "<<fNumSampleWords<<" sample words, event size "<<fEventSize<<" => "<<(numWords-2)/fEventSize<<" events"<<std::endl;
+		}
+		if(numWords < 2 || (numWords-2)%fEventSize != 0) {
+			std::cerr<<numWords<<" words in channel aggregate, event size is "<<fEventSize<<" => "<<static_cast<double>(numWords-2.)/static_cast<double>(fEventSize)<<" events?"<<std::endl;
+			SkipBoard(2);
+			return;
+		}
+		if(numWords > fBoardLeft) {
+			std::cerr<<"2 - Missing words, channel "<<static_cast<int>(fChannel)<<" needs "<<numWords<<" words, but board aggregate only has "<<fBoardLeft<<" words left"<<std::endl;
+			SkipBoard(2);
+			return;
+		}
+		fBoardLeft -= 2;
+		fHitsLeft = (numWords-2)/fEventSize;
+		if(fHitsLeft > 0) {
+			fState = kHits;
+		} else {
+			fChannel += 2;
+			NextChannel();
+		}
+	}
+
+	// moves on to the next channel pair in the channel mask, or the end of the board aggregate
+	void NextChannel()
+	{
+		while(fChannel < 16 && ((fChannelMask>>(fChannel/2)) & 0x1) == 0x0) {
+			if(fDebug > 5) {
+				std::cout<<"skipping dual channel "<<static_cast<int>(fChannel)<<std::endl;
+			}
+			fChannel += 2;
+		}
+		if(fChannel < 16) {
+			if(fBoardLeft < 2) {
+				std::cerr<<"1 - Missing words, board aggregate ends before the header of channel "<<static_cast<int>(fChannel)<<std::endl;
+				SkipBoard(0);
+				return;
+			}
+			fState = kChannelHeader;
+			return;
+		}
+		// skip anything left in this board aggregate
+		fState = fBoardLeft > 0 ? kSkip : kBoardHeader;
+	}
+
+	// skips the rest of the board aggregate after an error, used is the number of words of it that were already read
+	void SkipBoard(size_t used)
+	{
+		++fErrors;
+		fBoardLeft -= used;
+		fState = fBoardLeft > 0 ? kSkip : kBoardHeader;
+	}
+
+	void ReportSkipped()
+	{
+		if(fSkippedSinceReport > 0) {
+			std::cerr<<"Skipped "<<fSkippedSinceReport<<" words that weren't board aggregate headers"<<std::endl;
+			fSkippedSinceReport = 0;
+		}
+	}
+
+	Sink& fSink;
+	int fDebug;
+
+	EState fState;
+	std::vector<uint32_t> fCarry; // incomplete header/hit
+	size_t fCarryBytes;
+
+	// current board aggregate
+	size_t fBoardLeft; // words left in the board aggregate
+	uint8_t fChannelMask;
+	uint8_t fChannel;  // first channel of the current channel pair
+
+	// current channel aggregate
+	size_t fHitsLeft;
+	uint32_t fFormat;
+	bool fDualTrace;
+	bool fExtras;
+	bool fWaveform;
+	uint8_t fExtraFormat;
+	size_t fNumSampleWords;
+	size_t fEventSize;
+
+	size_t fErrors;
+	size_t fSkippedWords;
+	size_t fSkippedSinceReport;
+};
+#endif
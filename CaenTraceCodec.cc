@@ -0,0 +1,214 @@
+#include "CaenTraceCodec.hh"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+	// differences of 16-bit samples need up to 17 bits
+	const int kMaxWidth = 17;
+
+	enum EDigitalMode : uint8_t { kDigitalBits = 0, kDigitalBytes = 1 };
+
+	inline uint32_t ZigZag(int32_t value)
+	{
+		return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+	}
+
+	inline int32_t UnZigZag(uint32_t value)
+	{
+		return static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1);
+	}
+
+	inline int Width(uint32_t value)
+	{
+		return value == 0 ? 0 : 32 - __builtin_clz(value);
+	}
+
+	// 32 bits at a time, little endian like the rest of the output
+	inline void Store32(uint8_t* output, uint32_t value)
+	{
+		std::memcpy(output, &value, sizeof(value));
+	}
+
+	inline uint32_t Load32(const uint8_t* input)
+	{
+		uint32_t value;
+		std::memcpy(&value, input, sizeof(value));
+		return value;
+	}
+
+	inline size_t PackedSize(size_t nofValues, int width)
+	{
+		return (nofValues*width + 7)/8;
+	}
+
+	uint8_t* Pack(const uint32_t* values, size_t nofValues, int width, uint8_t* output)
+	{
+		uint64_t buffer = 0;
+		int bits = 0;
+		for(size_t i = 0; i < nofValues; ++i) {
+			buffer |= static_cast<uint64_t>(values[i]) << bits;
+			bits += width;
+			if(bits >= 32) {
+				Store32(output, static_cast<uint32_t>(buffer));
+				output += 4;
+				buffer >>= 32;
+				bits -= 32;
+			}
+		}
+		for(; bits > 0; bits -= 8) {
+			*output++ = static_cast<uint8_t>(buffer);
+			buffer >>= 8;
+		}
+		return output;
+	}
+
+	// input holds exactly PackedSize(nofValues, width) bytes
+	void Unpack(const uint8_t* input, size_t nofValues, int width, uint32_t* values)
+	{
+		const uint8_t* end = input + PackedSize(nofValues, width);
+		const uint64_t mask = (static_cast<uint64_t>(1) << width) - 1;
+		uint64_t buffer = 0;
+		int bits = 0;
+		for(size_t i = 0; i < nofValues; ++i) {
+			if(bits < width) {
+				if(end - input >= 4) {
+					buffer |= static_cast<uint64_t>(Load32(input)) << bits;
+					input += 4;
+					bits += 32;
+				} else {
+					for(; bits < width; bits += 8) {
+						buffer |= static_cast<uint64_t>(*input++) << bits;
+					}
+				}
+			}
+			values[i] = static_cast<uint32_t>(buffer & mask);
+			buffer >>= width;
+			bits -= width;
+		}
+	}
+
+	// the eight samples of each byte of packed digital samples
+	struct DigitalTable {
+		uint64_t fSamples[256];
+
+		DigitalTable()
+		{
+			for(uint32_t byte = 0; byte < 256; ++byte) {
+				fSamples[byte] = 0;
+				for(int bit = 0; bit < 8; ++bit) {
+					fSamples[byte] |= static_cast<uint64_t>((byte >> bit) & 0x1) << (8*bit);
+				}
+			}
+		}
+	};
+
+	const DigitalTable digitalTable;
+}
+
+size_t MaxEncodedAnalogSize(size_t nofSamples)
+{
+	return (nofSamples + kTraceGroupSize - 1)/kTraceGroupSize + PackedSize(nofSamples, kMaxWidth);
+}
+
+size_t EncodeAnalog(const uint16_t* samples, size_t nofSamples, uint8_t* output)
+{
+	uint8_t* begin = output;
+	uint32_t values[kTraceGroupSize];
+	int32_t previous = 0;
+	for(size_t first = 0; first < nofSamples; first += kTraceGroupSize) {
+		size_t nofValues = std::min(kTraceGroupSize, nofSamples - first);
+		uint32_t all = 0;
+		for(size_t i = 0; i < nofValues; ++i) {
+			int32_t sample = samples[first + i];
+			values[i] = ZigZag(sample - previous);
+			previous = sample;
+			all |= values[i];
+		}
+		int width = Width(all);
+		*output++ = static_cast<uint8_t>(width);
+		output = Pack(values, nofValues, width, output);
+	}
+	return output - begin;
+}
+
+bool DecodeAnalog(const uint8_t* input, size_t inputSize, uint16_t* samples, size_t nofSamples)
+{
+	const uint8_t* end = input + inputSize;
+	uint32_t values[kTraceGroupSize];
+	int32_t previous = 0;
+	for(size_t first = 0; first < nofSamples; first += kTraceGroupSize) {
+		size_t nofValues = std::min(kTraceGroupSize, nofSamples - first);
+		if(input == end) {
+			return false;
+		}
+		int width = *input++;
+		if(width > kMaxWidth || static_cast<size_t>(end - input) < PackedSize(nofValues, width)) {
+			return false;
+		}
+		Unpack(input, nofValues, width, values);
+		input += PackedSize(nofValues, width);
+		for(size_t i = 0; i < nofValues; ++i) {
+			previous += UnZigZag(values[i]);
+			samples[first + i] = static_cast<uint16_t>(previous);
+		}
+	}
+	return input == end;
+}
+
+size_t MaxEncodedDigitalSize(size_t nofSamples)
+{
+	return nofSamples == 0 ? 0 : 1 + nofSamples;
+}
+
+size_t EncodeDigital(const uint8_t* samples, size_t nofSamples, uint8_t* output)
+{
+	if(nofSamples == 0) {
+		return 0;
+	}
+	if(std::any_of(samples, samples + nofSamples, [](uint8_t sample) { return sample > 1; })) {
+		output[0] = kDigitalBytes;
+		std::memcpy(output + 1, samples, nofSamples);
+		return 1 + nofSamples;
+	}
+	output[0] = kDigitalBits;
+	uint8_t* packed = output + 1;
+	size_t s = 0;
+	for(; s + 8 <= nofSamples; s += 8) {
+		// eight samples of 0 or 1 at once, the multiplication moves the lowest bit of each byte into the top byte
+		uint64_t eight;
+		std::memcpy(&eight, samples + s, sizeof(eight));
+		*packed++ = static_cast<uint8_t>((eight*0x0102040810204080ULL) >> 56);
+	}
+	if(s < nofSamples) {
+		uint8_t last = 0;
+		for(size_t bit = 0; s + bit < nofSamples; ++bit) {
+			last |= samples[s + bit] << bit;
+		}
+		*packed++ = last;
+	}
+	return packed - output;
+}
+
+bool DecodeDigital(const uint8_t* input, size_t inputSize, uint8_t* samples, size_t nofSamples)
+{
+	if(nofSamples == 0) {
+		return inputSize == 0;
+	}
+	if(inputSize == 1 + nofSamples && input[0] == kDigitalBytes) {
+		std::memcpy(samples, input + 1, nofSamples);
+		return true;
+	}
+	if(inputSize != 1 + (nofSamples + 7)/8 || input[0] != kDigitalBits) {
+		return false;
+	}
+	const uint8_t* packed = input + 1;
+	size_t s = 0;
+	for(; s + 8 <= nofSamples; s += 8) {
+		std::memcpy(samples + s, &digitalTable.fSamples[*packed++], 8);
+	}
+	for(size_t bit = 0; s + bit < nofSamples; ++bit) {
+		samples[s + bit] = (*packed >> bit) & 0x1;
+	}
+	return true;
+}
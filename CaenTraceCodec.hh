@@ -0,0 +1,27 @@
+#ifndef CAENTRACECODEC_HH
+#define CAENTRACECODEC_HH
+#include <cstdint>
+#include <cstddef>
+
+// Lossless compression of the traces, used by CaenEvent::Streamer before the traces are handed to ROOT.
+//
+// Analog traces are coded as the differences between consecutive samples (the first sample relative to zero), mapped
+// to unsigned numbers by zig-zag coding (0, -1, 1, -2, ... -> 0, 1, 2, 3, ...), so the small differences of a baseline
+// with noise become small numbers. Each group of kTraceGroupSize differences is bit-packed with the width of its
+// largest difference: one byte with the width, followed by the differences packed into width bits each (the last group
+// only has as many bytes as its samples need).
+// Digital traces are one bit per sample, packed eight samples to a byte after a byte with the mode. Traces with samples
+// other than 0 and 1 (which the digitizer never sends) are stored as they are.
+//
+// The Max...Size functions give the size of the output buffer the encoding needs, the encoders return the number of
+// bytes used. The decoders return false if the input isn't exactly the encoding of nofSamples samples.
+const size_t kTraceGroupSize = 32;
+
+size_t MaxEncodedAnalogSize(size_t nofSamples);
+size_t EncodeAnalog(const uint16_t* samples, size_t nofSamples, uint8_t* output);
+bool DecodeAnalog(const uint8_t* input, size_t inputSize, uint16_t* samples, size_t nofSamples);
+
+size_t MaxEncodedDigitalSize(size_t nofSamples);
+size_t EncodeDigital(const uint8_t* samples, size_t nofSamples, uint8_t* output);
+bool DecodeDigital(const uint8_t* input, size_t inputSize, uint8_t* samples, size_t nofSamples);
+#endif
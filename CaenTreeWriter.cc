@@ -0,0 +1,125 @@
+#include "CaenTreeWriter.hh"
+
+#include <iostream>
+
+CaenTreeWriter::CaenTreeWriter(TFile* outputFile, size_t batchSize, int nofBatches, double saveInterval, bool flat, bool flatWaveforms, CaenEventPool* pool, bool debug)
+	: fOutputFile(outputFile), fTree(nullptr), fEvent(nullptr), fEmptyEvent(nullptr), fFlat(nullptr), fPool(pool), fBatchSize(batchSize), fCurrent(nullptr), fSaveInterval(saveInterval), fLastSave(std::chrono::steady_clock::now()), fWriting(true), fStalls(0), fDebug(debug)
+{
+	// create the tree in the output file, this is the last time we touch it from the calling thread
+	fOutputFile->cd();
+	fTree = new TTree("tree", "tree");
+	if(flat) {
+		fFlat = new CaenFlatTree;
+		fFlat->Branch(fTree, flatWaveforms);
+	} else {
+		// the branch needs an event of its own, the pool events are only borrowed while they are filled
+		fEmptyEvent = new CaenEvent;
+		fEvent = fEmptyEvent;
+		fTree->Branch("event", &fEvent);
+	}
+
+	fBatches.resize(nofBatches);
+	for(auto& batch : fBatches) {
+		batch.reserve(fBatchSize);
+		fFree.push_back(&batch);
+	}
+	fCurrent = fFree.front();
+	fFree.pop_front();
+
+	fThread = std::thread(&CaenTreeWriter::Write, this);
+}
+
+CaenTreeWriter::~CaenTreeWriter()
+{
+	if(fThread.joinable()) {
+		Finish();
+	}
+	delete fFlat;
+	if(fEmptyEvent != nullptr) {
+		// the tree is still in the output file, so it mustn't keep the address of the deleted event
+		fTree->ResetBranchAddresses();
+		delete fEmptyEvent;
+	}
+}
+
+void CaenTreeWriter::Add(CaenEvent* event)
+{
+	fCurrent->push_back(event);
+	if(fCurrent->size() >= fBatchSize) {
+		Flush();
+	}
+}
+
+void CaenTreeWriter::Flush()
+{
+	if(fCurrent->empty()) {
+		return;
+	}
+	std::unique_lock<std::mutex> lock(fMutex);
+	fFull.push_back(fCurrent);
+	fFullCondition.notify_one();
+	// get a new batch, waiting for the writer thread if all of them are in use
+	if(fFree.empty()) {
+		++fStalls;
+		fFreeCondition.wait(lock, [this]() { return !fFree.empty(); });
+	}
+	fCurrent = fFree.front();
+	fFree.pop_front();
+}
+
+void CaenTreeWriter::Finish()
+{
+	Flush();
+	{
+		std::lock_guard<std::mutex> lock(fMutex);
+		fWriting = false;
+	}
+	fFullCondition.notify_one();
+	fThread.join();
+	// the writer thread is done, so the tree is ours again
+	fTree->Write("", TObject::kOverwrite);
+}
+
+size_t CaenTreeWriter::QueuedBatches()
+{
+	std::lock_guard<std::mutex> lock(fMutex);
+	return fFull.size();
+}
+
+void CaenTreeWriter::Write()
+{
+	std::unique_lock<std::mutex> lock(fMutex);
+	while(true) {
+		fFullCondition.wait(lock, [this]() { return !fFull.empty() || !fWriting; });
+		if(fFull.empty()) {
+			break;
+		}
+		std::vector<CaenEvent*>* batch = fFull.front();
+		fFull.pop_front();
+		lock.unlock();
+		for(auto event : *batch) {
+			if(fDebug) {
+				std::cout<<"Writing event "<<fTree->GetEntries()<<std::endl;
+				event->Print();
+			}
+			if(fFlat != nullptr) {
+				fFlat->Set(*event);
+				fFlat->Fill();
+			} else {
+				fEvent = event;
+				fTree->Fill();
+			}
+		}
+		// the events go back to the pool, so the branch mustn't point to them anymore
+		fEvent = fEmptyEvent;
+		fPool->Release(*batch);
+		if(fSaveInterval > 0. && std::chrono::duration<double>(std::chrono::steady_clock::now() - fLastSave).count() >= fSaveInterval) {
+			// writes the baskets and the tree header, so readers see all entries filled so far
+			fTree->AutoSave("SaveSelf");
+			fLastSave = std::chrono::steady_clock::now();
+		}
+		lock.lock();
+		fFree.push_back(batch);
+		fFreeCondition.notify_one();
+	}
+}
@@ -0,0 +1,65 @@
+#ifndef CAENTREEWRITER_HH
+#define CAENTREEWRITER_HH
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include "TFile.h"
+#include "TTree.h"
+
+#include "CaenEvent.hh"
+#include "CaenEventPool.hh"
+#include "CaenFlatTree.hh"
+
+// Writes events to a tree from its own thread.
+// Events are collected in batches, a full batch is swapped with an empty one and handed to the writer thread, which
+// fills the tree and returns the events to the event pool. If the writer falls behind and no empty batch is left, Add waits until the
+// writer has finished a batch. Once constructed, only the writer thread touches the tree and the output file, until
+// Finish returns.
+// Every saveInterval seconds the writer thread auto-saves the tree, so other programs (e.g. Histograms -follow) can read
+// the events written so far while the file is still being written.
+// With flat the tree has one branch per member of the events instead of one branch of CaenEvents (see CaenFlatTree).
+class CaenTreeWriter {
+public:
+	CaenTreeWriter(TFile* outputFile, size_t batchSize, int nofBatches, double saveInterval, bool flat, bool flatWaveforms, CaenEventPool* pool, bool debug);
+	~CaenTreeWriter();
+
+	void Add(CaenEvent* event); // the event is returned to the pool once it's written
+	void Flush();               // hands the current batch to the writer thread, even if it isn't full
+	void Finish();              // writes all remaining events and the tree, and stops the writer thread
+
+	size_t QueuedBatches();
+	uint64_t Stalls() const { return fStalls; } // how often Add had to wait for the writer thread
+
+private:
+	void Write();
+
+	TFile* fOutputFile;
+	TTree* fTree;
+	CaenEvent* fEvent;      // branch address, points to the event being filled
+	CaenEvent* fEmptyEvent; // owned, the branch address points to it outside of Fill (nullptr for the flat schema)
+	CaenFlatTree* fFlat; // nullptr unless the flat schema is written
+	CaenEventPool* fPool;
+
+	size_t fBatchSize;
+	std::vector<std::vector<CaenEvent*> > fBatches;
+	std::vector<CaenEvent*>* fCurrent;            // batch being filled by Add
+	std::deque<std::vector<CaenEvent*>*> fFree;   // empty batches
+	std::deque<std::vector<CaenEvent*>*> fFull;   // batches waiting for the writer thread
+
+	double fSaveInterval;
+	std::chrono::steady_clock::time_point fLastSave;
+
+	std::thread fThread;
+	std::mutex fMutex;
+	std::condition_variable fFreeCondition; // signals an empty batch
+	std::condition_variable fFullCondition; // signals a full batch (or that we're done)
+	bool fWriting;
+	uint64_t fStalls;
+
+	bool fDebug;
+};
+#endif
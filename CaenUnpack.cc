@@ -0,0 +1,150 @@
+#include "CaenUnpack.hh"
+
+#ifdef CAEN_UNPACK_X86
+#include <immintrin.h>
+#endif
+
+void UnpackSamplesScalar(const uint32_t* words, size_t nofWords, bool dualTrace, CaenTraces& traces)
+{
+	uint16_t* analog0 = traces.fAnalog[0];
+	uint16_t* analog1 = traces.fAnalog[1];
+	uint8_t* digital0 = traces.fDigital[0];
+	uint8_t* digital1 = traces.fDigital[1];
+	for(size_t s = 0; s < nofWords; ++s) {
+		uint32_t word = words[s];
+		digital0[2*s]   = (word>>14)&0x1;
+		digital1[2*s]   = (word>>15)&0x1;
+		digital0[2*s+1] = (word>>30)&0x1;
+		digital1[2*s+1] = (word>>31)&0x1;
+		if(dualTrace) {
+			// all even samples are from the first trace, all odd ones from the second trace
+			analog1[s] = word&0x3fff;
+			analog0[s] = (word>>16)&0x3fff;
+		} else {
+			// both samples are from the first trace
+			analog0[2*s]   = word&0x3fff;
+			analog0[2*s+1] = (word>>16)&0x3fff;
+		}
+	}
+}
+
+#ifdef CAEN_UNPACK_X86
+// Both kernels treat the sample words as pairs of 16-bit samples: masking with 0x3fff gives the analog samples in
+// order, shifting by 14/15 the digital probes. For dual trace data the lower and upper halves are separated by packing
+// the 32-bit words down to 16 bits.
+__attribute__((target("sse4.1")))
+void UnpackSamplesSse41(const uint32_t* words, size_t nofWords, bool dualTrace, CaenTraces& traces)
+{
+	const __m128i analogMask = _mm_set1_epi16(0x3fff);
+	const __m128i lowerMask = _mm_set1_epi32(0x3fff);
+	const __m128i one = _mm_set1_epi16(0x1);
+	size_t s = 0;
+	for(; s + 8 <= nofWords; s += 8) {
+		__m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(words + s));
+		__m128i second = _mm_loadu_si128(reinterpret_cast<const __m128i*>(words + s + 4));
+		__m128i digital0 = _mm_packus_epi16(_mm_and_si128(_mm_srli_epi16(first, 14), one), _mm_and_si128(_mm_srli_epi16(second, 14), one));
+		__m128i digital1 = _mm_packus_epi16(_mm_srli_epi16(first, 15), _mm_srli_epi16(second, 15));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(traces.fDigital[0] + 2*s), digital0);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(traces.fDigital[1] + 2*s), digital1);
+		if(dualTrace) {
+			__m128i lower = _mm_packus_epi32(_mm_and_si128(first, lowerMask), _mm_and_si128(second, lowerMask));
+			__m128i upper = _mm_packus_epi32(_mm_and_si128(_mm_srli_epi32(first, 16), lowerMask), _mm_and_si128(_mm_srli_epi32(second, 16), lowerMask));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(traces.fAnalog[1] + s), lower);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(traces.fAnalog[0] + s), upper);
+		} else {
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(traces.fAnalog[0] + 2*s), _mm_and_si128(first, analogMask));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(traces.fAnalog[0] + 2*s + 8), _mm_and_si128(second, analogMask));
+		}
+	}
+	if(s < nofWords) {
+		CaenTraces rest = { { traces.fAnalog[0] + (dualTrace ? s : 2*s), dualTrace ? traces.fAnalog[1] + s : nullptr }, { traces.fDigital[0] + 2*s, traces.fDigital[1] + 2*s } };
+		UnpackSamplesScalar(words + s, nofWords - s, dualTrace, rest);
+	}
+}
+
+__attribute__((target("avx2")))
+void UnpackSamplesAvx2(const uint32_t* words, size_t nofWords, bool dualTrace, CaenTraces& traces)
+{
+	// the 256-bit packs work on each 128-bit lane separately, the permutes put the 64-bit blocks back in order
+	const __m256i analogMask = _mm256_set1_epi16(0x3fff);
+	const __m256i lowerMask = _mm256_set1_epi32(0x3fff);
+	const __m256i one = _mm256_set1_epi16(0x1);
+	size_t s = 0;
+	for(; s + 16 <= nofWords; s += 16) {
+		__m256i first = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + s));
+		__m256i second = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + s + 8));
+		__m256i digital0 = _mm256_packus_epi16(_mm256_and_si256(_mm256_srli_epi16(first, 14), one), _mm256_and_si256(_mm256_srli_epi16(second, 14), one));
+		__m256i digital1 = _mm256_packus_epi16(_mm256_srli_epi16(first, 15), _mm256_srli_epi16(second, 15));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(traces.fDigital[0] + 2*s), _mm256_permute4x64_epi64(digital0, 0xd8));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(traces.fDigital[1] + 2*s), _mm256_permute4x64_epi64(digital1, 0xd8));
+		if(dualTrace) {
+			__m256i lower = _mm256_packus_epi32(_mm256_and_si256(first, lowerMask), _mm256_and_si256(second, lowerMask));
+			__m256i upper = _mm256_packus_epi32(_mm256_and_si256(_mm256_srli_epi32(first, 16), lowerMask), _mm256_and_si256(_mm256_srli_epi32(second, 16), lowerMask));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(traces.fAnalog[1] + s), _mm256_permute4x64_epi64(lower, 0xd8));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(traces.fAnalog[0] + s), _mm256_permute4x64_epi64(upper, 0xd8));
+		} else {
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(traces.fAnalog[0] + 2*s), _mm256_and_si256(first, analogMask));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(traces.fAnalog[0] + 2*s + 16), _mm256_and_si256(second, analogMask));
+		}
+	}
+	if(s < nofWords) {
+		CaenTraces rest = { { traces.fAnalog[0] + (dualTrace ? s : 2*s), dualTrace ? traces.fAnalog[1] + s : nullptr }, { traces.fDigital[0] + 2*s, traces.fDigital[1] + 2*s } };
+		UnpackSamplesSse41(words + s, nofWords - s, dualTrace, rest);
+	}
+}
+#endif
+
+bool HasSse41()
+{
+#ifdef CAEN_UNPACK_X86
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.1");
+#else
+	return false;
+#endif
+}
+
+bool HasAvx2()
+{
+#ifdef CAEN_UNPACK_X86
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#else
+	return false;
+#endif
+}
+
+namespace {
+	typedef void (*UnpackFunction)(const uint32_t*, size_t, bool, CaenTraces&);
+
+	struct UnpackKernelChoice {
+		UnpackFunction fFunction;
+		const char* fName;
+
+		UnpackKernelChoice()
+			: fFunction(UnpackSamplesScalar), fName("scalar")
+		{
+#ifdef CAEN_UNPACK_X86
+			if(HasAvx2()) {
+				fFunction = UnpackSamplesAvx2;
+				fName = "AVX2";
+			} else if(HasSse41()) {
+				fFunction = UnpackSamplesSse41;
+				fName = "SSE4.1";
+			}
+#endif
+		}
+	};
+
+	const UnpackKernelChoice unpackKernel;
+}
+
+void UnpackSamples(const uint32_t* words, size_t nofWords, bool dualTrace, CaenTraces& traces)
+{
+	unpackKernel.fFunction(words, nofWords, dualTrace, traces);
+}
+
+const char* UnpackKernel()
+{
+	return unpackKernel.fName;
+}
@@ -0,0 +1,27 @@
+#ifndef CAENUNPACK_HH
+#define CAENUNPACK_HH
+#include <cstdint>
+#include <cstddef>
+
+#include "CaenHit.hh"
+
+// Unpacking of the DPP-PSD sample words of one hit into the traces.
+// Each sample word holds two samples: bits [13:0] and [29:16] are the analog samples, bits 14/30 the first and 15/31
+// the second digital probe. For single trace data both analog samples go to the first trace, for dual trace data the
+// lower one goes to the second and the upper one to the first trace (see CaenTraces for the sizes of the traces).
+//
+// UnpackSamples uses the fastest kernel the CPU supports (AVX2, SSE4.1, or plain C++), which is picked once at
+// startup. The kernels all produce the same results and are only exposed for testing and benchmarking.
+void UnpackSamples(const uint32_t* words, size_t nofWords, bool dualTrace, CaenTraces& traces);
+
+void UnpackSamplesScalar(const uint32_t* words, size_t nofWords, bool dualTrace, CaenTraces& traces);
+#if defined(__x86_64__) || defined(__i386__)
+#define CAEN_UNPACK_X86
+void UnpackSamplesSse41(const uint32_t* words, size_t nofWords, bool dualTrace, CaenTraces& traces);
+void UnpackSamplesAvx2(const uint32_t* words, size_t nofWords, bool dualTrace, CaenTraces& traces);
+#endif
+
+bool HasSse41();
+bool HasAvx2();
+const char* UnpackKernel(); // name of the kernel used by UnpackSamples
+#endif
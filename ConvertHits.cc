@@ -0,0 +1,105 @@
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+#include <string>
+
+#include "TROOT.h"
+#include "TFile.h"
+#include "TTree.h"
+
+#include "CaenEvent.hh"
+#include "CaenFlatTree.hh"
+#include "CaenHitReader.hh"
+#include "CommandLineInterface.hh"
+
+// converts hit files written by CaenReadout -hf into the same tree CaenReadout writes (the flat tree, or with -events the tree of CaenEvents)
+int main(int argc, char** argv) {
+	CommandLineInterface interface;
+	std::vector<std::string> inputFilenames;
+	interface.Add("-if", "input hit files (required), converted in this order", &inputFilenames);
+	std::string outputFilename;
+	interface.Add("-of", "output root file (required)", &outputFilename);
+	bool events = false;
+	interface.Add("-events", "write one branch of CaenEvents instead of the flat tree with one branch per member of the hits (see CaenFlatTree), readers of it always read the traces as well", &events);
+	bool flatFlag = false;
+	interface.Add("-flat", "write the flat tree (the default now, only kept for old scripts)", &flatFlag);
+	bool noWaveforms = false;
+	interface.Add("-nw", "don't write the traces to the flat tree", &noWaveforms);
+	int debug = 0;
+	interface.Add("-d", "debug level", &debug);
+
+	interface.CheckFlags(argc, argv);
+	bool flat = !events;
+
+	if(inputFilenames.empty() || outputFilename.empty()) {
+		std::cerr<<"You need to provide at least one input file (-if flag) and an output file (-of flag)"<<std::endl;
+		return 1;
+	}
+
+	// open input files
+	std::vector<CaenHitReader*> readers;
+	uint64_t totalHits = 0;
+	for(const auto& inputFilename : inputFilenames) {
+		try {
+			readers.push_back(new CaenHitReader(inputFilename, debug > 0));
+		} catch(const std::runtime_error& e) {
+			std::cerr<<e.what()<<std::endl;
+			return 1;
+		}
+		// the blocks are used in place if the file can be mapped
+		if(!readers.back()->Map()) {
+			std::cout<<"Failed to map \""<<inputFilename<<"\", reading it block by block instead"<<std::endl;
+		}
+		totalHits += readers.back()->NofHits();
+	}
+
+	// open root file
+	auto output = new TFile(outputFilename.c_str(), "recreate");
+	if(output == nullptr || !output->IsOpen()) {
+		std::cerr<<R"(Failed to open ")"<<outputFilename<<R"(" as output root file)"<<std::endl;
+		return 1;
+	}
+	// compress the baskets of the tree in parallel
+	ROOT::EnableImplicitMT();
+
+	TTree* tree = new TTree("tree", "tree");
+	auto caenEvent = new CaenEvent;
+	CaenFlatTree flatTree;
+	if(flat) {
+		flatTree.Branch(tree, !noWaveforms);
+	} else {
+		tree->Branch("event", &caenEvent);
+	}
+
+	uint64_t hitsDone = 0;
+	for(auto reader : readers) {
+		CaenHitIterator hit(*reader);
+		while(hit.Next()) {
+			hit.Fill(*caenEvent);
+			if(flat) {
+				flatTree.Set(*caenEvent);
+				flatTree.Fill();
+			} else {
+				tree->Fill();
+			}
+			if(debug > 4) {
+				caenEvent->Print();
+			}
+			if(++hitsDone%1000000 == 0) {
+				std::cout<<hitsDone<<"/"<<totalHits<<" hits = "<<(100*hitsDone)/totalHits<<" % done\r"<<std::flush;
+			}
+		}
+	}
+	std::cout<<hitsDone<<"/"<<totalHits<<" hits = 100 % done"<<std::endl;
+	if(hitsDone != totalHits) {
+		std::cout<<totalHits - hitsDone<<" hits were in blocks that couldn't be read"<<std::endl;
+	}
+
+	tree->Write();
+	output->Close();
+	for(auto reader : readers) {
+		delete reader;
+	}
+
+	return 0;
+}
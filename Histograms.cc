@@ -1,88 +1,439 @@
 #include <iostream>
+#include <iomanip>
+#include <array>
+#include <vector>
+#include <string>
+#include <thread>
+#include <future>
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <fstream>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
 
+#include <signal.h>
+
+#include "TROOT.h"
 #include "TFile.h"
 #include "TTree.h"
+#include "TBranch.h"
+#include "TObjArray.h"
 #include "TH1.h"
-#include "TH2.h"
+#include "TVectorD.h"
+
+#include "CommandLineInterface.hh"
 
 #include "CaenEvent.hh"
+#include "CaenFlatTree.hh"
+#include "CaenHistogramEngine.hh"
 
-int main(int argc, char** argv)
+// the parts of the last event of a channel needed for the time differences
+struct LastHit {
+	bool     fValid;
+	uint64_t fTimestamp;
+	double   fTime;
+	uint16_t fCfd;
+};
+
+const int kNofChannels = 16;
+typedef std::array<LastHit, kNofChannels> LastHits;
+
+// Range of entries handled by one thread.
+// The coincidences need the last hit of each channel before the current entry, which for the first hits of each
+// channel in the chunk is in one of the chunks before it. So each chunk is first filled on its own, then the last
+// hits of the chunks before it are passed along, and the missing coincidences are filled in a second pass over the
+// entries up to the first hit of each channel.
+struct Chunk {
+	Long64_t fBegin;
+	Long64_t fEnd;
+	std::array<Long64_t, kNofChannels> fFirstEntry; // first entry of each channel in this chunk, fEnd if there is none
+	LastHits fLastHits;                              // last hits at the end of this chunk (only of this chunk)
+	std::unique_ptr<CaenHistogramFiller> fHistograms;
+	std::promise<LastHits> fIncoming;                // last hits of all chunks before this one
+};
+
+// reads the members of the events we need
+class HitReader {
+public:
+	HitReader(const char* filename, Long64_t begin, Long64_t end)
+		: fFile(filename), fTree(nullptr), fEvent(nullptr), fIsFlat(false)
+	{
+		if(!fFile.IsOpen()) {
+			std::cerr<<"Failed to open input file \""<<filename<<"\""<<std::endl;
+			return;
+		}
+		fTree = static_cast<TTree*>(fFile.Get("tree"));
+		if(fTree == nullptr) {
+			std::cerr<<"Failed to find tree in \""<<filename<<"\""<<std::endl;
+			return;
+		}
+		// read as little as possible, with the baskets of the branches read in large chunks by the tree cache:
+		// - the flat schema has one branch per member, so only the members we need are read, not the traces
+		// - the event branch of files from before CaenEvent had its own streamer (version 3 and older) is split into one
+		//   branch per member, so the same holds for them
+		// - since then the event branch is unsplit and every entry is read as a whole, including the coded traces (they
+		//   aren't decoded, but still have to be read and decompressed), which is why the flat schema is the default output
+		std::vector<const char*> neededBranches;
+		fIsFlat = fFlat.SetBranchAddresses(fTree, false);
+		if(fIsFlat) {
+			neededBranches = { "channel", "timestamp", "cfd", "charge", "shortGate" };
+		} else {
+			fTree->SetBranchAddress("event", &fEvent);
+			TBranch* branch = fTree->GetBranch("event");
+			if(branch != nullptr && branch->GetListOfBranches()->GetEntriesFast() == 0) {
+				neededBranches = { "event" };
+			} else {
+				neededBranches = { "*fChannel", "*fTriggerTime", "*fExtendedTimestamp", "*fCfd", "*fCharge", "*fShortGate" };
+			}
+		}
+		fTree->SetBranchStatus("*", false);
+		fTree->SetCacheSize(100000000);
+		fTree->SetCacheEntryRange(begin, end);
+		for(auto branch : neededBranches) {
+			fTree->SetBranchStatus(branch, true);
+			fTree->AddBranchToCache(branch, true);
+		}
+		fTree->StopCacheLearningPhase();
+	}
+
+	bool IsOpen() const { return fTree != nullptr; }
+
+	// returns false if the channel is out of range
+	bool Read(Long64_t entry, HistogramHit& hit)
+	{
+		fTree->GetEntry(entry);
+		hit.fChannel = fIsFlat ? fFlat.fChannel : fEvent->Channel();
+		if(hit.fChannel < 0 || hit.fChannel >= kNofChannels) {
+			std::cerr<<"Channel "<<hit.fChannel<<" of entry "<<entry<<" out of range, skipping it"<<std::endl;
+			return false;
+		}
+		if(fIsFlat) {
+			hit.fTimestamp = fFlat.fTimestamp;
+			hit.fTime = fFlat.Time();
+			hit.fCharge = fFlat.fCharge;
+			hit.fShortGate = fFlat.fShortGate;
+			hit.fCfd = fFlat.fCfd;
+			return true;
+		}
+		hit.fTimestamp = fEvent->GetTimestamp();
+		hit.fTime = fEvent->GetTime();
+		hit.fCharge = fEvent->Charge();
+		hit.fShortGate = fEvent->ShortGate();
+		hit.fCfd = fEvent->Cfd();
+		return true;
+	}
+
+private:
+	TFile fFile;
+	TTree* fTree;
+	CaenEvent* fEvent;
+	CaenFlatTree fFlat;
+	bool fIsFlat;
+};
+
+void FillChunk(const char* filename, Chunk& chunk, std::promise<LastHits>* outgoing, std::atomic<Long64_t>& entriesDone, Long64_t nofEntries, bool printProgress)
 {
-	if(argc != 2) {
-		std::cerr<<"Usage: "<<argv[0]<<" <input-file>"<<std::endl;
-		return 1;
+	HitReader reader(filename, chunk.fBegin, chunk.fEnd);
+	HistogramHit hit;
+	LastHits& lastHits = chunk.fLastHits;
+	for(auto& lastHit : lastHits) {
+		lastHit.fValid = false;
 	}
+	chunk.fFirstEntry.fill(chunk.fEnd);
 
-	TFile input(argv[1]);
-	if(!input.IsOpen()) {
-		std::cerr<<"Failed to open input file \""<<argv[1]<<"\""<<std::endl;
-		return 1;
+	// first pass, with the coincidences within this chunk
+	for(Long64_t i = chunk.fBegin; reader.IsOpen() && i < chunk.fEnd; ++i) {
+		if(!reader.Read(i, hit)) {
+			continue;
+		}
+		// loop over all previous events
+		for(int c = 0; c < kNofChannels; ++c) {
+			if(lastHits[c].fValid) {
+				chunk.fHistograms->AddPair(hit, c, lastHits[c].fTimestamp, lastHits[c].fTime, lastHits[c].fCfd);
+			}
+		}
+		chunk.fHistograms->AddHit(hit);
+
+		// update last event of this channel to current event
+		LastHit& last = lastHits[hit.fChannel];
+		if(!last.fValid) {
+			chunk.fFirstEntry[hit.fChannel] = i;
+		}
+		last.fValid = true;
+		last.fTimestamp = hit.fTimestamp;
+		last.fTime = hit.fTime;
+		last.fCfd = hit.fCfd;
+
+		if((i - chunk.fBegin)%1000 == 999) {
+			entriesDone += 1000;
+			if(printProgress) {
+				std::cout<<std::setw(3)<<(100*entriesDone)/nofEntries<<" % done\r"<<std::flush;
+			}
+		}
+	}
+
+	// pass the last hits on to the next chunk (or back to the caller after the last chunk), as soon as we know those of
+	// the chunks before this one
+	LastHits incoming = chunk.fIncoming.get_future().get();
+	LastHits last = incoming;
+	for(int c = 0; c < kNofChannels; ++c) {
+		if(lastHits[c].fValid) {
+			last[c] = lastHits[c];
+		}
+	}
+	outgoing->set_value(last);
+
+	// second pass, with the coincidences with the hits of the chunks before this one, which are the last hits of each
+	// channel up to (and including) the first hit of that channel in this chunk
+	Long64_t fixEnd = chunk.fBegin;
+	for(int c = 0; c < kNofChannels; ++c) {
+		if(incoming[c].fValid) {
+			fixEnd = std::max(fixEnd, std::min(chunk.fFirstEntry[c] + 1, chunk.fEnd));
+		}
+	}
+	for(Long64_t i = chunk.fBegin; reader.IsOpen() && i < fixEnd; ++i) {
+		if(!reader.Read(i, hit)) {
+			continue;
+		}
+		for(int c = 0; c < kNofChannels; ++c) {
+			if(incoming[c].fValid && i <= chunk.fFirstEntry[c]) {
+				chunk.fHistograms->AddPair(hit, c, incoming[c].fTimestamp, incoming[c].fTime, incoming[c].fCfd);
+			}
+		}
+	}
+	chunk.fHistograms->Flush();
+}
+
+// fills the histograms with the entries [begin, end), lastHits are the last hits before begin and are updated to
+// those at end
+void FillEntries(const std::string& filename, Long64_t begin, Long64_t end, int nofThreads, const CaenHistogramEngine& engine, LastHits& lastHits, CaenHistogramFiller& histograms)
+{
+	Long64_t nofEntries = end - begin;
+	if(nofEntries < 1) {
+		return;
+	}
+	// split the entries into one chunk per thread
+	if(nofEntries < nofThreads) {
+		nofThreads = nofEntries;
+	}
+	std::vector<Chunk> chunks(nofThreads);
+	for(int t = 0; t < nofThreads; ++t) {
+		chunks[t].fBegin = begin + (nofEntries*t)/nofThreads;
+		chunks[t].fEnd = begin + (nofEntries*(t+1))/nofThreads;
+		chunks[t].fHistograms.reset(new CaenHistogramFiller(engine));
+	}
+	chunks[0].fIncoming.set_value(lastHits);
+	std::promise<LastHits> outgoing;
+
+	std::atomic<Long64_t> entriesDone(0);
+	std::vector<std::thread> threads;
+	for(int t = 0; t < nofThreads; ++t) {
+		threads.emplace_back(FillChunk, filename.c_str(), std::ref(chunks[t]), t + 1 < nofThreads ? &chunks[t+1].fIncoming : &outgoing, std::ref(entriesDone), nofEntries, t == 0);
+	}
+	for(auto& thread : threads) {
+		thread.join();
 	}
+	std::cout<<"100 % done"<<std::endl;
+
+	lastHits = outgoing.get_future().get();
+	for(auto& chunk : chunks) {
+		histograms.Add(*chunk.fHistograms);
+	}
+}
 
+// returns the number of entries in the tree of the file, -1 if it can't be read
+Long64_t NofEntries(const std::string& filename)
+{
+	TFile input(filename.c_str());
+	if(!input.IsOpen()) {
+		std::cerr<<"Failed to open input file \""<<filename<<"\""<<std::endl;
+		return -1;
+	}
 	TTree* tree = static_cast<TTree*>(input.Get("tree"));
-	CaenEvent* event = nullptr;
-	tree->SetBranchAddress("event", &event);
+	if(tree == nullptr) {
+		std::cerr<<"Failed to find tree in \""<<filename<<"\""<<std::endl;
+		return -1;
+	}
+	return tree->GetEntries();
+}
+
+// The checkpoint is written with the histograms, so they can be updated with the entries added to the input file
+// later on. It holds the number of entries filled so far, and the last hit of each channel.
+const int kCheckpointSize = 1 + 4*kNofChannels;
+
+bool ReadCheckpoint(TFile& file, Long64_t& entries, LastHits& lastHits)
+{
+	TVectorD* checkpoint = dynamic_cast<TVectorD*>(file.Get("checkpoint"));
+	if(checkpoint == nullptr || checkpoint->GetNrows() != kCheckpointSize) {
+		delete checkpoint;
+		return false;
+	}
+	entries = static_cast<Long64_t>((*checkpoint)[0]);
+	for(int c = 0; c < kNofChannels; ++c) {
+		lastHits[c].fValid = (*checkpoint)[1 + 4*c] != 0.;
+		lastHits[c].fTimestamp = static_cast<uint64_t>((*checkpoint)[2 + 4*c]);
+		lastHits[c].fTime = (*checkpoint)[3 + 4*c];
+		lastHits[c].fCfd = static_cast<uint16_t>((*checkpoint)[4 + 4*c]);
+	}
+	delete checkpoint;
+	return true;
+}
 
-	TFile output(Form("hist_%s", argv[1]), "recreate");
+void WriteCheckpoint(Long64_t entries, const LastHits& lastHits)
+{
+	TVectorD checkpoint(kCheckpointSize);
+	// the timestamps have 48 bits, so they fit into a double
+	checkpoint[0] = entries;
+	for(int c = 0; c < kNofChannels; ++c) {
+		checkpoint[1 + 4*c] = lastHits[c].fValid ? 1. : 0.;
+		checkpoint[2 + 4*c] = lastHits[c].fTimestamp;
+		checkpoint[3 + 4*c] = lastHits[c].fTime;
+		checkpoint[4 + 4*c] = lastHits[c].fCfd;
+	}
+	checkpoint.Write("checkpoint");
+}
+
+// writes to a temporary file that then replaces the output file, so the output file is always complete, even if the
+// program is stopped while writing
+bool WriteOutput(const std::string& filename, CaenHistogramFiller& histograms, Long64_t entries, const LastHits& lastHits)
+{
+	std::string temporary = filename + ".tmp";
+	TFile output(temporary.c_str(), "recreate");
 	if(!output.IsOpen()) {
-		std::cerr<<"Failed to open output file \""<<Form("hist_%s", argv[1])<<"\""<<std::endl;
-		return 1;
+		std::cerr<<"Failed to open output file \""<<temporary<<"\""<<std::endl;
+		return false;
+	}
+	histograms.Write();
+	WriteCheckpoint(entries, lastHits);
+	output.Close();
+	if(std::rename(temporary.c_str(), filename.c_str()) != 0) {
+		std::cerr<<"Failed to rename \""<<temporary<<"\" to \""<<filename<<"\": "<<std::strerror(errno)<<std::endl;
+		return false;
 	}
+	return true;
+}
+
+volatile std::sig_atomic_t interrupted = 0;
+
+void HandleSignal(int)
+{
+	interrupted = 1;
+}
 
-	std::map<int, CaenEvent> lastEvents;
+int main(int argc, char** argv)
+{
+	CommandLineInterface interface;
+	std::string inputFilename;
+	interface.Add("-if", "input root file (required), trees of CaenEvents (FlatTree setting off, -events of MakeHist/ConvertHits) are read with their traces, the default flat tree without", &inputFilename);
+	std::string outputFilename;
+	interface.Add("-of", "output root file (default is hist_<input file>)", &outputFilename);
+	std::string definitionFilename;
+	interface.Add("-hf", "file with the histogram definitions (default are the histograms from CaenHistogramEngine::DefaultDefinitions)", &definitionFilename);
+	int nofThreads = std::thread::hardware_concurrency();
+	interface.Add("-j", "number of threads filling the histograms (default is the number of cores)", &nofThreads);
+	bool incremental = false;
+	interface.Add("-inc", "continue from the checkpoint in the output file, only filling the entries added since then", &incremental);
+	bool follow = false;
+	interface.Add("-follow", "keep filling the entries added to the input file while it's written, until stopped with ctrl-c (implies -inc)", &follow);
+	double interval = 10.;
+	interface.Add("-interval", "seconds between updates in follow mode (default 10)", &interval);
 
-	TH1F tsDiff("tsDiff", "#DeltaTS, different channels;#DeltaTS [sample]", 100000, 0., 100000.);
-	TH1F tDiff("tDiff", "#Deltat, different channels;#Deltat [#mus]", 10000, 0., 1000.);
-	TH2F tDiffZoomVsCharge("tDiffZoomVsCharge", "#Deltat, different channels vs. charge;charge [channels];#Deltat [ns]", 1000, 0., 65000., 1280, 0., 10.);
-	TH2F cfdDiffVsTsDiff("cfdDiffVsTsDiff", "#DeltaCFD vs. #DeltaTS;#DeltaTS [sample];#DeltaCFD [ns]", 10, -0., 9.5, 512, 0., 2.);
-	TH2F tDiffSame("tDiffSame", "#Deltat, same channel;Channel Number;#Deltat [#mus]", 2, -0., 1.5, 1000, 0., 1000.);
-	TH2F channelVsCharge("channelVsCharge", "Channel # vs. charge;charge [channels]", 1000, 0., 65000., 8, -0.5, 7.5);
-	TH2F channelVsShortGate("channelVsShortGate", "Channel # vs. short gate;short gate [channels]", 1000, 0., 65000., 8, -0.5, 7.5);
-	TH2F psdVsCharge("psdVsCharge", "PSD (short gate/charge) vs. charge;charge [channels]", 1000, 0., 65000., 1000, 0.2, 1.2);
+	interface.CheckFlags(argc, argv);
 
-	for(Long64_t i = 0; i < tree->GetEntries(); ++i) {
-		tree->GetEntry(i);
+	if(inputFilename.empty()) {
+		std::cerr<<"You need to provide an input file (-if flag)"<<std::endl;
+		return 1;
+	}
+	if(outputFilename.empty()) {
+		outputFilename = "hist_" + inputFilename;
+	}
+	if(nofThreads < 1) {
+		nofThreads = 1;
+	}
 
-		// loop over all previous events
-		for(auto it : lastEvents) {
-			if(it.first == event->Channel()) {
-				// same channel
-				tDiffSame.Fill(it.first, (event->GetTime() - it.second.GetTime())/1e3);
-			} else {
-				// different channel
-				tsDiff.Fill(event->GetTimestamp() - it.second.GetTimestamp());
-				tDiff.Fill((event->GetTime() - it.second.GetTime())/1e3);
-				tDiffZoomVsCharge.Fill(event->Charge(), event->GetTime() - it.second.GetTime());
-				cfdDiffVsTsDiff.Fill(event->GetTimestamp() - it.second.GetTimestamp(), (event->Cfd() - it.second.Cfd())/512.);
+	CaenHistogramEngine engine;
+	try {
+		if(definitionFilename.empty()) {
+			for(const auto& definition : CaenHistogramEngine::DefaultDefinitions()) {
+				engine.Add(definition);
 			}
+		} else {
+			engine.Read(definitionFilename);
 		}
+	} catch(const std::runtime_error& e) {
+		std::cerr<<e.what()<<std::endl;
+		return 1;
+	}
 
-		channelVsCharge.Fill(event->Charge(), event->Channel());
-		channelVsShortGate.Fill(event->ShortGate(), event->Channel());
-		if(event->Channel() == 0) psdVsCharge.Fill(event->Charge(), static_cast<double>(event->ShortGate())/static_cast<double>(event->Charge()));
+	// each thread reads the input file on its own
+	ROOT::EnableThreadSafety();
+	// the histograms are read, added up, and written explicitly
+	TH1::AddDirectory(false);
 
-		// update last event of this channel to current event
-		lastEvents[event->Channel()] = *event;
+	Long64_t entriesDone = 0;
+	LastHits lastHits;
+	for(auto& lastHit : lastHits) {
+		lastHit.fValid = false;
+	}
+	std::unique_ptr<CaenHistogramFiller> histograms(new CaenHistogramFiller(engine));
 
-		if(i%1000 == 0) {
-			std::cout<<std::setw(3)<<(100*i)/tree->GetEntries()<<" % done\r"<<std::flush;
+	if((incremental || follow) && std::ifstream(outputFilename).good()) {
+		TFile previous(outputFilename.c_str());
+		if(previous.IsOpen() && ReadCheckpoint(previous, entriesDone, lastHits) && histograms->Load(&previous)) {
+			std::cout<<"Continuing after "<<entriesDone<<" entries from the checkpoint in \""<<outputFilename<<"\""<<std::endl;
+		} else {
+			std::cerr<<"\""<<outputFilename<<"\" has no checkpoint, or histograms that don't match the definitions, starting from the first entry"<<std::endl;
+			entriesDone = 0;
+			for(auto& lastHit : lastHits) {
+				lastHit.fValid = false;
+			}
 		}
 	}
-	std::cout<<"100 % done"<<std::endl;
-
-	input.Close();
 
-	tsDiff.Write();
-	tDiff.Write();
-	tDiffZoomVsCharge.Write();
-	cfdDiffVsTsDiff.Write();
-	tDiffSame.Write();
-	channelVsCharge.Write();
-	channelVsShortGate.Write();
-	psdVsCharge.Write();
+	if(follow) {
+		// finish the current update before stopping
+		struct sigaction action;
+		action.sa_handler = HandleSignal;
+		action.sa_flags = 0;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGINT, &action, nullptr);
+		sigaction(SIGTERM, &action, nullptr);
+	}
 
-	output.Close();
+	bool written = false;
+	do {
+		// in follow mode this only sees the entries saved by the last AutoSave of the writer (see TreeSaveInterval)
+		Long64_t nofEntries = NofEntries(inputFilename);
+		if(nofEntries < 0 && !follow) {
+			return 1;
+		}
+		if(nofEntries >= 0 && nofEntries < entriesDone) {
+			std::cerr<<"\""<<inputFilename<<"\" has "<<nofEntries<<" entries, less than the "<<entriesDone<<" already filled, starting from the first entry"<<std::endl;
+			entriesDone = 0;
+			for(auto& lastHit : lastHits) {
+				lastHit.fValid = false;
+			}
+			histograms.reset(new CaenHistogramFiller(engine));
+		}
+		if(nofEntries > entriesDone || (nofEntries >= 0 && !written)) {
+			std::cout<<"Filling entries "<<entriesDone<<" to "<<nofEntries<<std::endl;
+			FillEntries(inputFilename, entriesDone, nofEntries, nofThreads, engine, lastHits, *histograms);
+			entriesDone = nofEntries;
+			if(!WriteOutput(outputFilename, *histograms, entriesDone, lastHits) && !follow) {
+				return 1;
+			}
+			written = true;
+		}
+		if(follow) {
+			for(double waited = 0.; waited < interval && interrupted == 0; waited += 0.1) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			}
+		}
+	} while(follow && interrupted == 0);
 
 	return 0;
 }
@@ -1,18 +1,31 @@
 #include <iostream>
 #include <iomanip>
-#include <fstream>
+#include <stdexcept>
+#include <algorithm>
 #include <vector>
 #include <string>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <sys/resource.h>
 
 #include "CAENDigitizer.h"
 
+#include "TROOT.h"
 #include "TFile.h"
 #include "TTree.h"
 #include "TH1.h"
 #include "TH2.h"
 
 #include "CaenEvent.hh"
-#include "CaenParser.hh"
+#include "CaenStreamParser.hh"
+#include "CaenRawReader.hh"
+#include "CaenHitColumns.hh"
+#include "CaenFlatTree.hh"
+#include "CommandLineInterface.hh"
 
 std::string format(const std::string& format, ...)
 {
@@ -27,43 +40,259 @@ std::string format(const std::string& format, ...)
 	return &vec[0];
 }
 
+// bytes of raw data per task, large enough to keep the overhead per task small, and small enough to keep the memory
+// needed for the hits of all tasks in flight (three per thread) small
+const uint64_t kTaskSize = 4*1024*1024;
+
+// One unit of work for the parsing threads: a range of blocks of a framed file, or complete board aggregates copied
+// from an unframed file. Tasks are numbered in the order of the data, so the hits can be written in that order no
+// matter which thread parsed them.
+struct Task {
+	size_t fIndex;
+	CaenRawReader* fReader; // nullptr for unframed data
+	size_t fFirstBlock;
+	size_t fLastBlock;
+	std::vector<char> fData;
+	uint64_t fBytes;        // size of the input data
+	CaenHitColumns fHits;
+};
+
+// everything the threads share, guarded by fMutex
+struct TaskQueue {
+	std::mutex fMutex;
+	std::condition_variable fTodoCondition; // new task in fTodo or fProducing reset
+	std::condition_variable fDoneCondition; // new task in fDone or fProducing reset
+	std::condition_variable fFreeCondition; // new task in fFree
+	std::deque<Task*> fTodo;
+	std::map<size_t, Task*> fDone;
+	std::vector<Task*> fFree;
+	size_t fNofTasks;
+	bool fProducing;
+
+	TaskQueue() : fNofTasks(0), fProducing(true) {}
+
+	Task* GetFree()
+	{
+		std::unique_lock<std::mutex> lock(fMutex);
+		fFreeCondition.wait(lock, [this] { return !fFree.empty(); });
+		Task* task = fFree.back();
+		fFree.pop_back();
+		return task;
+	}
+
+	void Add(Task* task)
+	{
+		std::lock_guard<std::mutex> lock(fMutex);
+		task->fIndex = fNofTasks++;
+		fTodo.push_back(task);
+		fTodoCondition.notify_one();
+	}
+};
+
+// returns the position after the last complete board aggregate in the data
+// headers that are too large for a board are skipped like the parser does, so a corrupted header doesn't make
+// everything after it wait for the end of an aggregate that never comes
+size_t LastAggregateEnd(const std::vector<char>& data)
+{
+	const uint32_t* word = reinterpret_cast<const uint32_t*>(data.data());
+	size_t nofWords = data.size()/4;
+	size_t pos = 0;
+	size_t end = 0;
+	while(pos < nofWords) {
+		size_t numWords = word[pos]&0xfffffff;
+		if((word[pos]>>28) != 0xa || numWords < 4 || numWords > kMaxBoardAggregateWords) {
+			// padding or garbage, the parser skips it
+			end = ++pos;
+			continue;
+		}
+		if(pos + numWords > nofWords) {
+			break;
+		}
+		pos += numWords;
+		end = pos;
+	}
+	return 4*end;
+}
+
+// splits the input files into tasks of about taskSize bytes, consecutive blocks of framed files, or complete board
+// aggregates of unframed files
+void Produce(std::vector<CaenRawReader*>& readers, uint64_t taskSize, TaskQueue& queue)
+{
+	for(auto reader : readers) {
+		if(!reader->IsLegacy()) {
+			size_t first = 0;
+			while(first < reader->NofBlocks()) {
+				Task* task = queue.GetFree();
+				task->fReader = reader;
+				task->fFirstBlock = first;
+				task->fBytes = 0;
+				while(first < reader->NofBlocks() && task->fBytes < taskSize) {
+					task->fBytes += reader->Block(first++).fSize;
+				}
+				task->fLastBlock = first;
+				queue.Add(task);
+			}
+			continue;
+		}
+		// board aggregates of unframed files are split between the chunks, so the chunks are read in order and
+		// everything after the last complete board aggregate is carried over to the next task (at most one board
+		// aggregate, see kMaxBoardAggregateWords)
+		RawBlockView view;
+		RawBlock buffer;
+		std::vector<char> carry;
+		while(reader->Next(view, buffer)) {
+			for(size_t pos = 0; pos < view.fSize; pos += taskSize) {
+				size_t size = std::min<size_t>(taskSize, view.fSize - pos);
+				Task* task = queue.GetFree();
+				task->fReader = nullptr;
+				task->fData.assign(carry.begin(), carry.end());
+				task->fData.insert(task->fData.end(), view.fData + pos, view.fData + pos + size);
+				size_t end = LastAggregateEnd(task->fData);
+				carry.assign(task->fData.begin() + end, task->fData.end());
+				task->fData.resize(end);
+				task->fBytes = size;
+				queue.Add(task);
+			}
+		}
+		if(!carry.empty()) {
+			// incomplete board aggregate at the end of the file, the parser will complain about it
+			Task* task = queue.GetFree();
+			task->fReader = nullptr;
+			task->fData.swap(carry);
+			task->fBytes = 0;
+			queue.Add(task);
+		}
+	}
+	std::lock_guard<std::mutex> lock(queue.fMutex);
+	queue.fProducing = false;
+	queue.fTodoCondition.notify_all();
+	queue.fDoneCondition.notify_all();
+}
+
+// parses tasks and fills this thread's histograms until there are no more tasks
+void Parse(TaskQueue& queue, TH1* channels, TH2* charge, size_t& errors, size_t& skippedWords, int debug)
+{
+	RawBlockView view;
+	RawBlock buffer;
+	while(true) {
+		Task* task;
+		{
+			std::unique_lock<std::mutex> lock(queue.fMutex);
+			queue.fTodoCondition.wait(lock, [&queue] { return !queue.fTodo.empty() || !queue.fProducing; });
+			if(queue.fTodo.empty()) {
+				return;
+			}
+			task = queue.fTodo.front();
+			queue.fTodo.pop_front();
+		}
+
+		task->fHits.Clear();
+		CaenStreamParser<CaenHitColumns> parser(task->fHits, debug);
+		if(task->fReader != nullptr) {
+			// each framed block is a complete readout
+			for(size_t b = task->fFirstBlock; b < task->fLastBlock; ++b) {
+				if(task->fReader->ViewBlock(b, view, buffer)) {
+					task->fHits.SetBoard(view.fBoard);
+					parser.Feed(view.fData, view.fSize);
+					parser.Finish();
+				}
+			}
+			task->fReader->Release(task->fFirstBlock, task->fLastBlock);
+		} else {
+			// unframed files don't know which board the data came from
+			task->fHits.SetBoard(0);
+			parser.Feed(task->fData.data(), task->fData.size());
+			parser.Finish();
+		}
+		errors += parser.Errors();
+		skippedWords += parser.SkippedWords();
+
+		CaenHitColumns& hits = task->fHits;
+		for(size_t i = 0; i < hits.Size(); ++i) {
+			channels->Fill(hits.fChannel[i]);
+			charge->Fill(hits.fCharge[i], hits.fChannel[i]);
+		}
+		if(debug > 3) {
+			std::cout<<"got "<<hits.Size()<<" events from task "<<task->fIndex<<std::endl;
+		}
+
+		std::lock_guard<std::mutex> lock(queue.fMutex);
+		queue.fDone[task->fIndex] = task;
+		queue.fDoneCondition.notify_one();
+	}
+}
+
 int main(int argc, char** argv) {
-	if(argc != 3 && argc != 4) {
-		std::cerr<<"Usage: "<<argv[0]<<" <input midas file> <output root file> <optional debug level>"<<std::endl;
+	// the histograms are filled from several threads
+	ROOT::EnableThreadSafety();
+
+	CommandLineInterface interface;
+	std::vector<std::string> inputFilenames;
+	interface.Add("-if", "input raw data files (required), converted in this order", &inputFilenames);
+	std::string outputFilename;
+	interface.Add("-of", "output root file (required)", &outputFilename);
+	int nofThreads = std::thread::hardware_concurrency();
+	interface.Add("-j", "number of threads parsing the data (default is the number of cores)", &nofThreads);
+	bool events = false;
+	interface.Add("-events", "write one branch of CaenEvents instead of the flat tree with one branch per member of the hits (see CaenFlatTree), readers of it always read the traces as well", &events);
+	bool flatFlag = false;
+	interface.Add("-flat", "write the flat tree (the default now, only kept for old scripts)", &flatFlag);
+	bool noWaveforms = false;
+	interface.Add("-nw", "don't write the traces to the flat tree", &noWaveforms);
+	int debug = 0;
+	interface.Add("-d", "debug level", &debug);
+
+	interface.CheckFlags(argc, argv);
+	bool flat = !events;
+
+	if(inputFilenames.empty() || outputFilename.empty()) {
+		std::cerr<<"You need to provide at least one input file (-if flag) and an output file (-of flag)"<<std::endl;
 		return 1;
 	}
+	if(nofThreads < 1) {
+		nofThreads = 1;
+	}
 
-	// open input file
-	std::ifstream dataFile(argv[1]);
-	if(!dataFile.is_open()) {
-		std::cerr<<R"(Failed to open ")"<<argv[1]<<R"(" as input data file)"<<std::endl;
-		return 1;
+	// open input files
+	std::vector<CaenRawReader*> readers;
+	uint64_t totalBytes = 0;
+	for(const auto& inputFilename : inputFilenames) {
+		try {
+			readers.push_back(new CaenRawReader(inputFilename, debug > 0));
+		} catch(const std::runtime_error& e) {
+			std::cerr<<e.what()<<std::endl;
+			return 1;
+		}
+		if(readers.back()->IsLegacy()) {
+			std::cout<<"\""<<inputFilename<<"\" is an unframed raw data file, scanning it for board aggregates"<<std::endl;
+		}
+		// the blocks are parsed in place if the file can be mapped
+		if(!readers.back()->Map()) {
+			std::cout<<"Failed to map \""<<inputFilename<<"\", reading it block by block instead"<<std::endl;
+		}
+		totalBytes += readers.back()->FileSize();
 	}
-	dataFile.seekg(0, dataFile.end);
-	size_t fileSize = dataFile.tellg();
-	dataFile.seekg(0, dataFile.beg);
-	char* data = new char[fileSize];
-	dataFile.read(data, fileSize);
-	dataFile.close();
 
 	// open root file
-	auto output = new TFile(argv[2], "recreate");
+	auto output = new TFile(outputFilename.c_str(), "recreate");
 	if(output == nullptr || !output->IsOpen()) {
-		std::cerr<<R"(Failed to open ")"<<argv[2]<<R"(" as output root file)"<<std::endl;
+		std::cerr<<R"(Failed to open ")"<<outputFilename<<R"(" as output root file)"<<std::endl;
 		return 1;
 	}
-
-	int debug = 0;
-	if(argc == 4) {
-		debug = strtol(argv[3], nullptr, 0);
-	}
+	// compress the baskets of the tree in parallel, filling it is the only part that isn't split between threads
+	ROOT::EnableImplicitMT(nofThreads);
 
 	int nofChannels = 8;
 
 	// create tree and histograms
 	TTree* tree = new TTree("tree", "tree");
 	auto caenEvent = new CaenEvent;
-	tree->Branch("event", &caenEvent);
+	CaenFlatTree flatTree;
+	if(flat) {
+		flatTree.Branch(tree, !noWaveforms);
+	} else {
+		tree->Branch("event", &caenEvent);
+	}
 
 	auto list = new TList;
 	auto channels = new TH1F("channels", "channel number", nofChannels+1, 0, nofChannels+1); list->Add(channels);
@@ -74,47 +303,101 @@ int main(int argc, char** argv) {
 		list->Print();
 	}
 
-	// read from data buffer
-	uint32_t* word = reinterpret_cast<uint32_t*>(data);
-	size_t pos = 0;
-	int i = 0;
-	while(pos < fileSize/4) {
-		// check that we have the next header, otherwise advance until we find it
-		while((word[pos]>>28) != 0xa) {
-			std::cout<<"0x"<<std::hex<<word[pos]<<std::dec<<": not a header, skipping"<<std::endl;
-			++pos;
-		}
-		// read data size (in 32-bit words) from header
-		int32_t numWords = word[pos]&0xfffffff;
-		std::vector<CaenEvent*> caenEvents = ParseData(reinterpret_cast<char*>(word + pos), numWords, debug);
-		if(debug > 3) {
-			std::cout<<"got "<<caenEvents.size()<<" events from this midas event"<<std::endl;
+	// each thread fills its own copy of the histograms, they are added up at the end
+	std::vector<TH1*> threadChannels;
+	std::vector<TH2*> threadCharge;
+	for(int t = 0; t < nofThreads; ++t) {
+		threadChannels.push_back(static_cast<TH1*>(channels->Clone(format("channels_%d", t).c_str())));
+		threadChannels.back()->SetDirectory(nullptr);
+		threadCharge.push_back(static_cast<TH2*>(charge->Clone(format("channelVsCharge_%d", t).c_str())));
+		threadCharge.back()->SetDirectory(nullptr);
+	}
+
+	// enough tasks that all threads are busy while the oldest task waits to be written
+	TaskQueue queue;
+	std::vector<Task> tasks(3*nofThreads);
+	for(auto& task : tasks) {
+		queue.fFree.push_back(&task);
+	}
+	std::vector<size_t> errors(nofThreads, 0);
+	std::vector<size_t> skippedWords(nofThreads, 0);
+
+	std::thread producer(Produce, std::ref(readers), kTaskSize, std::ref(queue));
+	std::vector<std::thread> parsers;
+	for(int t = 0; t < nofThreads; ++t) {
+		parsers.emplace_back(Parse, std::ref(queue), threadChannels[t], threadCharge[t], std::ref(errors[t]), std::ref(skippedWords[t]), debug);
+	}
+
+	// fill the tree with the hits of the tasks in their original order
+	uint64_t bytesDone = 0;
+	for(size_t next = 0; ; ++next) {
+		Task* task;
+		{
+			std::unique_lock<std::mutex> lock(queue.fMutex);
+			queue.fDoneCondition.wait(lock, [&queue, next] { return queue.fDone.count(next) == 1 || (!queue.fProducing && next == queue.fNofTasks); });
+			if(queue.fDone.count(next) == 0) {
+				break;
+			}
+			task = queue.fDone[next];
+			queue.fDone.erase(next);
 		}
-		for(auto ev : caenEvents) {
-			*caenEvent = *ev;
-			tree->Fill();
-			channels->Fill(ev->Channel());
-			charge->Fill(ev->Charge(), ev->Channel());
+		CaenHitColumns& hits = task->fHits;
+		for(size_t i = 0; i < hits.Size(); ++i) {
+			if(flat) {
+				flatTree.Set(hits, i);
+				flatTree.Fill();
+			} else {
+				hits.Fill(i, *caenEvent);
+				tree->Fill();
+			}
 			if(debug > 4) {
-				std::cout<<"Charge "<<caenEvent->Charge()<<std::endl;
+				std::cout<<"Charge "<<hits.fCharge[i]<<std::endl;
 			}
-			delete ev;
 		}
 		if(debug > 3) {
 			std::cout<<"have "<<tree->GetEntries()<<" entries total"<<std::endl;
 		}
-		pos += numWords;
-		if(i%10 == 0) {
-			// pos count in 32bit = 4 bytes words; *4/1024 = /256
-			std::cout<<pos/256<<" kiB/"<<fileSize/1024<<" kiB = "<<(400*pos)/fileSize<<" % done\r"<<std::flush;
+		bytesDone += task->fBytes;
+		if(next%10 == 0) {
+			std::cout<<bytesDone/1000000<<"/"<<totalBytes/1000000<<" MB = "<<(totalBytes > 0 ? (100*bytesDone)/totalBytes : 100)<<" % done\r"<<std::flush;
 		}
-		++i;
-	} // end of event loop
-	std::cout<<pos/256<<" kiB/"<<fileSize/1024<<" kiB = "<<(400*pos)/fileSize<<" % done"<<std::endl;
+		{
+			std::lock_guard<std::mutex> lock(queue.fMutex);
+			queue.fFree.push_back(task);
+			queue.fFreeCondition.notify_one();
+		}
+	}
+	producer.join();
+	for(auto& parser : parsers) {
+		parser.join();
+	}
+	std::cout<<bytesDone/1000000<<"/"<<totalBytes/1000000<<" MB = 100 % done"<<std::endl;
+
+	size_t totalErrors = 0;
+	size_t totalSkipped = 0;
+	for(int t = 0; t < nofThreads; ++t) {
+		channels->Add(threadChannels[t]);
+		charge->Add(threadCharge[t]);
+		delete threadChannels[t];
+		delete threadCharge[t];
+		totalErrors += errors[t];
+		totalSkipped += skippedWords[t];
+	}
+	if(totalErrors > 0 || totalSkipped > 0) {
+		std::cout<<totalErrors<<" corrupted board aggregates, skipped "<<totalSkipped<<" words"<<std::endl;
+	}
 
 	tree->Write();
 	list->Write();
 	output->Close();
+	for(auto reader : readers) {
+		delete reader;
+	}
+
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF, &usage) == 0) {
+		std::cout<<"peak resident memory "<<usage.ru_maxrss/1024.<<" MB"<<std::endl;
+	}
 
 	return 0;
 }
@@ -0,0 +1,64 @@
+#ifndef RINGBUFFER_HH
+#define RINGBUFFER_HH
+#include <vector>
+#include <atomic>
+#include <cstddef>
+
+// Lock-free single producer/single consumer ring buffer.
+// Exactly one thread may call Push and exactly one (other) thread may call Pop.
+// The capacity is rounded up to the next power of two.
+template<class T>
+class RingBuffer {
+public:
+	explicit RingBuffer(size_t capacity)
+		: fHead(0), fTail(0)
+	{
+		size_t size = 1;
+		while(size < capacity) size <<= 1;
+		fData.resize(size);
+		fMask = size - 1;
+	}
+
+	// returns false if the ring is full, in which case value is not added
+	bool Push(const T& value)
+	{
+		size_t tail = fTail.load(std::memory_order_relaxed);
+		if(tail - fHead.load(std::memory_order_acquire) > fMask) {
+			return false;
+		}
+		fData[tail & fMask] = value;
+		fTail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// returns false if the ring is empty, in which case value is unchanged
+	bool Pop(T& value)
+	{
+		size_t head = fHead.load(std::memory_order_relaxed);
+		if(head == fTail.load(std::memory_order_acquire)) {
+			return false;
+		}
+		value = fData[head & fMask];
+		fHead.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	// only approximate if called while the other thread is active
+	size_t Size() const { return fTail.load(std::memory_order_acquire) - fHead.load(std::memory_order_acquire); }
+	bool Empty() const { return Size() == 0; }
+	size_t Capacity() const { return fMask + 1; }
+
+private:
+	RingBuffer(const RingBuffer&) = delete;
+	RingBuffer& operator=(const RingBuffer&) = delete;
+
+	std::vector<T> fData;
+	size_t fMask;
+	// head and tail are written by different threads, keep them on separate cache lines
+	char fPad0[64];
+	std::atomic<size_t> fHead; // next element to be read, only written by the consumer
+	char fPad1[64];
+	std::atomic<size_t> fTail; // next element to be written, only written by the producer
+	char fPad2[64];
+};
+#endif
@@ -1,2 +1,2 @@
 #pragma link C++ class CaenSettings+;
-#pragma link C++ class CaenEvent+;
+#pragma link C++ class CaenEvent-;